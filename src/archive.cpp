@@ -0,0 +1,390 @@
+#include "archive.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+
+static_assert ((int)VTUWriter::typeUInt8 == archiveUInt8 && (int)VTUWriter::typeFloat32 == archiveFloat32,
+               "archive types must match VTUWriter ones");
+
+
+// cell arrays which are part of topology
+static const char* topology_arrays[] = { "PartID", "ElementType" };
+
+
+static bool isTopologyArray (const VTUWriter::array_t& a)
+{
+    for (unsigned int i = 0; i < sizeof (topology_arrays) / sizeof (topology_arrays[0]); i++)
+        if (a.name == topology_arrays[i])
+            return true;
+    return false;
+}
+
+
+
+// Filters are chosen by compressed size of sample of array, made of
+// a few slices long enough for codec to find its matches
+#define SAMPLE_SLICES 2
+#define SAMPLE_SLICE  16384 // words
+
+
+static void sampleWords (const std::vector<uint32_t>& words, std::vector<uint32_t>& sample)
+{
+    size_t slice = std::min (words.size () / SAMPLE_SLICES, (size_t)SAMPLE_SLICE);
+
+    sample.clear ();
+    if (!slice) {
+        sample = words;
+        return;
+    }
+
+    for (size_t i = 0; i < SAMPLE_SLICES; i++) {
+        size_t from = words.size () / SAMPLE_SLICES * i + (words.size () / SAMPLE_SLICES - slice) / 2;
+
+        sample.insert (sample.end (), words.begin () + from, words.begin () + from + slice);
+    }
+}
+
+
+// slices of sample are compressed separately, as blocks are
+static size_t sampleBytes (int codec, int level, const std::vector<uint32_t>& sample, bool shuffle)
+{
+    size_t res = 0;
+
+    for (size_t from = 0; from < sample.size (); from += SAMPLE_SLICE) {
+        size_t size = std::min (sample.size () - from, (size_t)SAMPLE_SLICE) * sizeof (uint32_t);
+        std::vector<char> planes (size), packed (compressBound (codec, size));
+        const void* src = &sample[from];
+
+        if (shuffle) {
+            shuffleBytes (src, size, sizeof (uint32_t), &planes[0]);
+            src = &planes[0];
+        }
+
+        size_t n = compressBlock (codec, level, src, size, &packed[0], packed.size ());
+
+        res += n ? n : packed.size ();
+    }
+
+    return res;
+}
+
+
+
+// --------------------------------------------------
+// ArchiveWriter
+// --------------------------------------------------
+ArchiveWriter::ArchiveWriter ()
+    : _f (0),
+      _pos (0),
+      _codec (codecNone),
+      _level (0),
+      _pool (0),
+      _keyframes (0)
+{
+}
+
+
+ArchiveWriter::~ArchiveWriter ()
+{
+    close ();
+}
+
+
+bool ArchiveWriter::open (const char* fileName)
+{
+    close ();
+
+    _f = fopen (fileName, "wb");
+    if (!_f)
+        return false;
+
+    setvbuf (_f, 0, _IOFBF, 1024*1024);
+
+    archive_header_t hdr;
+
+    memset (&hdr, 0, sizeof (hdr));
+    memcpy (hdr.magic, ARCHIVE_MAGIC, sizeof (ARCHIVE_MAGIC) - 1);
+    hdr.version = ARCHIVE_VERSION;
+
+    _pos = 0;
+    _index.clear ();
+    _key.clear ();
+    _revision.clear ();
+    _lastState.clear ();
+    _sinceKeyframe.clear ();
+    _last.clear ();
+
+    if (fwrite (&hdr, sizeof (hdr), 1, _f) != 1)
+        return false;
+    _pos += sizeof (hdr);
+
+    return pad ();
+}
+
+
+bool ArchiveWriter::close ()
+{
+    if (!_f)
+        return true;
+
+    // index goes after the last block, footer ends the file
+    archive_footer_t footer;
+    bool ok = pad ();
+
+    memset (&footer, 0, sizeof (footer));
+    footer.offset = _pos;
+    footer.entries = _index.size ();
+    memcpy (footer.magic, ARCHIVE_INDEX_MAGIC, sizeof (footer.magic));
+
+    if (ok && !_index.empty ())
+        ok = fwrite (&_index[0], sizeof (archive_entry_t), _index.size (), _f) == _index.size ();
+    if (ok)
+        ok = fwrite (&footer, sizeof (footer), 1, _f) == 1;
+
+    ok = (fclose (_f) == 0) && ok;
+    _f = 0;
+    _index.clear ();
+
+    return ok;
+}
+
+
+bool ArchiveWriter::pad ()
+{
+    static const char zeros[ARCHIVE_ALIGN] = { 0 };
+    size_t n = archiveAlign (_pos) - _pos;
+
+    _pos += n;
+    return !n || fwrite (zeros, 1, n, _f) == n;
+}
+
+
+void ArchiveWriter::setCompression (int codec, int level, ThreadPool* pool)
+{
+    _codec = codec;
+    _level = level;
+    _pool = pool;
+}
+
+
+bool ArchiveWriter::writeBlock (archive_block_kind_t kind, unsigned int grid, unsigned int revision,
+                                int state, float time, const std::vector<const VTUWriter::array_t*>& arrays,
+                                const std::vector<unsigned int>* filters, int reference)
+{
+    std::vector<VTUWriter::packed_t> packed;
+    std::vector<unsigned int> shuffle (arrays.size (), 0);
+    size_t i;
+
+    // codes of quantized arrays are stored, not values they expand to
+    std::vector<const VTUWriter::array_t*> stored (arrays);
+    std::vector<VTUWriter::array_t> codes (arrays.size ());
+
+    for (i = 0; i < arrays.size (); i++)
+        if (arrays[i]->quant.bits) {
+            codes[i] = *arrays[i];
+            codes[i].type = VTUWriter::typeUInt8;
+            codes[i].components *= arrays[i]->quant.bits / 8;
+            codes[i].quant.bits = 0;
+            stored[i] = &codes[i];
+        }
+
+    // both filters shuffle words, so they need compressed blocks
+    if (filters)
+        for (i = 0; i < arrays.size (); i++)
+            if ((*filters)[i] != filterNone)
+                shuffle[i] = 4;
+
+    if (_codec != codecNone &&
+        !VTUWriter::packArrays (stored, _codec, _level, _pool, packed, filters ? &shuffle : 0))
+        return false;
+
+    archive_block_t blk;
+    std::vector<archive_array_t> hdrs (arrays.size ());
+
+    memset (&blk, 0, sizeof (blk));
+    memcpy (blk.magic, ARCHIVE_BLOCK_MAGIC, sizeof (blk.magic));
+    blk.kind = kind;
+    blk.grid = grid;
+    blk.revision = revision;
+    blk.state = state;
+    blk.time = time;
+    blk.arrays = arrays.size ();
+
+    // data of every array starts aligned after the headers
+    uint64_t pos = archiveAlign (_pos + sizeof (blk) + hdrs.size () * sizeof (archive_array_t));
+
+    for (i = 0; i < arrays.size (); i++) {
+        const VTUWriter::array_t& a = *arrays[i];
+        archive_array_t& hdr = hdrs[i];
+
+        memset (&hdr, 0, sizeof (hdr));
+        strncpy (hdr.name, a.name.c_str (), sizeof (hdr.name) - 1);
+        hdr.type = a.type;
+        hdr.components = a.components;
+        hdr.tuples = a.tuples;
+
+        if (a.quant.bits) {
+            hdr.quantized = a.quant.bits;
+            hdr.scale = a.quant.scale;
+            hdr.origin = a.quant.offset;
+        }
+
+        if (packed.empty ()) {
+            hdr.codec = codecNone;
+            hdr.bytes = VTUWriter::arrayBytes (*stored[i]);
+        }
+        else {
+            hdr.codec = _codec;
+            hdr.bytes = VTUWriter::packedBytes (packed[i], true);
+            hdr.filter = shuffle[i] ? (*filters)[i] : (unsigned int)filterNone;
+            if (hdr.filter == filterXorPrevious)
+                hdr.reference = reference;
+        }
+
+        hdr.offset = pos;
+        pos = archiveAlign (pos + hdr.bytes);
+    }
+
+    blk.size = pos - _pos;
+
+    if (fwrite (&blk, sizeof (blk), 1, _f) != 1)
+        return false;
+    if (!hdrs.empty () && fwrite (&hdrs[0], sizeof (archive_array_t), hdrs.size (), _f) != hdrs.size ())
+        return false;
+    _pos += sizeof (blk) + hdrs.size () * sizeof (archive_array_t);
+
+    for (i = 0; i < arrays.size (); i++) {
+        if (!pad ())
+            return false;
+        if (packed.empty () ? !VTUWriter::writeValues (_f, *stored[i]) : !VTUWriter::writePacked (_f, packed[i], true))
+            return false;
+        _pos += hdrs[i].bytes;
+
+        archive_entry_t e;
+
+        memset (&e, 0, sizeof (e));
+        e.kind = kind;
+        e.grid = grid;
+        e.revision = revision;
+        e.state = state;
+        e.time = time;
+        e.array = hdrs[i];
+        _index.push_back (e);
+    }
+
+    return pad ();
+}
+
+
+bool ArchiveWriter::writeGrid (unsigned int grid, uint64_t topologyKey, int state, float time,
+                               const VTUWriter& vtu)
+{
+    if (!_f)
+        return false;
+
+    std::vector<const VTUWriter::array_t*> topo, values;
+    size_t i;
+
+    topo.push_back (&vtu.connectivity ());
+    topo.push_back (&vtu.offsets ());
+    topo.push_back (&vtu.types ());
+
+    values.push_back (&vtu.points ());
+
+    for (i = 0; i < vtu.cellData ().size (); i++)
+        if (isTopologyArray (vtu.cellData ()[i]))
+            topo.push_back (&vtu.cellData ()[i]);
+        else
+            values.push_back (&vtu.cellData ()[i]);
+
+    for (i = 0; i < vtu.pointData ().size (); i++)
+        values.push_back (&vtu.pointData ()[i]);
+
+    if (grid >= _key.size ()) {
+        _key.resize (grid + 1, 0);
+        _revision.resize (grid + 1, -1);
+        _lastState.resize (grid + 1, 0);
+        _sinceKeyframe.resize (grid + 1, 0);
+        _last.resize (grid + 1);
+    }
+
+    bool keyframe = true;
+
+    if (_revision[grid] < 0 || _key[grid] != topologyKey) {
+        _revision[grid]++;
+        if (!writeBlock (blockTopology, grid, _revision[grid], state, time, topo))
+            return false;
+        _key[grid] = topologyKey;
+
+        // values of other topology are of no use
+        _last[grid].clear ();
+    }
+    else
+        keyframe = _sinceKeyframe[grid] + 1 >= _keyframes;
+
+    if (!_keyframes || _codec == codecNone)
+        return writeBlock (blockState, grid, _revision[grid], state, time, values);
+
+    // Float arrays of the same size as in the last state block of grid
+    // may be XORed with it, values of this one are kept for the next.
+    // Slowly changing values leave mostly zero high bytes, fast ones
+    // may compress better as they are, so the smallest sample wins.
+    // Only float arrays stored whole are kept, so every kept array is
+    // of state _lastState[grid], the one XORed arrays refer to.
+    std::vector<unsigned int> filters (values.size (), filterNone);
+    std::vector<VTUWriter::array_t> xored (values.size ());
+    std::vector<std::vector<uint32_t> > words (values.size ());
+    std::vector<uint32_t> sample;
+    std::map<std::string, std::vector<uint32_t> > kept;
+
+    for (i = 0; i < values.size (); i++) {
+        const VTUWriter::array_t& a = *values[i];
+
+        if (a.type != VTUWriter::typeFloat32 || a.quant.bits)
+            continue;
+
+        std::map<std::string, std::vector<uint32_t> >::const_iterator it = _last[grid].find (a.name);
+        const std::vector<uint32_t>* last = it != _last[grid].end () ? &it->second : 0;
+        std::vector<uint32_t> current (a.tuples * a.components);
+
+        if (!current.empty ())
+            VTUWriter::gather (a, 0, current.size () * sizeof (uint32_t), (char*)&current[0]);
+
+        sampleWords (current, sample);
+
+        size_t plain = sampleBytes (_codec, _level, sample, false);
+        size_t best = sampleBytes (_codec, _level, sample, true);
+
+        filters[i] = best < plain ? filterShuffle : filterNone;
+        best = std::min (best, plain);
+
+        if (!keyframe && last && last->size () == current.size ()) {
+            words[i].resize (current.size ());
+            for (size_t j = 0; j < current.size (); j++)
+                words[i][j] = current[j] ^ (*last)[j];
+
+            sampleWords (words[i], sample);
+            if (sampleBytes (_codec, _level, sample, true) < best) {
+                xored[i] = a;
+                xored[i].data = words[i].empty () ? 0 : (const char*)&words[i][0];
+                xored[i].index = 0;
+                values[i] = &xored[i];
+                filters[i] = filterXorPrevious;
+            }
+        }
+
+        kept[a.name].swap (current);
+    }
+
+    if (!writeBlock (blockState, grid, _revision[grid], state, time, values, &filters, _lastState[grid]))
+        return false;
+
+    _last[grid].swap (kept);
+
+    _sinceKeyframe[grid] = keyframe ? 0 : _sinceKeyframe[grid] + 1;
+    _lastState[grid] = state;
+
+    return true;
+}
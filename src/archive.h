@@ -0,0 +1,78 @@
+//
+// Writer of states container (<base>.d2l), see archive_format.h
+//
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "archive_format.h"
+#include "vtuwriter.h"
+
+
+class ArchiveWriter
+{
+private:
+    FILE* _f;
+    uint64_t _pos;
+    std::vector<archive_entry_t> _index;
+
+    // per grid: key of the last topology written and its revision,
+    // -1 until grid is written
+    std::vector<uint64_t> _key;
+    std::vector<long long> _revision;
+
+    int _codec, _level;
+    ThreadPool* _pool;
+
+    // temporal filter: keyframe interval (0 if off), and per grid state
+    // of the last state block, blocks since keyframe and values of its
+    // float arrays
+    unsigned int _keyframes;
+    std::vector<int> _lastState;
+    std::vector<unsigned int> _sinceKeyframe;
+    std::vector<std::map<std::string, std::vector<uint32_t> > > _last;
+
+protected:
+    // zeros up to the next aligned position
+    bool pad ();
+
+    // filters of arrays (archive_filter_t) may be given, reference is
+    // the state XORed arrays refer to
+    bool writeBlock (archive_block_kind_t kind, unsigned int grid, unsigned int revision,
+                     int state, float time, const std::vector<const VTUWriter::array_t*>& arrays,
+                     const std::vector<unsigned int>* filters = 0, int reference = 0);
+
+public:
+    ArchiveWriter ();
+    ~ArchiveWriter ();
+
+    bool open (const char* fileName);
+
+    // writes index and footer, false if file is incomplete
+    bool close ();
+
+    bool isOpen () const
+        { return _f; };
+
+    // arrays are compressed by codec, blocks in parallel on pool
+    void setCompression (int codec, int level = 0, ThreadPool* pool = 0);
+
+    // Float arrays of states are stored XORed with previous state of
+    // grid, whole every interval states. Needs compression, 0 is off.
+    void setKeyframes (unsigned int interval)
+        { _keyframes = interval; };
+
+    // Writes arrays of grid prepared for VTU output. Topology block is
+    // written only if topology key differs from the last one of this
+    // grid, which starts next revision.
+    bool writeGrid (unsigned int grid, uint64_t topologyKey, int state, float time,
+                    const VTUWriter& vtu);
+};
+
+
+#endif
@@ -0,0 +1,131 @@
+//
+// Layout of the states container (<base>.d2l), shared by ArchiveWriter
+// and ArchiveReader. All values are in byte order of the writer.
+//
+//   header, padded to ARCHIVE_ALIGN
+//   blocks: block header, array headers, padding, then data of every
+//           array starting at ARCHIVE_ALIGN boundary
+//   index:  entry per array of every block, aligned
+//   footer: last bytes of file
+//
+// Topology of a grid is stored once for every topology revision, state
+// blocks carry only the arrays which change: point coordinates and
+// fields. Without footer (writer did not finish) blocks are found by
+// walking block headers.
+//
+// Temporal mode stores float arrays of a state XORed with the same
+// array of the previous state of grid, only keyframes (every N states
+// and new topology) hold them whole. Reading such array walks the
+// chain of references back to the keyframe.
+//
+// Quantized float arrays are stored as 8 or 16 bit codes, readers
+// expand them to origin + code * scale (see quantize.h).
+//
+#ifndef __ARCHIVE_FORMAT_H__
+#define __ARCHIVE_FORMAT_H__
+
+#include <stdint.h>
+
+
+#define ARCHIVE_MAGIC       "D2LARC"
+#define ARCHIVE_BLOCK_MAGIC "D2LB"
+#define ARCHIVE_INDEX_MAGIC "D2LINDEX"
+#define ARCHIVE_VERSION     5
+
+// blocks and arrays data start at multiples of it, so they could be
+// read directly (O_DIRECT, mmap)
+#define ARCHIVE_ALIGN       4096
+
+// readers reject compressed arrays with larger blocks, writers use
+// 256 KB ones
+#define ARCHIVE_MAX_BLOCK   (64*1024*1024)
+
+typedef enum {
+    blockTopology = 1,  // connectivity, offsets, types, PartID, ElementType
+    blockState = 2,     // points and fields
+} archive_block_kind_t;
+
+// Transformation of array values before compression. Bytes of every
+// compressed block are split into planes of 4 byte values (see
+// shuffleBytes) by both filters.
+typedef enum {
+    filterNone = 0,
+    filterShuffle = 1,      // keyframe
+    filterXorPrevious = 2,  // words XORed with array of reference state
+} archive_filter_t;
+
+// value types, same as VTUWriter::value_type_t
+typedef enum {
+    archiveUInt8,
+    archiveInt32,
+    archiveUInt32,
+    archiveFloat32,
+} archive_type_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} archive_header_t;
+
+// block header, followed by headers of its arrays
+typedef struct {
+    char magic[4];
+    uint32_t kind;
+    uint32_t grid;          // grid_kind_t
+    uint32_t revision;      // topology revision block belongs to
+    int32_t state;          // -1 for initial geometry
+    float time;
+    uint32_t arrays;
+    uint32_t reserved;
+    uint64_t size;          // of whole block, next one starts after it
+} archive_block_t;
+
+// Array header. Compressed data starts with VTK-like block header of
+// 64 bit values: number of blocks, uncompressed block size, size of
+// partial last block (0 if it is full), compressed size of each block.
+typedef struct {
+    char name[64];
+    uint32_t type;          // archive_type_t
+    uint32_t components;
+    uint64_t tuples;
+    uint32_t codec;         // codec_t
+    uint32_t filter;        // archive_filter_t
+    uint64_t bytes;         // stored in file
+    uint64_t offset;        // of data in file
+    int32_t reference;      // state of filterXorPrevious
+    uint32_t quantized;     // bits of stored codes, 0 if values are stored
+    double scale;           // quantized value is origin + code * scale
+    double origin;
+} archive_array_t;
+
+// index entry, one per array
+typedef struct {
+    uint32_t kind;
+    uint32_t grid;
+    uint32_t revision;
+    int32_t state;
+    float time;
+    uint32_t reserved;
+    archive_array_t array;
+} archive_entry_t;
+
+typedef struct {
+    uint64_t offset;        // of the first index entry
+    uint64_t entries;
+    char magic[8];
+} archive_footer_t;
+
+
+static inline unsigned int archiveTypeSize (uint32_t type)
+{
+    return type == archiveUInt8 ? 1 : 4;
+}
+
+static inline uint64_t archiveAlign (uint64_t pos)
+{
+    return (pos + ARCHIVE_ALIGN - 1) / ARCHIVE_ALIGN * ARCHIVE_ALIGN;
+}
+
+
+#endif
@@ -0,0 +1,354 @@
+#include "archive_reader.h"
+#include "compress.h"
+
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+// --------------------------------------------------
+// ArchiveReader
+// --------------------------------------------------
+ArchiveReader::ArchiveReader ()
+    : _fd (-1),
+      _fileSize (0)
+{
+}
+
+
+ArchiveReader::~ArchiveReader ()
+{
+    close ();
+}
+
+
+bool ArchiveReader::open (const char* fileName)
+{
+    close ();
+
+    _fd = ::open (fileName, O_RDONLY);
+    if (_fd < 0)
+        return false;
+
+    struct stat st;
+    archive_header_t hdr;
+
+    if (fstat (_fd, &st) || !readAt (&hdr, sizeof (hdr), 0) ||
+        memcmp (hdr.magic, ARCHIVE_MAGIC, sizeof (ARCHIVE_MAGIC) - 1) ||
+        hdr.version != ARCHIVE_VERSION) {
+        close ();
+        return false;
+    }
+
+    _fileSize = st.st_size;
+
+    if (!loadIndex (_fileSize) && !scanBlocks (_fileSize)) {
+        close ();
+        return false;
+    }
+
+    buildMaps ();
+    return true;
+}
+
+
+void ArchiveReader::close ()
+{
+    if (_fd >= 0)
+        ::close (_fd);
+    _fd = -1;
+    _fileSize = 0;
+
+    _entries.clear ();
+    _states.clear ();
+    _times.clear ();
+    _blocks.clear ();
+    _topology.clear ();
+}
+
+
+bool ArchiveReader::readAt (void* dst, size_t size, uint64_t offset) const
+{
+    char* p = (char*)dst;
+
+    while (size) {
+        ssize_t n = pread (_fd, p, size, offset);
+
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+
+bool ArchiveReader::loadIndex (uint64_t fileSize)
+{
+    archive_footer_t footer;
+
+    if (fileSize < ARCHIVE_ALIGN + sizeof (footer) ||
+        !readAt (&footer, sizeof (footer), fileSize - sizeof (footer)) ||
+        memcmp (footer.magic, ARCHIVE_INDEX_MAGIC, sizeof (footer.magic)) ||
+        footer.entries > fileSize / sizeof (archive_entry_t) ||
+        footer.offset + footer.entries * sizeof (archive_entry_t) + sizeof (footer) != fileSize)
+        return false;
+
+    _entries.resize (footer.entries);
+
+    return _entries.empty () ||
+        readAt (&_entries[0], _entries.size () * sizeof (archive_entry_t), footer.offset);
+}
+
+
+bool ArchiveReader::scanBlocks (uint64_t fileSize)
+{
+    uint64_t pos = ARCHIVE_ALIGN;
+
+    _entries.clear ();
+
+    // the last block may be cut short, it is ignored then
+    while (pos + sizeof (archive_block_t) <= fileSize) {
+        archive_block_t blk;
+
+        if (!readAt (&blk, sizeof (blk), pos) ||
+            memcmp (blk.magic, ARCHIVE_BLOCK_MAGIC, sizeof (blk.magic)) ||
+            !blk.size || pos + blk.size > fileSize ||
+            blk.arrays > (blk.size - sizeof (blk)) / sizeof (archive_array_t))
+            break;
+
+        std::vector<archive_array_t> hdrs (blk.arrays);
+
+        if (!hdrs.empty () &&
+            !readAt (&hdrs[0], hdrs.size () * sizeof (archive_array_t), pos + sizeof (blk)))
+            break;
+
+        for (size_t i = 0; i < hdrs.size (); i++) {
+            archive_entry_t e;
+
+            memset (&e, 0, sizeof (e));
+            e.kind = blk.kind;
+            e.grid = blk.grid;
+            e.revision = blk.revision;
+            e.state = blk.state;
+            e.time = blk.time;
+            e.array = hdrs[i];
+            _entries.push_back (e);
+        }
+
+        pos += blk.size;
+    }
+
+    return true;
+}
+
+
+void ArchiveReader::buildMaps ()
+{
+    for (size_t i = 0; i < _entries.size (); i++) {
+        const archive_entry_t& e = _entries[i];
+
+        if (e.kind == blockTopology) {
+            _topology[std::make_pair (e.grid, e.revision)].push_back (i);
+            continue;
+        }
+
+        if (_states.empty () || _states.back () != e.state) {
+            _states.push_back (e.state);
+            _times.push_back (e.time);
+        }
+        _blocks[std::make_pair (e.state, e.grid)].push_back (i);
+    }
+}
+
+
+const archive_entry_t* ArchiveReader::find (int state, unsigned int grid, const char* name) const
+{
+    std::map<std::pair<int, unsigned int>, std::vector<size_t> >::const_iterator b =
+        _blocks.find (std::make_pair (state, grid));
+
+    if (b == _blocks.end ())
+        return 0;
+
+    size_t i;
+
+    for (i = 0; i < b->second.size (); i++)
+        if (!strcmp (_entries[b->second[i]].array.name, name))
+            return &_entries[b->second[i]];
+
+    // state block knows revision of its topology
+    std::map<std::pair<unsigned int, unsigned int>, std::vector<size_t> >::const_iterator t =
+        _topology.find (std::make_pair (grid, _entries[b->second[0]].revision));
+
+    if (t == _topology.end ())
+        return 0;
+
+    for (i = 0; i < t->second.size (); i++)
+        if (!strcmp (_entries[t->second[i]].array.name, name))
+            return &_entries[t->second[i]];
+
+    return 0;
+}
+
+
+std::vector<std::string> ArchiveReader::arrays (int state, unsigned int grid) const
+{
+    std::vector<std::string> res;
+    std::map<std::pair<int, unsigned int>, std::vector<size_t> >::const_iterator b =
+        _blocks.find (std::make_pair (state, grid));
+
+    if (b == _blocks.end ())
+        return res;
+
+    std::map<std::pair<unsigned int, unsigned int>, std::vector<size_t> >::const_iterator t =
+        _topology.find (std::make_pair (grid, _entries[b->second[0]].revision));
+    size_t i;
+
+    if (t != _topology.end ())
+        for (i = 0; i < t->second.size (); i++)
+            res.push_back (_entries[t->second[i]].array.name);
+
+    for (i = 0; i < b->second.size (); i++)
+        res.push_back (_entries[b->second[i]].array.name);
+
+    return res;
+}
+
+
+bool ArchiveReader::read (const archive_entry_t* e, void* dst, uint64_t first, uint64_t count) const
+{
+    const archive_array_t& a = e->array;
+
+    if (first > a.tuples || a.filter > filterXorPrevious)
+        return false;
+    if (count > a.tuples - first)
+        count = a.tuples - first;
+
+    if (!a.quantized) {
+        uint64_t tupleSize = (uint64_t)a.components * archiveTypeSize (a.type);
+
+        return readStored (e, dst, first * tupleSize, (first + count) * tupleSize);
+    }
+
+    // codes are fetched and expanded to floats
+    if (a.type != archiveFloat32 || (a.quantized != 8 && a.quantized != 16) ||
+        a.filter == filterXorPrevious)
+        return false;
+
+    uint64_t values = count * a.components;
+    uint64_t codeSize = a.quantized / 8;
+    std::vector<char> codes (values * codeSize);
+    quantization_t q;
+
+    q.bits = a.quantized;
+    q.scale = a.scale;
+    q.offset = a.origin;
+
+    if (!values)
+        return true;
+    if (!readStored (e, &codes[0], first * a.components * codeSize, (first + count) * a.components * codeSize))
+        return false;
+
+    dequantizeValues (q, &codes[0], values, (float*)dst);
+
+    return true;
+}
+
+
+bool ArchiveReader::readStored (const archive_entry_t* e, void* dst, uint64_t from, uint64_t to) const
+{
+    const archive_array_t& a = e->array;
+
+    if (from == to)
+        return true;
+
+    if (a.codec == codecNone)
+        return a.filter == filterNone && readAt (dst, to - from, a.offset + from);
+
+    // XORed words go over values of reference, which was written before
+    // (so chain of references ends)
+    if (a.filter == filterXorPrevious) {
+        const archive_entry_t* ref = find (a.reference, e->grid, a.name);
+
+        if (!ref || ref->array.offset >= a.offset || ref->array.type != archiveFloat32 ||
+            ref->array.tuples != a.tuples || ref->array.components != a.components ||
+            ref->array.quantized || !readStored (ref, dst, from, to))
+            return false;
+    }
+
+    // block header: count, block size, partial last block size, sizes.
+    // Sizes come from file, they are checked before anything is
+    // allocated by them.
+    uint64_t head[3];
+
+    if (a.bytes < sizeof (head) || a.bytes > _fileSize || a.offset > _fileSize - a.bytes ||
+        !readAt (head, sizeof (head), a.offset) ||
+        !head[1] || head[1] > ARCHIVE_MAX_BLOCK || head[2] > head[1] ||
+        head[0] > (a.bytes - sizeof (head)) / sizeof (uint64_t))
+        return false;
+
+    std::vector<uint64_t> sizes (head[0]);
+
+    if (!sizes.empty () && !readAt (&sizes[0], sizes.size () * sizeof (uint64_t), a.offset + sizeof (head)))
+        return false;
+
+    uint64_t blockSize = head[1];
+    uint64_t firstBlock = from / blockSize;
+    uint64_t lastBlock = (to - 1) / blockSize;
+    uint64_t pos = a.offset + (3 + sizes.size ()) * sizeof (uint64_t);
+    uint64_t rest = a.bytes - (3 + sizes.size ()) * sizeof (uint64_t);
+    uint64_t k;
+
+    if (lastBlock >= sizes.size ())
+        return false;
+
+    // compressed blocks are within stored bytes of array
+    for (k = 0; k < sizes.size (); k++) {
+        if (sizes[k] > rest)
+            return false;
+        rest -= sizes[k];
+    }
+
+    for (k = 0; k < firstBlock; k++)
+        pos += sizes[k];
+
+    std::vector<char> packed, raw (blockSize), planes (a.filter != filterNone ? blockSize : 0);
+    char* out = (char*)dst;
+
+    for (k = firstBlock; k <= lastBlock; k++) {
+        uint64_t rawSize = (k == sizes.size () - 1 && head[2]) ? head[2] : blockSize;
+
+        packed.resize (sizes[k]);
+        if (!readAt (&packed[0], packed.size (), pos) ||
+            !decompressBlock (a.codec, &packed[0], packed.size (), a.filter != filterNone ? &planes[0] : &raw[0], rawSize))
+            return false;
+        pos += sizes[k];
+
+        if (a.filter != filterNone)
+            unshuffleBytes (&planes[0], rawSize, 4, &raw[0]);
+
+        // part of block inside requested range
+        uint64_t start = k * blockSize;
+        uint64_t lo = from > start ? from - start : 0;
+        uint64_t hi = to < start + rawSize ? to - start : rawSize;
+
+        if (a.filter == filterXorPrevious) {
+            // range of float array is made of whole words
+            const uint32_t* words = (const uint32_t*)&raw[lo];
+            uint32_t* values = (uint32_t*)out;
+
+            for (uint64_t i = 0; i < (hi - lo) / 4; i++)
+                values[i] ^= words[i];
+        }
+        else
+            memcpy (out, &raw[lo], hi - lo);
+        out += hi - lo;
+    }
+
+    return true;
+}
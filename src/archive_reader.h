@@ -0,0 +1,85 @@
+//
+// Random access reader of states container (<base>.d2l), see
+// archive_format.h. Index at the end of file is loaded on open, any
+// array of any state, or range of its tuples, is then fetched by a few
+// positioned reads. Neither VTK nor the rest of dyna2lz is needed, only
+// compress.cpp and quantize.cpp.
+//
+#ifndef __ARCHIVE_READER_H__
+#define __ARCHIVE_READER_H__
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "archive_format.h"
+#include "quantize.h"
+
+
+class ArchiveReader
+{
+private:
+    int _fd;
+    uint64_t _fileSize;
+    std::vector<archive_entry_t> _entries;
+
+    // states in order of writing, -1 is initial geometry
+    std::vector<int> _states;
+    std::vector<float> _times;
+
+    // entries of state blocks by (state, grid) and of topology blocks
+    // by (grid, revision)
+    std::map<std::pair<int, unsigned int>, std::vector<size_t> > _blocks;
+    std::map<std::pair<unsigned int, unsigned int>, std::vector<size_t> > _topology;
+
+protected:
+    bool readAt (void* dst, size_t size, uint64_t offset) const;
+
+    // bytes from to to of data as stored, XORed arrays are resolved
+    bool readStored (const archive_entry_t* e, void* dst, uint64_t from, uint64_t to) const;
+
+    bool loadIndex (uint64_t fileSize);
+
+    // walks block headers of file without index
+    bool scanBlocks (uint64_t fileSize);
+
+    void buildMaps ();
+
+public:
+    ArchiveReader ();
+    ~ArchiveReader ();
+
+    bool open (const char* fileName);
+    void close ();
+
+    const std::vector<archive_entry_t>& entries () const
+        { return _entries; };
+
+    size_t statesCount () const
+        { return _states.size (); };
+    int state (size_t i) const
+        { return _states[i]; };
+    float time (size_t i) const
+        { return _times[i]; };
+
+    // Entry of array of grid in state. Topology arrays are taken from
+    // the revision state refers to. 0 if there is no such array.
+    const archive_entry_t* find (int state, unsigned int grid, const char* name) const;
+
+    // names of arrays of grid in state, topology ones included
+    std::vector<std::string> arrays (int state, unsigned int grid) const;
+
+    static uint64_t rawBytes (const archive_entry_t& e)
+        { return e.array.tuples * e.array.components * archiveTypeSize (e.array.type); };
+
+    // Reads count tuples of array starting at first into dst, only
+    // compressed blocks holding them are fetched and decompressed.
+    // Quantized arrays are expanded to floats.
+    bool read (const archive_entry_t* e, void* dst, uint64_t first = 0,
+               uint64_t count = UINT64_MAX) const;
+};
+
+
+#endif
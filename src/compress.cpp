@@ -0,0 +1,197 @@
+#include "compress.h"
+
+#include <string.h>
+
+#include <zlib.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+
+typedef struct {
+    const char* name;
+    const char* vtkName;
+    int minLevel, maxLevel, defLevel;
+} codec_info_t;
+
+static const codec_info_t codecs_info[codecsCount] = {
+    { "none", 0, 0, 0, 0 },
+    { "zlib", "vtkZLibDataCompressor", 1, 9, 6 },
+    // LZ4 level is turned into acceleration, 9 is the slowest
+    { "lz4", "vtkLZ4DataCompressor", 1, 9, 9 },
+    { "zstd", 0, 1, 22, 3 },
+};
+
+
+const char* codecName (int codec)
+{
+    return codecs_info[codec].name;
+}
+
+
+int findCodec (const char* name)
+{
+    for (int i = 0; i < codecsCount; i++)
+        if (!strcmp (codecs_info[i].name, name))
+            return i;
+    return -1;
+}
+
+
+bool codecAvailable (int codec)
+{
+    switch (codec) {
+    case codecNone:
+    case codecZLib:
+        return true;
+#ifdef HAVE_LZ4
+    case codecLZ4:
+        return true;
+#endif
+#ifdef HAVE_ZSTD
+    case codecZstd:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+
+const char* codecVTKName (int codec)
+{
+    return codecs_info[codec].vtkName;
+}
+
+
+int codecLevel (int codec, int level)
+{
+    const codec_info_t& info = codecs_info[codec];
+
+    if (level < info.minLevel || level > info.maxLevel)
+        return info.defLevel;
+    return level;
+}
+
+
+size_t compressBound (int codec, size_t size)
+{
+    switch (codec) {
+    case codecZLib:
+        return ::compressBound (size);
+#ifdef HAVE_LZ4
+    case codecLZ4:
+        return LZ4_compressBound (size);
+#endif
+#ifdef HAVE_ZSTD
+    case codecZstd:
+        return ZSTD_compressBound (size);
+#endif
+    default:
+        return size;
+    }
+}
+
+
+size_t compressBlock (int codec, int level, const void* src, size_t size,
+                      void* dst, size_t capacity)
+{
+    level = codecLevel (codec, level);
+
+    switch (codec) {
+    case codecNone:
+        if (size > capacity)
+            return 0;
+        memcpy (dst, src, size);
+        return size;
+
+    case codecZLib: {
+        uLongf res = capacity;
+
+        if (compress2 ((Bytef*)dst, &res, (const Bytef*)src, size, level) != Z_OK)
+            return 0;
+        return res;
+    }
+
+#ifdef HAVE_LZ4
+    case codecLZ4: {
+        int res = LZ4_compress_fast ((const char*)src, (char*)dst, size, capacity, 10 - level);
+
+        return res > 0 ? res : 0;
+    }
+#endif
+
+#ifdef HAVE_ZSTD
+    case codecZstd: {
+        size_t res = ZSTD_compress (dst, capacity, src, size, level);
+
+        return ZSTD_isError (res) ? 0 : res;
+    }
+#endif
+
+    default:
+        return 0;
+    }
+}
+
+
+bool decompressBlock (int codec, const void* src, size_t size, void* dst, size_t rawSize)
+{
+    switch (codec) {
+    case codecNone:
+        if (size != rawSize)
+            return false;
+        memcpy (dst, src, size);
+        return true;
+
+    case codecZLib: {
+        uLongf res = rawSize;
+
+        return uncompress ((Bytef*)dst, &res, (const Bytef*)src, size) == Z_OK && res == rawSize;
+    }
+
+#ifdef HAVE_LZ4
+    case codecLZ4:
+        return LZ4_decompress_safe ((const char*)src, (char*)dst, size, rawSize) == (int)rawSize;
+#endif
+
+#ifdef HAVE_ZSTD
+    case codecZstd:
+        return ZSTD_decompress (dst, rawSize, src, size) == rawSize;
+#endif
+
+    default:
+        return false;
+    }
+}
+
+
+void shuffleBytes (const void* src, size_t size, unsigned int width, void* dst)
+{
+    const unsigned char* in = (const unsigned char*)src;
+    unsigned char* out = (unsigned char*)dst;
+    size_t count = width ? size / width : 0;
+
+    for (unsigned int b = 0; b < width; b++)
+        for (size_t i = 0; i < count; i++)
+            *out++ = in[i * width + b];
+
+    memcpy (out, in + count * width, size - count * width);
+}
+
+
+void unshuffleBytes (const void* src, size_t size, unsigned int width, void* dst)
+{
+    const unsigned char* in = (const unsigned char*)src;
+    unsigned char* out = (unsigned char*)dst;
+    size_t count = width ? size / width : 0;
+
+    for (unsigned int b = 0; b < width; b++)
+        for (size_t i = 0; i < count; i++)
+            out[i * width + b] = *in++;
+
+    memcpy (out + count * width, in, size - count * width);
+}
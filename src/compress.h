@@ -0,0 +1,50 @@
+//
+// Block compression codecs of appended data. zlib is always built in,
+// LZ4 and Zstd only if the build found them (HAVE_LZ4, HAVE_ZSTD).
+//
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stddef.h>
+
+
+typedef enum {
+    codecNone,
+    codecZLib,
+    codecLZ4,
+    codecZstd,
+    codecsCount,
+} codec_t;
+
+
+const char* codecName (int codec);
+
+// codec by name, -1 if unknown
+int findCodec (const char* name);
+
+bool codecAvailable (int codec);
+
+// class name of VTK compressor, 0 if VTK readers do not support codec
+const char* codecVTKName (int codec);
+
+// default level, and level used if given one is out of codec range
+int codecLevel (int codec, int level);
+
+// worst case size of compressed block
+size_t compressBound (int codec, size_t size);
+
+// Returns size of compressed data in dst, 0 on failure
+size_t compressBlock (int codec, int level, const void* src, size_t size,
+                      void* dst, size_t capacity);
+
+// Restores exactly rawSize bytes of block into dst
+bool decompressBlock (int codec, const void* src, size_t size, void* dst, size_t rawSize);
+
+// Splits values of width bytes into byte planes (the first bytes of all
+// values, then the second ones, ...). Similar floats have similar high
+// bytes, so planes compress better. Tail shorter than value is copied.
+void shuffleBytes (const void* src, size_t size, unsigned int width, void* dst);
+void unshuffleBytes (const void* src, size_t size, unsigned int width, void* dst);
+
+
+#endif
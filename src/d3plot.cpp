@@ -12,35 +12,37 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-
-// float comparision function
-int float_compare (const void* a, const void* b)
-{
-    float fa = *(float*)a, fb = *(float*)b;
-    return fa < fb ? -1 : 1;
-}
-
-
-int float_compare_rev (const void* a, const void* b)
-{
-    return -float_compare (a, b);
-}
+#include <algorithm>
+#include <functional>
 
 
 // --------------------------------------------------
 // D3PlotFile
 // --------------------------------------------------
-D3PlotFile::D3PlotFile (const char* fileName)
+D3PlotFile::D3PlotFile (const char* fileName, bool useMmap)
 {
     _baseName = strdup (fileName);
     _f = 0;
+    _fileSize = 0;
     _index = 0;
+    _mapped = false;
+    _cur = 0;
+    _offset = 0;
+
+    // plain reads are used if family cannot be mapped, see mapped ()
+    if (useMmap)
+        mapFamily ();
 }
 
 
 D3PlotFile::~D3PlotFile ()
 {
+    if (_mapped)
+        unmapFamily ();
     if (_baseName)
         free (_baseName);
     if (_f)
@@ -48,40 +50,219 @@ D3PlotFile::~D3PlotFile ()
 }
 
 
-void D3PlotFile::readBlock (void* buf, unsigned int size)
+// map d3plot, d3plot01, d3plot02... until the first missing file
+bool D3PlotFile::mapFamily ()
+{
+    char buf[1024];
+
+    for (unsigned int i = 0; ; i++) {
+        fileName (i, buf);
+
+        int fd = open (buf, O_RDONLY);
+
+        if (fd < 0)
+            break;
+
+        struct stat st;
+        mapped_file_t m = { 0, 0 };
+
+        if (fstat (fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap (0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (p != MAP_FAILED) {
+                madvise (p, st.st_size, MADV_SEQUENTIAL);
+                m.data = (const char*)p;
+                m.size = st.st_size;
+            }
+        }
+        close (fd);
+
+        if (!m.data)
+            break;
+        _maps.push_back (m);
+    }
+
+    _mapped = !_maps.empty ();
+    return _mapped;
+}
+
+
+void D3PlotFile::unmapFamily ()
+{
+    for (unsigned int i = 0; i < _maps.size (); i++)
+        munmap ((void*)_maps[i].data, _maps[i].size);
+    _maps.clear ();
+    _mapped = false;
+}
+
+
+bool D3PlotFile::readBlock (void* buf, size_t size)
 {
+    char* dst = (char*)buf;
+
+    if (_mapped) {
+        while (size && _cur < _maps.size ()) {
+            size_t avail = _maps[_cur].size - _offset;
+
+            if (!avail) {
+                if (!openNextFile ())
+                    break;
+                continue;
+            }
+            if (avail > size)
+                avail = size;
+            memcpy (dst, _maps[_cur].data + _offset, avail);
+            _offset += avail;
+            dst += avail;
+            size -= avail;
+        }
+        return !size;
+    }
+
     if (!_f)
         openNextFile ();
 
-    if (!fread (buf, size, 1, _f)) {
-        openNextFile ();
-        int res = fread (buf, size, 1, _f);
-        if (!res)
-            // here we must throw an exception
-            ;
+    // block could be split between two files of family
+    while (size && _f) {
+        size_t res = fread (dst, 1, size, _f);
+
+        dst += res;
+        size -= res;
+        if (size && !openNextFile ())
+            break;
     }
+
+    return !size;
 }
 
 
-bool D3PlotFile::openNextFile ()
+const void* D3PlotFile::mapBlock (size_t size, std::vector<char>& scratch)
 {
-    if (_f)
-        fclose (_f);
+    if (_mapped && _cur < _maps.size ()) {
+        if (_offset == _maps[_cur].size)
+            openNextFile ();
+
+        if (_cur < _maps.size () && _offset + size <= _maps[_cur].size) {
+            const char* res = _maps[_cur].data + _offset;
+            _offset += size;
+            return res;
+        }
+    }
+
+    // straddling block or plain file
+    scratch.resize (size);
+    if (!readBlock (&scratch[0], size))
+        return 0;
+    return &scratch[0];
+}
+
+
+// gaps smaller than this are read through, seeking over them costs more
+#define RANGES_MIN_GAP (64*1024)
+
+const void* D3PlotFile::mapRanges (size_t size, const std::vector<byte_range_t>& ranges,
+                                   std::vector<char>& scratch)
+{
+    if (_mapped && _cur < _maps.size ()) {
+        if (_offset == _maps[_cur].size)
+            openNextFile ();
+
+        // pages outside of ranges are never touched
+        if (_cur < _maps.size () && _offset + size <= _maps[_cur].size)
+            return mapBlock (size, scratch);
+    }
+
+    scratch.resize (size);
+
+    size_t pos = 0, i = 0;
+
+    while (i < ranges.size ()) {
+        size_t start = ranges[i].offset, end = start + ranges[i].size;
+
+        // merge ranges with small gaps into one read
+        for (i++; i < ranges.size () && ranges[i].offset < end + RANGES_MIN_GAP; i++)
+            end = ranges[i].offset + ranges[i].size;
+
+        if (start - pos < RANGES_MIN_GAP)
+            start = pos;
+        else if (skip (start - pos) < start - pos)
+            return 0;
+        if (!readBlock (&scratch[start], end - start))
+            return 0;
+        pos = end;
+    }
+
+    if (skip (size - pos) < size - pos)
+        return 0;
+    return &scratch[0];
+}
 
-    static char buf[1024];
 
-    if (_index)
-        sprintf (buf, "%s%02d", _baseName, _index);
+void D3PlotFile::fileName (unsigned int index, char* buf) const
+{
+    if (index)
+        sprintf (buf, "%s%02d", _baseName, index);
     else
         sprintf (buf, "%s", _baseName);
+}
+
+
+bool D3PlotFile::openFile (unsigned int index)
+{
+    if (_mapped) {
+        if (index >= _maps.size ())
+            return false;
+        _cur = index;
+        _offset = 0;
+        return true;
+    }
+
+    if (_f)
+        fclose (_f);
+
+    char buf[1024];
+
+    fileName (index, buf);
     _f = fopen (buf, "rb");
+    _fileSize = 0;
 
-    _index++;
+    if (_f) {
+        struct stat st;
+
+        if (fstat (fileno (_f), &st) == 0)
+            _fileSize = st.st_size;
+    }
+
+    _index = index + 1;
 
     return _f;
 }
 
 
+bool D3PlotFile::openNextFile ()
+{
+    if (_mapped)
+        return openFile (_cur + 1);
+    return openFile (_index);
+}
+
+
+void D3PlotFile::familySizes (std::vector<long long>& sizes) const
+{
+    char buf[1024];
+    struct stat st;
+
+    sizes.clear ();
+
+    for (unsigned int i = 0; ; i++) {
+        fileName (i, buf);
+        if (stat (buf, &st) != 0)
+            break;
+        sizes.push_back (st.st_size);
+    }
+}
+
+
 
 bool D3PlotFile::readBool ()
 {
@@ -113,33 +294,119 @@ float D3PlotFile::readFloat ()
 }
 
 
-void D3PlotFile::skip (unsigned int size)
+unsigned long long D3PlotFile::skip (unsigned long long size)
 {
-    while (size)
-    {
-        readInt ();
-        size -= sizeof (int);
+    unsigned long long done = 0;
+
+    if (_mapped) {
+        while (size && _cur < _maps.size ()) {
+            unsigned long long avail = _maps[_cur].size - _offset;
+
+            if (size <= avail) {
+                _offset += size;
+                return done + size;
+            }
+
+            done += avail;
+            size -= avail;
+            _offset += avail;
+            if (!openNextFile ())
+                break;
+        }
+        return done;
+    }
+
+    if (!_f)
+        openNextFile ();
+
+    while (size && _f) {
+        unsigned long long avail = _fileSize - ftello (_f);
+
+        if (size <= avail) {
+            fseeko (_f, size, SEEK_CUR);
+            return done + size;
+        }
+
+        done += avail;
+        size -= avail;
+        fseeko (_f, 0, SEEK_END);
+        if (!openNextFile ())
+            break;
     }
+
+    return done;
 }
 
 
 void D3PlotFile::sayPos ()
 {
-    printf ("Position: %x\n", ftell (_f));
+    if (_mapped)
+        printf ("Position: %u:%lx\n", _cur, (unsigned long)_offset);
+    else
+        printf ("Position: %lx\n", _f ? ftell (_f) : 0L);
+}
+
+
+file_pos_t D3PlotFile::tell () const
+{
+    file_pos_t pos;
+
+    if (_mapped) {
+        pos.file = _cur;
+        pos.offset = _offset;
+    } else if (_f) {
+        pos.file = _index - 1;
+        pos.offset = ftello (_f);
+    } else {
+        pos.file = 0;
+        pos.offset = 0;
+    }
+
+    return pos;
+}
+
+
+bool D3PlotFile::seek (const file_pos_t& pos)
+{
+    if (_mapped) {
+        if (pos.file >= _maps.size () || pos.offset > (long long)_maps[pos.file].size)
+            return false;
+        _cur = pos.file;
+        _offset = pos.offset;
+        return true;
+    }
+
+    if (!_f || pos.file != _index - 1)
+        if (!openFile (pos.file))
+            return false;
+
+    return fseeko (_f, pos.offset, SEEK_SET) == 0;
+}
+
+
+bool D3PlotFile::readTime (float* time)
+{
+    if (!readBlock (time, sizeof (float)))
+        return false;
+
+    // end of file marker
+    if (*time < 0)
+        return openNextFile () && readBlock (time, sizeof (float));
+
+    return true;
 }
 
 
 void D3PlotFile::pushPos ()
 {
-    _pos_stack.push_back (ftell (_f));
+    _pos_stack.push_back (tell ());
 }
 
 
 void D3PlotFile::popPos ()
 {
-    long pos = _pos_stack.back ();
+    seek (_pos_stack.back ());
     _pos_stack.pop_back ();
-    fseek (_f, pos, SEEK_SET);
 }
 
 
@@ -253,6 +520,84 @@ D3PlotControl::D3PlotControl (D3PlotFile* f)
 
     // skip blank fields
     f->skip (14 * WORD_SIZE);
+
+    buildLayout ();
+}
+
+
+// places section of count records of stride words at offset and moves
+// offset past it
+static void placeSection (state_section_t& s, unsigned long long& offset,
+                          unsigned int count, unsigned int stride)
+{
+    s.offset = offset;
+    s.count  = count;
+    s.stride = stride;
+    offset += s.words ();
+}
+
+
+void D3PlotControl::buildLayout ()
+{
+    state_layout_t& l = _layout;
+    unsigned long long offset = 0;
+
+    placeSection (l.globals, offset, _num_global_vars, 1);
+    placeSection (l.coords,  offset, _nodes, 3);
+    placeSection (l.temps,   offset, _temperatures ? _nodes : 0, 1);
+    placeSection (l.vel,     offset, _velocities ? _nodes : 0, 3);
+    placeSection (l.accel,   offset, _accelerations ? _nodes : 0, 3);
+
+    placeSection (l.solids,       offset, _num_8_node_elems, _num_8_node_vals);
+    placeSection (l.thick_shells, offset, _thick_shell_elems, _thick_shell_vals);
+    placeSection (l.beams,        offset, _num_2_node_elems, _num_2_node_vals);
+    placeSection (l.shells,       offset, _num_4_node_elems, _num_4_node_vals);
+    placeSection (l.deletion,     offset, deletion_words (), 1);
+    l.words = offset;
+
+    // solid record: sigma, plastic strain, then NEIPH additional
+    // values, first six of them are strains when ISTRN is set
+    l.solid_sigma = 0;
+    l.solid_pl_strain = 6;
+    l.solid_strain = istrn () && _num_8_node_add >= 6 ? 7 : -1;
+
+    // shell record: MAXINT integration points of sigma, plastic
+    // strain and NEIPS values, then resultants, thickness and element
+    // values, strains of inner and outer surface and internal energy
+    int pos = 0;
+
+    l.shell_sigma = _stress_components ? pos : -1;
+    pos += _stress_components ? 6 : 0;
+    l.shell_pl_strain = _plastic_strain ? pos : -1;
+    pos += _plastic_strain ? 1 : 0;
+
+    l.shell_layers = _num_4_node_int;
+    l.shell_layer_stride = pos + _num_4_node_add;
+    pos = l.shell_layers * l.shell_layer_stride;
+
+    l.shell_bending = l.shell_shear = l.shell_normal = -1;
+    if (_shell_force_res) {
+        l.shell_bending = pos;
+        l.shell_shear   = pos + 3;
+        l.shell_normal  = pos + 5;
+        pos += 8;
+    }
+
+    l.shell_thickness = l.shell_elem_dep = l.shell_energy = -1;
+    if (_shell_thickness_energy) {
+        l.shell_thickness = pos;
+        l.shell_elem_dep  = pos + 1;
+        pos += 3;
+    }
+
+    l.shell_strain = -1;
+    if (istrn ()) {
+        l.shell_strain = pos;
+        pos += 12;
+    }
+
+    if (_shell_thickness_energy)
+        l.shell_energy = pos;
 }
 
 
@@ -319,1028 +664,1935 @@ bool D3PlotControl::istrn () const
 }
 
 
+unsigned long long D3PlotControl::deletion_words () const
+{
+    switch (_elems_deletion) {
+    case 1:
+        return _nodes;
+    case 2:
+        return total_cells ();
+    default:
+        return 0;
+    }
+}
+
 
 // --------------------------------------------------
-// GenericCell
+// D3PlotIndex
 // --------------------------------------------------
-GenericCell::GenericCell (unsigned int* nodes, unsigned char pts, unsigned int partID, unsigned int elemKind)
-    : _pts (pts),
-      _partID (partID),
-      _elemKind (elemKind)
+#define INDEX_MAGIC   "D3PIDX"
+#define INDEX_VERSION 1
+
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int files;
+    unsigned long long state_words;
+    unsigned int nodes;
+    unsigned int cells;
+    unsigned int states;
+    unsigned int reserved;
+} index_header_t;
+
+
+D3PlotIndex::D3PlotIndex ()
+    : _stateWords (0),
+      _nodes (0),
+      _cells (0)
 {
-//    _nodes = (unsigned int*)malloc (sizeof (unsigned int) * pts);
-    memcpy (_nodes, nodes, sizeof (unsigned int) * pts);
 }
 
 
-
-GenericCell::~GenericCell ()
+void D3PlotIndex::scan (D3PlotFile* f, D3PlotControl* ctl)
 {
-//    free (_nodes);
-}
+    unsigned long long rest = (ctl->state_words () - 1) * WORD_SIZE;
 
+    _states.clear ();
+    f->familySizes (_sizes);
+    _stateWords = ctl->state_words ();
+    _nodes = ctl->nodes ();
+    _cells = ctl->total_cells ();
 
+    while (1) {
+        state_entry_t entry;
 
+        // padding is zeroed, so index files are reproducible
+        memset (&entry, 0, sizeof (entry));
+        if (!f->readTime (&entry.time))
+            break;
 
-// --------------------------------------------------
-// D3PlotGeometry class
-// --------------------------------------------------
-// File handle must be positioned at the begining
-// of gemetry block
-D3PlotGeometry::D3PlotGeometry (D3PlotFile* f, D3PlotControl* ctl, StateOptions* opts)
-    : _ctl  (ctl),
-      _opts (opts),
-      _stateMode (false),
-      _nodes (0)
-{
-    int i, j;
+        entry.pos = f->tell ();
+        entry.pos.offset -= sizeof (float);
 
-    _points = _hexas = _lines = _triangles = _quads = _pyramids = _tetras = _wedges = 0;
+        // incomplete state at the end of family is not indexed
+        if (f->skip (rest) < rest)
+            break;
 
-    for (i = 0; i < 3; i++) {
-        _deleted[i] = 0;
-        _local2global[i] = 0;
+        _states.push_back (entry);
     }
-    
-    // --[ Nodes ]------------------------------------------------
-    // read points
-    f->sayPos ();
-    _nodes  = (node_coord_t*)malloc (ctl->nodes () * sizeof (node_coord_t));
-    _deltas = (node_coord_t*)malloc (ctl->nodes () * sizeof (node_coord_t));
-
-    memset (_deltas, 0, ctl->nodes () * sizeof (node_coord_t));
-    f->readBlock (_nodes, sizeof (node_coord_t) * ctl->nodes ());
-    _points = ctl->nodes ();
+}
 
-    int id = 0;
 
-    // --[ Solids ]------------------------------------------------
-    for (i = 0; i < ctl->num_8_node_elems () + ctl->thick_shell_elems (); i++) {
-        unsigned int nodes[8], partID, elemKind;
-        int pts = 0;
+bool D3PlotIndex::load (const char* fileName, D3PlotFile* f, D3PlotControl* ctl)
+{
+    FILE* in = fopen (fileName, "rb");
 
-        f->readBlock (nodes, sizeof (nodes));
-        partID = f->readUInt ();
+    if (!in)
+        return false;
 
-        for (j = 0; j < 8; j++) {
-            nodes[j]--;
-            if (j == 0 || nodes[j] != nodes[j-1])
-                pts++;
-            else
-                break;
-        }
+    index_header_t hdr;
+    std::vector<long long> sizes;
+    bool ok = fread (&hdr, sizeof (hdr), 1, in) == 1;
 
-        switch (pts) {
-        case 8:
-            elemKind = VTK_HEXAHEDRON;
-            _hexas++;
-            break;
+    f->familySizes (sizes);
 
-        case 5:
-            elemKind = VTK_PYRAMID;
-            _pyramids++;
-            break;
+    ok = ok && !memcmp (hdr.magic, INDEX_MAGIC, sizeof (INDEX_MAGIC)) && hdr.version == INDEX_VERSION &&
+        hdr.files == sizes.size () && hdr.state_words == ctl->state_words () &&
+        hdr.nodes == ctl->nodes () && hdr.cells == ctl->total_cells ();
 
-        case 4:
-            elemKind = VTK_TETRA;
-            _tetras++;
-            break;
+    if (ok) {
+        _sizes.resize (hdr.files);
+        _states.resize (hdr.states);
 
-        case 6:
-            elemKind = VTK_WEDGE;
-            _wedges++;
-            break;
+        ok = (!hdr.files || fread (&_sizes[0], sizeof (long long), hdr.files, in) == hdr.files) &&
+            _sizes == sizes &&
+            (!hdr.states || fread (&_states[0], sizeof (state_entry_t), hdr.states, in) == hdr.states);
+    }
 
-        default:
-            printf ("Unknown amount of vertices = %d\n", pts);
-        }
+    fclose (in);
 
-        _cells[gridSolids].push_back (new GenericCell (nodes, pts, partID, elemKind));
+    if (!ok) {
+        _states.clear ();
+        _sizes.clear ();
+        return false;
     }
 
-    // --[ Beams ]------------------------------------------------
-    for (i = 0; i < ctl->num_2_node_elems (); i++) {
-        unsigned int tmp[5];
-        unsigned int partID;
-        f->readBlock (tmp, sizeof (tmp));
-        partID = f->readUInt ();
+    _stateWords = hdr.state_words;
+    _nodes = hdr.nodes;
+    _cells = hdr.cells;
+    return true;
+}
 
-        tmp[0]--;
-        tmp[1]--;
 
-        _cells[gridBeams].push_back (new GenericCell (tmp, 2, partID, VTK_LINE));
-        _lines++;
-    }
+bool D3PlotIndex::save (const char* fileName) const
+{
+    FILE* out = fopen (fileName, "wb");
 
-    // --[ Shells ]------------------------------------------------
-    for (i = 0; i < ctl->num_4_node_elems (); i++) {
-        unsigned int points[4];
-        unsigned int partID;
+    if (!out)
+        return false;
 
-        f->readBlock (points, sizeof (points));
-        partID = f->readUInt ();
+    index_header_t hdr;
 
-        for (int j = 0; j < 4; j++)
-            points[j]--;
+    memset (&hdr, 0, sizeof (hdr));
+    strcpy (hdr.magic, INDEX_MAGIC);
+    hdr.version = INDEX_VERSION;
+    hdr.files = _sizes.size ();
+    hdr.state_words = _stateWords;
+    hdr.nodes = _nodes;
+    hdr.cells = _cells;
+    hdr.states = _states.size ();
 
-        if (points[3] == points[2]) {
-            _cells[gridShells].push_back (new GenericCell (points, 3, partID, VTK_TRIANGLE));
-            _triangles++;
-        }
-        else {
-            _cells[gridShells].push_back (new GenericCell (points, 4, partID, VTK_QUAD));
-            _quads++;
-        }
-    }
+    bool ok = fwrite (&hdr, sizeof (hdr), 1, out) == 1 &&
+        (_sizes.empty () || fwrite (&_sizes[0], sizeof (long long), _sizes.size (), out) == _sizes.size ()) &&
+        (_states.empty () || fwrite (&_states[0], sizeof (state_entry_t), _states.size (), out) == _states.size ());
 
-    updateMaps ();
+    if (fclose (out))
+        ok = false;
+    return ok;
 }
 
 
-D3PlotGeometry::~D3PlotGeometry ()
+int D3PlotIndex::findTime (float time) const
 {
-    std::vector<GenericCell*>::iterator it;
+    int res = -1;
 
-    for (int i = 0; i < 3; i++) {
+    for (unsigned int i = 0; i < _states.size (); i++)
+        if (res < 0 || fabs (_states[i].time - time) < fabs (_states[res].time - time))
+            res = i;
 
-        it = _cells[i].begin ();
+    return res;
+}
 
-        while (it != _cells[i].end ())
-            delete *(it++);
-        _cells[i].clear ();
 
-        if (_local2global[i])
-            free (_local2global[i]);
-        
-        _global2local[i].clear ();
-        free (_deleted[i]);
-        _sigma[i].clear ();
-        _pl_strain[i].clear ();
-        _strain[i].clear ();
-    }
 
-    free (_nodes);
-    free (_deltas);
-    _vel.clear ();
-    _accel.clear ();
-    _innerSigma.clear ();
-    _outerSigma.clear ();
-    _pl_innerStrain.clear ();
-    _pl_outerStrain.clear ();
-    _innerStrain.clear ();
-    _outerStrain.clear ();
+// --------------------------------------------------
+// CellArray
+// --------------------------------------------------
+CellArray::CellArray ()
+    : _offsetsBuf (1, 0),
+      _conn (0),
+      _partIDs (0),
+      _types (0),
+      _count (0)
+{
+    _offsets = &_offsetsBuf[0];
 }
 
 
-void D3PlotGeometry::resolveInvariants (float* res, const tensor_t& data)
+void CellArray::reserve (unsigned int cells, unsigned int nodes)
 {
-    float sigma[6] = {
-        data.val[0], data.val[1], data.val[2],
-        data.val[3], data.val[4], data.val[5],
-    };
-    float alpha = 0.0, koefA = -(sigma[0]+sigma[1]+sigma[2]), koefB, koefC, kP, kQ, fi;
+    _offsetsBuf.reserve (cells + 1);
+    _connBuf.reserve (nodes);
+    _partIDsBuf.reserve (cells);
+    _typesBuf.reserve (cells);
+}
 
-    koefB = sigma[0]*sigma[1] + sigma[1]*sigma[2] + sigma[2]*sigma[0] -
-            sigma[3]*sigma[3] - sigma[4]*sigma[4] - sigma[5]*sigma[5];
 
-    koefC = sigma[0]*sigma[1]*sigma[2] - 2*sigma[3]*sigma[4]*sigma[5] +
-            sigma[0]*sigma[4]*sigma[4] + sigma[1]*sigma[5]*sigma[5] + sigma[2]*sigma[3]*sigma[3];
+void CellArray::append (const unsigned int* nodes, unsigned char pts, unsigned int partID, unsigned char type)
+{
+    _connBuf.insert (_connBuf.end (), nodes, nodes + pts);
+    _offsetsBuf.push_back (_connBuf.size ());
+    _partIDsBuf.push_back (partID);
+    _typesBuf.push_back (type);
+
+    // buffers could be reallocated
+    _offsets = &_offsetsBuf[0];
+    _conn    = &_connBuf[0];
+    _partIDs = &_partIDsBuf[0];
+    _types   = &_typesBuf[0];
+    _count++;
+}
 
-    kP = -(koefA * koefA / 3.0) + koefB;
 
-    kQ = 2*koefA*koefA*koefA - koefA*koefB/3.0 + koefC;
-    fi = -kQ / 2.0 / sqrt (-kP*kP*kP/27.0);
+void CellArray::attach (unsigned int count, const unsigned int* offsets, const unsigned int* conn,
+                        const unsigned int* partIDs, const unsigned char* types)
+{
+    _offsetsBuf.clear ();
+    _connBuf.clear ();
+    _partIDsBuf.clear ();
+    _typesBuf.clear ();
+
+    _count   = count;
+    _offsets = offsets;
+    _conn    = conn;
+    _partIDs = partIDs;
+    _types   = types;
+}
 
-    if (fabs (fi) >= 1)
-        alpha = 0.0;
-    else
-        alpha = acos (fi) / 3.0;
 
-    res[0] = 2*sqrt (-kP/3.0) * cos (alpha) - koefA/3.0;
-    res[1] = -2*sqrt (-kP/3.0) * cos (alpha + 1.047197551197) - koefA/3.0;
-    res[2] = -2*sqrt (-kP/3.0) * cos (alpha - 1.047197551197) - koefA/3.0;
 
-    qsort (res, 3, sizeof (float), float_compare_rev);
+// --------------------------------------------------
+// Fields registry
+// --------------------------------------------------
+static const field_info_t fields_info[fieldsCount] = {
+    { "Sigma",                   0,                  6, false, -1 },
+    { "Von Mizes Stress",        "Von Mises Stress", 1, false, fieldSigma },
+    { "Principal Stress",        0,                  3, false, fieldSigma },
+    { "Hydrostatic Pressure",    0,                  1, false, fieldSigma },
+    { "Principal Shear Stress",  0,                  3, false, fieldSigma },
+    { "Octahedral Shear Stress", 0,                  1, false, fieldSigma },
+    { "Plastic Strain",          0,                  1, false, -1 },
+    { "Strain",                  0,                  6, false, -1 },
+    { "Principal Strain",        0,                  3, false, fieldStrain },
+    { "InnerSigma",              0,                  6, false, -1 },
+    { "OuterSigma",              0,                  6, false, -1 },
+    { "InnerPlasticStrain",      0,                  1, false, -1 },
+    { "OuterPlasticStrain",      0,                  1, false, -1 },
+    { "InnerStrain",             0,                  6, false, -1 },
+    { "OuterStrain",             0,                  6, false, -1 },
+    { "Bending Moment",          0,                  3, false, -1 },
+    { "Shear Resultant",         0,                  2, false, -1 },
+    { "Normal Resultant",        0,                  3, false, -1 },
+    { "Thickness",               0,                  1, false, -1 },
+    { "Element Depended Value",  0,                  2, false, -1 },
+    { "Internal Energy",         0,                  1, false, -1 },
+    { "Velocity",                0,                  3, true,  -1 },
+    { "Acceleration",            0,                  3, true,  -1 },
+    { "Delta Movements",         0,                  3, true,  -1 },
+    { "Coords",                  0,                  3, true,  -1 },
+};
+
+
+const field_info_t& fieldInfo (int field)
+{
+    return fields_info[field];
 }
 
 
-void D3PlotGeometry::appendCellArray (vtkUnstructuredGrid* grid, vtkDataArray* array)
+int findField (const char* name)
 {
-    if (array) {
-        grid->GetCellData ()->AddArray (array);
-        array->Delete ();
-    }
-}
+    for (int i = 0; i < fieldsCount; i++)
+        if (!strcmp (fields_info[i].name, name) ||
+            (fields_info[i].alias && !strcmp (fields_info[i].alias, name)))
+            return i;
 
+    return -1;
+}
 
-vtkFloatArray* D3PlotGeometry::createArray (const char* name, unsigned int components)
-{
-    vtkFloatArray* res = vtkFloatArray::New ();
 
-    res->SetName (name);
-    res->SetNumberOfComponents (components);
 
-    return res;
+// --------------------------------------------------
+// State decoders
+// --------------------------------------------------
+template <int N, typename T>
+static inline void copyValues (T& dst, const float* src)
+{
+    for (int i = 0; i < N; i++)
+        dst.val[i] = src[i];
 }
 
 
-
-vtkUnstructuredGrid* D3PlotGeometry::createGrid (grid_kind_t kind)
+// Solids followed by thick shells, for the latter only first
+// integration point is fetched and strains are never present.
+// Additional values skipped (TODO)
+template <bool Strain>
+static void decodeSolidsT (const float* data, const state_layout_t& l, const solid_targets_t& t)
 {
-    vtkUnstructuredGrid* grid = vtkUnstructuredGrid::New ();
-    vtkPoints* points = getPoints (kind);
+    const state_section_t* blocks[2] = { &l.solids, &l.thick_shells };
+    unsigned int cell = 0, i;
 
-    grid->SetPoints (points);
-    points->Delete ();
+    for (int b = 0; b < 2; b++) {
+        const float* p = data + blocks[b]->offset;
+        const unsigned int stride = blocks[b]->stride;
 
-    // cells
-    std::vector<GenericCell*>::iterator it = _cells[kind].begin ();
-    vtkUnsignedIntArray* partIDField      = vtkUnsignedIntArray::New ();
-    vtkUnsignedIntArray* elementTypeField = vtkUnsignedIntArray::New ();
+        if (t.sigma)
+            for (i = 0; i < blocks[b]->count; i++)
+                copyValues<6> (t.sigma[cell + i], p + (size_t)i * stride);
 
-    partIDField->SetName ("PartID");
-    elementTypeField->SetName ("ElementType");
+        if (t.pl_strain)
+            for (i = 0; i < blocks[b]->count; i++)
+                t.pl_strain[cell + i] = p[(size_t)i * stride + 6];
 
-    vtkFloatArray* sigmaField = 0;
-    vtkFloatArray* vm_stressField = 0;
-    vtkFloatArray* pri_stressField = 0;
-    vtkFloatArray* hydroPressureField = 0;
-    vtkFloatArray* pri_shearStressField = 0;
-    vtkFloatArray* oct_shearStressField = 0;
-    
-    if (_stateMode && _sigma[kind].size ()) {
-        sigmaField           = createArray ("Sigma", 6);
-        vm_stressField       = createArray ("Von Mizes Stress");
-        pri_stressField      = createArray ("Principal Stress", 3);
-        hydroPressureField   = createArray ("Hydrostatic Pressure");
-        pri_shearStressField = createArray ("Principal Shear Stress", 3); 
-        oct_shearStressField = createArray ("Octahedral Shear Stress");
+        if (Strain && b == 0 && t.strain)
+            for (i = 0; i < blocks[b]->count; i++)
+                copyValues<6> (t.strain[cell + i], p + (size_t)i * stride + 7);
+
+        cell += blocks[b]->count;
+    }
+}
+
+
+// Shell records. Stress and plastic strain presence, additional values
+// count and number of integration points are template parameters, so
+// offsets of layer values are constants; -1 means value is taken from
+// layout at run time. Only middle, inner and outer layers are decoded.
+template <bool Stress, bool PlStrain, bool Strain, int Add, int MaxInt>
+static void decodeShellsT (const float* data, const state_layout_t& l, const shell_targets_t& t)
+{
+    const unsigned int layerStride = Add >= 0 ? (Stress ? 6 : 0) + (PlStrain ? 1 : 0) + Add
+                                              : l.shell_layer_stride;
+    const unsigned int maxInt = MaxInt >= 0 ? MaxInt : l.shell_layers;
+    const unsigned int layers = maxInt < 3 ? maxInt : 3;
+    const unsigned int count = l.shells.count;
+    const size_t stride = l.shells.stride;
+    const float* p = data + l.shells.offset;
+    unsigned int i, j;
+
+    for (j = 0; j < layers; j++) {
+        const float* v = p + j * layerStride;
+
+        if (Stress && t.sigma[j])
+            for (i = 0; i < count; i++)
+                copyValues<6> (t.sigma[j][i], v + i * stride);
+
+        if (PlStrain && t.pl_strain[j])
+            for (i = 0; i < count; i++)
+                t.pl_strain[j][i] = v[i * stride + (Stress ? 6 : 0)];
+    }
+
+    if (t.bending)
+        for (i = 0; i < count; i++)
+            copyValues<3> (t.bending[i], p + i * stride + l.shell_bending);
+
+    if (t.shear)
+        for (i = 0; i < count; i++)
+            copyValues<2> (t.shear[i], p + i * stride + l.shell_shear);
+
+    if (t.normal)
+        for (i = 0; i < count; i++)
+            copyValues<3> (t.normal[i], p + i * stride + l.shell_normal);
+
+    if (t.thickness)
+        for (i = 0; i < count; i++)
+            t.thickness[i] = p[i * stride + l.shell_thickness];
+
+    if (t.elem_dep)
+        for (i = 0; i < count; i++)
+            copyValues<2> (t.elem_dep[i], p + i * stride + l.shell_elem_dep);
+
+    for (j = 0; Strain && j < 2; j++)
+        if (t.strain[j])
+            for (i = 0; i < count; i++)
+                copyValues<6> (t.strain[j][i], p + i * stride + l.shell_strain + j * 6);
+
+    if (t.energy)
+        for (i = 0; i < count; i++)
+            t.energy[i] = p[i * stride + l.shell_energy];
+}
+
+
+// most files have no additional shell values and 3 integration points,
+// the rest is served by decoders taking them from layout
+template <bool Stress, bool PlStrain, bool Strain>
+static shell_decoder_t shellDecoder (unsigned int add, unsigned int maxInt)
+{
+    if (add == 0)
+        return maxInt == 3 ? decodeShellsT<Stress, PlStrain, Strain, 0, 3>
+                           : decodeShellsT<Stress, PlStrain, Strain, 0, -1>;
+
+    return maxInt == 3 ? decodeShellsT<Stress, PlStrain, Strain, -1, 3>
+                       : decodeShellsT<Stress, PlStrain, Strain, -1, -1>;
+}
+
+
+static shell_decoder_t selectShellDecoder (const D3PlotControl* ctl)
+{
+    unsigned int add = ctl->num_4_node_add (), maxInt = ctl->num_4_node_int ();
+    bool strain = ctl->layout ().shell_strain >= 0;
+
+    switch ((ctl->stress_components () ? 4 : 0) + (ctl->plastic_strain () ? 2 : 0) + strain) {
+    case 0: return shellDecoder<false, false, false> (add, maxInt);
+    case 1: return shellDecoder<false, false, true>  (add, maxInt);
+    case 2: return shellDecoder<false, true,  false> (add, maxInt);
+    case 3: return shellDecoder<false, true,  true>  (add, maxInt);
+    case 4: return shellDecoder<true,  false, false> (add, maxInt);
+    case 5: return shellDecoder<true,  false, true>  (add, maxInt);
+    case 6: return shellDecoder<true,  true,  false> (add, maxInt);
+    default: return shellDecoder<true, true,  true>  (add, maxInt);
     }
+}
 
-    vtkFloatArray* plStrainField = 0;
 
-    if (_stateMode && _pl_strain[kind].size ())
-        plStrainField = createArray ("Plastic Strain");
 
-    vtkFloatArray* strainField = 0;
-    vtkFloatArray* pri_strainField = 0;
+// --------------------------------------------------
+// D3PlotGeometry class
+// --------------------------------------------------
+// File handle must be positioned at the begining
+// of gemetry block
+D3PlotGeometry::D3PlotGeometry (D3PlotFile* f, D3PlotControl* ctl, StateOptions* opts, const char* cacheName)
+    : _ctl  (ctl),
+      _opts (opts),
+      _nodes (0),
+      _stateMode (false),
+      _cacheMap (0),
+      _cacheSize (0),
+      _pool (0),
+      _master (0)
+{
+    _points = _hexas = _lines = _triangles = _quads = _pyramids = _tetras = _wedges = 0;
 
-    if (_stateMode && _ctl->istrn () && _strain[kind].size ()) {
-        strainField = createArray ("Strain", 6); 
-        pri_strainField = createArray ("Principal Strain", 3);
+    for (int i = 0; i < 3; i++) {
+        _l2g_size[i] = 0;
+        _topoRev[i] = 0;
+        _topoKey[i] = 0;
+        _piecesRev[i] = 0;
     }
 
-    vtkUnsignedCharArray* deletedField = 0;
+    _solidDecoder = ctl->layout ().solid_strain >= 0 ? decodeSolidsT<true> : decodeSolidsT<false>;
+    _shellDecoder = selectShellDecoder (ctl);
+
+    // without field list everything is output
+    const FieldFilter* fields = opts->fieldFilter ();
+
+    for (int i = 0; i < fieldsCount; i++)
+        _outputField[i] = _decodeField[i] = !fields || !fields->active ();
 
-    if (_opts->keepDeleted () && _deleted[kind]) {
-        deletedField = vtkUnsignedCharArray::New ();
-        deletedField->SetName ("Deleted");
+    if (fields)
+        for (size_t i = 0; i < fields->names ().size (); i++) {
+            int id = findField (fields->names ()[i].c_str ());
+
+            if (id < 0)
+                continue;
+            _outputField[id] = _decodeField[id] = true;
+            if (fields_info[id].input >= 0)
+                _decodeField[fields_info[id].input] = true;
+        }
+
+    const QuantizeFilter* quantize = opts->quantizeFilter ();
+
+    for (int i = 0; i < fieldsCount; i++) {
+        _quantBound[i] = 0;
+        _quantRelative[i] = false;
     }
 
-    // shell-specific fields
-    vtkFloatArray* innerSigmaField = 0;
-    vtkFloatArray* outerSigmaField = 0;
-    vtkFloatArray* innerPlStrainField = 0;
-    vtkFloatArray* outerPlStrainField = 0;
-    vtkFloatArray* innerStrainField = 0;
-    vtkFloatArray* outerStrainField = 0;
+    if (quantize)
+        for (size_t i = 0; i < quantize->names ().size (); i++) {
+            int id = findField (quantize->names ()[i].c_str ());
 
-    vtkFloatArray* bendingMomentField = 0;
-    vtkFloatArray* shearResultantField = 0;
-    vtkFloatArray* normalResultantField = 0;
-    vtkFloatArray* thicknessField = 0;
-    vtkFloatArray* elemDepValField = 0;
-    vtkFloatArray* energyField = 0;
-    
-    if (_stateMode && kind == gridShells) {
-        innerSigmaField = createArray ("InnerSigma", 6);
-        outerSigmaField = createArray ("OuterSigma", 6);
-        innerPlStrainField = createArray ("InnerPlasticStrain");
-        outerPlStrainField = createArray ("OuterPlasticStrain");
-
-        bendingMomentField = createArray ("Bending Moment", 3);
-        shearResultantField = createArray ("Shear Resultant", 2);
-        normalResultantField = createArray ("Normal Resultant", 3);
-        thicknessField = createArray ("Thickness");
-        elemDepValField = createArray ("Element Depended Value", 2);
-        energyField = createArray ("Internal Energy");
-        
-        if (_ctl->istrn ()) {
-            innerStrainField = createArray ("InnerStrain", 6);
-            outerStrainField = createArray ("OuterStrain", 6);
+            if (id < 0)
+                continue;
+            _quantBound[id] = quantize->bound (i);
+            _quantRelative[id] = quantize->relative (i);
         }
+
+    if (opts->codec () != codecNone || opts->pieces () > 1)
+        _pool = new ThreadPool (opts->threads ());
+
+    _points = ctl->nodes ();
+    _nodes  = (node_coord_t*)malloc (_points * sizeof (node_coord_t));
+    _deltas = (node_coord_t*)malloc (_points * sizeof (node_coord_t));
+    memset (_deltas, 0, _points * sizeof (node_coord_t));
+
+    if (cacheName && loadCache (cacheName, f))
+        // geometry block is not needed
+        f->skip ((unsigned long long)WORD_SIZE * (_points * 3 +
+                 (ctl->num_8_node_elems () + ctl->thick_shell_elems ()) * 9 +
+                 ctl->num_2_node_elems () * 6 + ctl->num_4_node_elems () * 5));
+    else {
+        readGeometry (f);
+        if (cacheName && !saveCache (cacheName, f))
+            printf ("(cannot write %s) ", cacheName);
     }
 
-    int index = 0;
-    bool notCheckDel = _opts->keepDeleted () || !_deleted[kind];
-    int i;
+    updateMaps ();
 
-    while (it != _cells[kind].end ()) {
-        vtkIdType pts[8];
-
-        if (_opts->partIDCheck ((*it)->partID ()) && (notCheckDel || !_deleted[kind][index])) {
-            for (i = 0; i < (*it)->nodesCount (); i++)
-                pts[i] = _global2local[kind][(*it)->node (i)];
-
-            grid->InsertNextCell ((*it)->elemKind (), (*it)->nodesCount (), pts);
-            partIDField->InsertNextValue ((*it)->partID ());
-            elementTypeField->InsertNextValue ((*it)->elemKind ());
-
-            if (deletedField)
-                deletedField->InsertNextValue (_deleted[kind][index]);
-            
-            if (sigmaField) {
-                sigmaField->InsertNextTuple (_sigma[kind][index].val);
-
-                // calculate custom fields
-                float a, b, c, d, e, f;
-                float sigma[6] = {
-                    _sigma[kind][index].val[0], _sigma[kind][index].val[1], _sigma[kind][index].val[2],
-                    _sigma[kind][index].val[3], _sigma[kind][index].val[4], _sigma[kind][index].val[5],
-                };
-                
-                a = sigma[0] - sigma[1];
-                b = sigma[1] - sigma[2];
-                c = sigma[2] - sigma[0];
-
-                d = sigma[3];
-                e = sigma[4];
-                f = sigma[5];
-
-                vm_stressField->InsertNextValue (sqrt ((a*a + b*b + c*c + 6*(d*d+e*e+f*f)) / 2));
-
-                a = -(sigma[0]+sigma[1]+sigma[2]);
-
-                hydroPressureField->InsertNextValue (a / 3.0);
-
-                float data[3];
-                
-                resolveInvariants (data, _sigma[kind][index]);
-                pri_stressField->InsertNextTuple (data);
-
-                float data2[3] = {
-                    (data[0]-data[1]),
-                    (data[1]-data[2]),
-                    (data[2]-data[0])
-                };
-
-                float oct_shear = sqrt (data2[0]*data2[0] + data2[1]*data2[1] + data2[2]*data2[2]) / 3;
-
-                oct_shearStressField->InsertNextValue (oct_shear);
-                
-                data2[0] /= 2;
-                data2[1] /= 2;
-                data2[2] /= 2;
-                
-                pri_shearStressField->InsertNextTuple (data2);
-                
-            }
-            if (plStrainField)
-                plStrainField->InsertNextValue (_pl_strain[kind][index]);
+    if (opts->pieces () > 1)
+        runConcurrently (3, [&] (unsigned int grid) { orderCells (grid); });
+}
 
-            if (strainField) {
-                strainField->InsertNextTuple (_strain[kind][index].val);
 
-                float data[3];
-                
-                resolveInvariants (data, _strain[kind][index]);
-                pri_strainField->InsertNextTuple (data);
-            }
+// File handle must be positioned at the begining
+// of gemetry block
+void D3PlotGeometry::readGeometry (D3PlotFile* f)
+{
+    D3PlotControl* ctl = _ctl;
+    int i, j;
 
-            if (innerSigmaField) {
-                innerSigmaField->InsertNextTuple (_innerSigma[index].val);
-                outerSigmaField->InsertNextTuple (_outerSigma[index].val);
-                innerPlStrainField->InsertNextValue (_pl_innerStrain[index]);
-                outerPlStrainField->InsertNextValue (_pl_outerStrain[index]);
+    // --[ Nodes ]------------------------------------------------
+    // read points
+    f->readBlock (_nodes, sizeof (node_coord_t) * _points);
 
-                if (_ctl->istrn ()) {
-                    innerStrainField->InsertNextTuple (_innerStrain[index].val);
-                    outerStrainField->InsertNextTuple (_outerStrain[index].val);
-                }
-                
-                bendingMomentField->InsertNextTuple (_bendingMoment[index].val);
-                shearResultantField->InsertNextTuple (_shearResultant[index].val);
-                normalResultantField->InsertNextTuple (_normalResultant[index].val);
-                thicknessField->InsertNextValue (_thickness[index]);
-                elemDepValField->InsertNextTuple (_elemDepVar[index].val);
-                energyField->InsertNextValue (_energy[index]);
-            }
+    // --[ Solids ]------------------------------------------------
+    // every solid is 8 node IDs followed by part ID
+    unsigned int count = ctl->num_8_node_elems () + ctl->thick_shell_elems ();
+    const unsigned int* data = f->map<unsigned int> ((size_t)count * 9);
+
+    if (!data)
+        count = 0;
+
+    _cells[gridSolids].reserve (count, count * 8);
+
+    for (i = 0; i < count; i++, data += 9) {
+        unsigned int nodes[8], partID, elemKind;
+        int pts = 0;
+
+        partID = data[8];
+
+        for (j = 0; j < 8; j++) {
+            nodes[j] = data[j] - 1;
+            if (j == 0 || nodes[j] != nodes[j-1])
+                pts++;
+            else
+                break;
         }
 
-        index++;
-        it++;
-    }
-
-    appendCellArray (grid, partIDField);
-    appendCellArray (grid, elementTypeField);
-    appendCellArray (grid, deletedField);
-    appendCellArray (grid, sigmaField);
-    appendCellArray (grid, vm_stressField);
-    appendCellArray (grid, pri_stressField);
-    appendCellArray (grid, hydroPressureField);
-    appendCellArray (grid, pri_shearStressField);
-    appendCellArray (grid, oct_shearStressField);
-    appendCellArray (grid, plStrainField);
-    appendCellArray (grid, strainField);
-    appendCellArray (grid, pri_strainField);
-
-    appendCellArray (grid, innerSigmaField);
-    appendCellArray (grid, outerSigmaField);
-    appendCellArray (grid, outerPlStrainField);
-    appendCellArray (grid, innerStrainField);
-    appendCellArray (grid, outerStrainField);
-
-    appendCellArray (grid, bendingMomentField);
-    appendCellArray (grid, shearResultantField);
-    appendCellArray (grid, normalResultantField);
-    appendCellArray (grid, thicknessField);
-    appendCellArray (grid, elemDepValField);
-    appendCellArray (grid, energyField);
-    
-    if (_stateMode) {
-        vtkFloatArray* velField = 0;
-        vtkFloatArray* accField = 0;
-        vtkFloatArray* deltaField = 0;
-        vtkFloatArray* coordsField = 0;
-        
-        if (_ctl->velocities ())
-            velField = createArray ("Velocity", 3);
-
-        if (_ctl->accelerations ())
-            accField = createArray ("Acceleration", 3);
-
-        deltaField  = createArray ("Delta Movements", 3);
-        coordsField = createArray ("Coords", 3);
-
-        // nodal values
-        for (int i = 0; i < _l2g_size[kind]; i++) {
-            unsigned int id = _local2global[kind][i];
-            if (velField)
-                velField->InsertNextTuple ((float*)&_vel[id]);
-            if (accField)
-                accField->InsertNextTuple ((float*)&_accel[id]);
-
-            deltaField->InsertNextTuple ((float*)&_deltas[id]);
-            coordsField->InsertNextTuple ((float*)&_nodes[id]);
+        switch (pts) {
+        case 8:
+            elemKind = cellHexahedron;
+            _hexas++;
+            break;
+
+        case 5:
+            elemKind = cellPyramid;
+            _pyramids++;
+            break;
+
+        case 4:
+            elemKind = cellTetra;
+            _tetras++;
+            break;
+
+        case 6:
+            elemKind = cellWedge;
+            _wedges++;
+            break;
+
+        default:
+            printf ("Unknown amount of vertices = %d\n", pts);
         }
 
-        if (velField) {
-            grid->GetPointData ()->AddArray (velField);
-            velField->Delete ();
+        _cells[gridSolids].append (nodes, pts, partID, elemKind);
+    }
+
+    // --[ Beams ]------------------------------------------------
+    // 2 node IDs, orientation node, 2 nulls, part ID
+    data = f->map<unsigned int> ((size_t)ctl->num_2_node_elems () * 6);
+    count = data ? ctl->num_2_node_elems () : 0;
+    _cells[gridBeams].reserve (count, count * 2);
+
+    for (i = 0; i < count; i++, data += 6) {
+        unsigned int tmp[2] = { data[0] - 1, data[1] - 1 };
+
+        _cells[gridBeams].append (tmp, 2, data[5], cellLine);
+        _lines++;
+    }
+
+    // --[ Shells ]------------------------------------------------
+    // 4 node IDs followed by part ID
+    data = f->map<unsigned int> ((size_t)ctl->num_4_node_elems () * 5);
+    count = data ? ctl->num_4_node_elems () : 0;
+    _cells[gridShells].reserve (count, count * 4);
+
+    for (i = 0; i < count; i++, data += 5) {
+        unsigned int points[4];
+        unsigned int partID = data[4];
+
+        for (int j = 0; j < 4; j++)
+            points[j] = data[j] - 1;
+
+        if (points[3] == points[2]) {
+            _cells[gridShells].append (points, 3, partID, cellTriangle);
+            _triangles++;
         }
-        if (accField) {
-            grid->GetPointData ()->AddArray (accField);
-            accField->Delete ();
+        else {
+            _cells[gridShells].append (points, 4, partID, cellQuad);
+            _quads++;
         }
+    }
+}
 
-        grid->GetPointData ()->AddArray (deltaField);
-        deltaField->Delete ();
 
-        grid->GetPointData ()->AddArray (coordsField);
-        coordsField->Delete ();
-    }
+// --------------------------------------------------
+// geometry cache
+// --------------------------------------------------
+#define GEO_CACHE_MAGIC   "D3PGEO"
+#define GEO_CACHE_VERSION 2
+
+// cache is valid only for the same d3plot (size and mtime) and the
+// same control data
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    char model_descr[44];
+    long long size, mtime, mtime_nsec;
+    unsigned long long state_words;
+    unsigned int nodes;
+    unsigned int cells[3];
+} geo_cache_key_t;
+
+typedef struct {
+    geo_cache_key_t key;
+    unsigned int conn[3];       // connectivity sizes of grids
+    unsigned int stats[7];      // hexas, lines, ... wedges
+    unsigned int reserved;
+} geo_cache_header_t;
+
+
+static bool geoCacheKey (geo_cache_key_t* key, D3PlotFile* f, D3PlotControl* ctl)
+{
+    struct stat st;
+
+    if (stat (f->baseName (), &st) != 0)
+        return false;
+
+    memset (key, 0, sizeof (*key));
+    strcpy (key->magic, GEO_CACHE_MAGIC);
+    key->version = GEO_CACHE_VERSION;
+    strncpy (key->model_descr, ctl->model_descr (), sizeof (key->model_descr) - 1);
+    key->size = st.st_size;
+    key->mtime = st.st_mtime;
+#ifdef __APPLE__
+    key->mtime_nsec = st.st_mtimespec.tv_nsec;
+#else
+    key->mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+    key->state_words = ctl->state_words ();
+    key->nodes = ctl->nodes ();
+    key->cells[gridSolids] = ctl->num_8_node_elems () + ctl->thick_shell_elems ();
+    key->cells[gridShells] = ctl->num_4_node_elems ();
+    key->cells[gridBeams]  = ctl->num_2_node_elems ();
+    return true;
+}
+
+
+// sections of cache are 8 bytes aligned
+static size_t geoCacheAlign (size_t size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+
+// cells arrays of cache are checked before any of them is used: nodes
+// of every cell follow the previous one and are valid node IDs
+static bool geoCacheCells (unsigned int count, const unsigned int* offsets,
+                           const unsigned int* conn, unsigned int connSize, unsigned int points)
+{
+    if (offsets[0] || offsets[count] != connSize)
+        return false;
+
+    for (unsigned int i = 0; i < count; i++)
+        if (offsets[i + 1] < offsets[i] || offsets[i + 1] - offsets[i] > 8)
+            return false;
 
-    return grid;
+    for (unsigned int i = 0; i < connSize; i++)
+        if (conn[i] >= points)
+            return false;
+
+    return true;
 }
 
 
-// update maps local_pt->global_pt && global->local
-void D3PlotGeometry::updateMaps ()
+bool D3PlotGeometry::loadCache (const char* fileName, D3PlotFile* f)
 {
-    for (int grid = 0; grid < 3; grid++) {
-        if (!_cells[grid].size ())
-            continue;
+    geo_cache_key_t key;
 
-        if (_local2global[grid])
-            free (_local2global[grid]);
-        _local2global[grid] = (unsigned int*)malloc (sizeof (unsigned int) * _points);
-        _l2g_size[grid] = 0;
-        _global2local[grid].clear ();
+    if (!geoCacheKey (&key, f, _ctl))
+        return false;
 
-        std::vector<GenericCell*>::const_iterator solid = _cells[grid].begin ();
-        int index = 0;
+    int fd = open (fileName, O_RDONLY);
 
-        while (solid != _cells[grid].end ()) {
-            if (_opts->partIDCheck ((*solid)->partID ()))
-                if (!_stateMode || _opts->keepDeleted () || !_deleted[grid][index] ) {
-                    for (int i = 0; i < (*solid)->nodesCount (); i++) {
-                        // we have global node id
-                        int g;
+    if (fd < 0)
+        return false;
 
-                        g = (*solid)->node (i);
+    struct stat st;
+    void* map = MAP_FAILED;
 
-                        std::map<unsigned int, unsigned int>::const_iterator local = _global2local[grid].find (g);
+    if (fstat (fd, &st) == 0 && st.st_size >= (off_t)sizeof (geo_cache_header_t))
+        map = mmap (0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
 
-                        if (local == _global2local[grid].end ()) {
-                            _global2local[grid][g] = _l2g_size[grid];
-                            _local2global[grid][_l2g_size[grid]++] = g;
-                        }
-                    }
-                }
+    if (map == MAP_FAILED)
+        return false;
+
+    const geo_cache_header_t* hdr = (const geo_cache_header_t*)map;
+    size_t size = geoCacheAlign (sizeof (*hdr)) + geoCacheAlign (_points * sizeof (node_coord_t));
+
+    for (int i = 0; i < 3; i++)
+        size += geoCacheAlign ((key.cells[i] + 1) * sizeof (unsigned int)) +
+            geoCacheAlign (hdr->conn[i] * sizeof (unsigned int)) +
+            geoCacheAlign (key.cells[i] * sizeof (unsigned int)) +
+            geoCacheAlign (key.cells[i]);
+
+    if (memcmp (&hdr->key, &key, sizeof (key)) || size != (size_t)st.st_size) {
+        munmap (map, st.st_size);
+        return false;
+    }
 
-            solid++;
-            index++;
+    const char* p = (const char*)map + geoCacheAlign (sizeof (*hdr));
+    const char* coords = p;
+
+    p += geoCacheAlign (_points * sizeof (node_coord_t));
+
+    const char* grids[3];
+
+    for (int i = 0; i < 3; i++) {
+        grids[i] = p;
+        if (!geoCacheCells (key.cells[i], (const unsigned int*)p,
+                            (const unsigned int*)(p + geoCacheAlign ((key.cells[i] + 1) * sizeof (unsigned int))),
+                            hdr->conn[i], _points)) {
+            munmap (map, st.st_size);
+            return false;
         }
+
+        p += geoCacheAlign ((key.cells[i] + 1) * sizeof (unsigned int)) +
+            geoCacheAlign (hdr->conn[i] * sizeof (unsigned int)) +
+            geoCacheAlign (key.cells[i] * sizeof (unsigned int)) +
+            geoCacheAlign (key.cells[i]);
     }
-}
 
+    // coordinates are modified by states, so they are copied
+    memcpy (_nodes, coords, _points * sizeof (node_coord_t));
 
+    for (int i = 0; i < 3; i++) {
+        p = grids[i];
 
-vtkPoints* D3PlotGeometry::getPoints (grid_kind_t grid)
-{
-    vtkPoints* points = vtkPoints::New ();
+        const unsigned int* offsets = (const unsigned int*)p;
+        p += geoCacheAlign ((key.cells[i] + 1) * sizeof (unsigned int));
+        const unsigned int* conn = (const unsigned int*)p;
+        p += geoCacheAlign (hdr->conn[i] * sizeof (unsigned int));
+        const unsigned int* partIDs = (const unsigned int*)p;
+        p += geoCacheAlign (key.cells[i] * sizeof (unsigned int));
+        const unsigned char* types = (const unsigned char*)p;
 
-    for (int i = 0; i < _l2g_size[grid]; i++)
-        points->InsertNextPoint ((float*)&_nodes[_local2global[grid][i]]);
+        _cells[i].attach (key.cells[i], offsets, conn, partIDs, types);
+    }
+
+    _hexas     = hdr->stats[0];
+    _lines     = hdr->stats[1];
+    _triangles = hdr->stats[2];
+    _quads     = hdr->stats[3];
+    _pyramids  = hdr->stats[4];
+    _tetras    = hdr->stats[5];
+    _wedges    = hdr->stats[6];
 
-    return points;
+    _cacheMap = map;
+    _cacheSize = st.st_size;
+    return true;
 }
 
 
+static bool geoCacheWrite (FILE* out, const void* data, size_t size)
+{
+    static const char pad[8] = { 0 };
+    size_t rest = geoCacheAlign (size) - size;
+
+    return (!size || fwrite (data, size, 1, out) == 1) &&
+        (!rest || fwrite (pad, rest, 1, out) == 1);
+}
+
 
-bool D3PlotGeometry::save (const char* baseName, int index)
+bool D3PlotGeometry::saveCache (const char* fileName, D3PlotFile* f) const
 {
-    PVDWriter writer (baseName, _opts->pvdMode (), index);
-    const char* names[] = { "solids", "shells", "beams" };
+    geo_cache_header_t hdr;
+
+    memset (&hdr, 0, sizeof (hdr));
+    if (!geoCacheKey (&hdr.key, f, _ctl))
+        return false;
 
     for (int i = 0; i < 3; i++)
-        if (_cells[i].size ())
-            writer.appendPart (names[i], createGrid ((grid_kind_t)i));
+        hdr.conn[i] = _cells[i].connSize ();
 
-    writer.write ();
+    hdr.stats[0] = _hexas;
+    hdr.stats[1] = _lines;
+    hdr.stats[2] = _triangles;
+    hdr.stats[3] = _quads;
+    hdr.stats[4] = _pyramids;
+    hdr.stats[5] = _tetras;
+    hdr.stats[6] = _wedges;
 
-    return true;
+    // written aside and renamed into place, other converters of the
+    // family may have the old cache mapped or write it at the same time
+    char tmpName[1024];
+
+    snprintf (tmpName, sizeof (tmpName), "%s.%d.tmp", fileName, (int)getpid ());
+    FILE* out = fopen (tmpName, "wb");
+
+    if (!out)
+        return false;
+
+    bool ok = geoCacheWrite (out, &hdr, sizeof (hdr)) &&
+        geoCacheWrite (out, _nodes, _points * sizeof (node_coord_t));
+
+    for (int i = 0; i < 3 && ok; i++) {
+        const CellArray& cells = _cells[i];
+
+        ok = geoCacheWrite (out, cells.offsets (), (cells.size () + 1) * sizeof (unsigned int)) &&
+            geoCacheWrite (out, cells.conn (), cells.connSize () * sizeof (unsigned int)) &&
+            geoCacheWrite (out, cells.partIDs (), cells.size () * sizeof (unsigned int)) &&
+            geoCacheWrite (out, cells.types (), cells.size ());
+    }
+
+    if (fclose (out))
+        ok = false;
+    if (ok && rename (tmpName, fileName))
+        ok = false;
+    if (!ok)
+        unlink (tmpName);
+    return ok;
 }
 
 
-void D3PlotGeometry::resetState ()
+D3PlotGeometry::D3PlotGeometry (D3PlotGeometry* geo)
+    : _ctl (geo->_ctl),
+      _opts (geo->_opts),
+      _points (geo->_points),
+      _hexas (geo->_hexas),
+      _lines (geo->_lines),
+      _triangles (geo->_triangles),
+      _quads (geo->_quads),
+      _pyramids (geo->_pyramids),
+      _tetras (geo->_tetras),
+      _wedges (geo->_wedges),
+      _stateMode (geo->_stateMode),
+      _solidDecoder (geo->_solidDecoder),
+      _shellDecoder (geo->_shellDecoder),
+      _cacheMap (0),
+      _cacheSize (0),
+      _pool (geo->_pool),
+      _master (geo->_master ? geo->_master : geo)
 {
-    int i;
+    _nodes  = (node_coord_t*)malloc (_points * sizeof (node_coord_t));
+    _deltas = (node_coord_t*)malloc (_points * sizeof (node_coord_t));
+    memcpy (_nodes, geo->_nodes, _points * sizeof (node_coord_t));
+    memcpy (_deltas, geo->_deltas, _points * sizeof (node_coord_t));
 
-    for (i = 0; i < 3; i++) {
-        if (!_deleted[i] && _cells[i].size () > 0)
-            _deleted[i] = (bool*)malloc (_cells[i].size () * sizeof (bool));
-    
-        memset (_deleted[i], 0, _cells[i].size () * sizeof (bool));
+    for (int i = 0; i < 3; i++) {
+        const CellArray& cells = geo->_cells[i];
+
+        _cells[i].attach (cells.size (), cells.offsets (), cells.conn (),
+                          cells.partIDs (), cells.types ());
+
+        _local2global[i] = geo->_local2global[i];
+        _l2g_size[i] = geo->_l2g_size[i];
+        _global2local[i] = geo->_global2local[i];
+        _nodeRefs[i] = geo->_nodeRefs[i];
+        _live[i] = geo->_live[i];
+        _liveCells[i] = geo->_liveCells[i];
+        _localConn[i] = geo->_localConn[i];
+        _topoRev[i] = geo->_topoRev[i];
+        _topoKey[i] = geo->_topoKey[i];
+        _pieces[i] = geo->_pieces[i];
+        _piecesRev[i] = geo->_piecesRev[i];
+        _deleted[i] = geo->_deleted[i];
+    }
 
-        if (i != gridBeams) {
-            _sigma[i].resize (_cells[i].size ());
-            _pl_strain[i].resize (_cells[i].size ());
-            if (_ctl->istrn () && i != gridShells)
-                _strain[i].resize (_cells[i].size ());
-        }
+    memcpy (_outputField, geo->_outputField, sizeof (_outputField));
+    memcpy (_decodeField, geo->_decodeField, sizeof (_decodeField));
+    memcpy (_quantBound, geo->_quantBound, sizeof (_quantBound));
+    memcpy (_quantRelative, geo->_quantRelative, sizeof (_quantRelative));
+}
+
+
+D3PlotGeometry::~D3PlotGeometry ()
+{
+    for (int i = 0; i < 3; i++) {
+        _local2global[i].clear ();
+        _global2local[i].clear ();
+        _deleted[i].clear ();
+        _sigma[i].clear ();
+        _pl_strain[i].clear ();
+        _strain[i].clear ();
     }
 
-    _innerSigma.resize (_cells[gridShells].size ());
-    _outerSigma.resize (_cells[gridShells].size ());
-    _pl_innerStrain.resize (_cells[gridShells].size ());
-    _pl_outerStrain.resize (_cells[gridShells].size ());
+    free (_nodes);
+    free (_deltas);
+    if (_cacheMap)
+        munmap (_cacheMap, _cacheSize);
+    _archive.close ();
+    _collection.close ();
+    if (!_master)
+        delete _pool;
+    _vel.clear ();
+    _accel.clear ();
+    _innerSigma.clear ();
+    _outerSigma.clear ();
+    _pl_innerStrain.clear ();
+    _pl_outerStrain.clear ();
+    _innerStrain.clear ();
+    _outerStrain.clear ();
+}
+
 
-    _bendingMoment.resize (_cells[gridShells].size ());
-    _shearResultant.resize (_cells[gridShells].size ());
-    _normalResultant.resize (_cells[gridShells].size ());
-    _thickness.resize (_cells[gridShells].size ());
-    _elemDepVar.resize (_cells[gridShells].size ());
-    _energy.resize (_cells[gridShells].size ());
-    
-    if (_ctl->istrn ()) {
-        _innerStrain.resize (_cells[gridShells].size ());
-        _outerStrain.resize (_cells[gridShells].size ());
+bool D3PlotGeometry::closeOutput ()
+{
+    return _archive.close ();
+}
+
+
+const float* D3PlotGeometry::cellValues (grid_kind_t kind, int field)
+{
+    switch (field) {
+    case fieldSigma:
+        return _sigma[kind].empty () ? 0 : _sigma[kind][0].val;
+    case fieldPlStrain:
+        return _pl_strain[kind].empty () ? 0 : &_pl_strain[kind][0];
+    case fieldStrain:
+        return !_ctl->istrn () || _strain[kind].empty () ? 0 : _strain[kind][0].val;
     }
 
-    if (_ctl->velocities ())
-        _vel.resize (_ctl->nodes ());
+    // the rest is known for shells only
+    if (kind != gridShells)
+        return 0;
+
+    switch (field) {
+    case fieldInnerSigma:
+        return _innerSigma.empty () ? 0 : _innerSigma[0].val;
+    case fieldOuterSigma:
+        return _outerSigma.empty () ? 0 : _outerSigma[0].val;
+    case fieldInnerPlStrain:
+        return _pl_innerStrain.empty () ? 0 : &_pl_innerStrain[0];
+    case fieldOuterPlStrain:
+        return _pl_outerStrain.empty () ? 0 : &_pl_outerStrain[0];
+    case fieldInnerStrain:
+        return !_ctl->istrn () || _innerStrain.empty () ? 0 : _innerStrain[0].val;
+    case fieldOuterStrain:
+        return !_ctl->istrn () || _outerStrain.empty () ? 0 : _outerStrain[0].val;
+    case fieldBendingMoment:
+        return _bendingMoment.empty () ? 0 : _bendingMoment[0].val;
+    case fieldShearResultant:
+        return _shearResultant.empty () ? 0 : _shearResultant[0].val;
+    case fieldNormalResultant:
+        return _normalResultant.empty () ? 0 : _normalResultant[0].val;
+    case fieldThickness:
+        return _thickness.empty () ? 0 : &_thickness[0];
+    case fieldElemDepValue:
+        return _elemDepVar.empty () ? 0 : _elemDepVar[0].val;
+    case fieldEnergy:
+        return _energy.empty () ? 0 : &_energy[0];
+    }
 
-    if (_ctl->accelerations ())
-        _accel.resize (_ctl->nodes ());
+    return 0;
+}
 
-    
-    _stateMode = true;
+
+// Derived values of all cells of the grid are computed at once, so
+// pieces of the grid can share them.
+void D3PlotGeometry::computeDerived (grid_kind_t kind, VTUWriter* store, float* derived[fieldsCount])
+{
+    const float* sigma = cellValues (kind, fieldSigma);
+    const float* strain = cellValues (kind, fieldStrain);
+    size_t all = _cells[kind].size ();
+    int id;
+
+    for (id = 0; id < fieldsCount; id++) {
+        int input = fields_info[id].input;
+
+        derived[id] = 0;
+        if (input >= 0 && _outputField[id] && cellValues (kind, input))
+            derived[id] = store->allocate<float> (all * fields_info[id].components);
+    }
+
+    if (derived[fieldVonMises] || derived[fieldPrincipalStress] || derived[fieldHydroPressure] ||
+        derived[fieldPrincipalShear] || derived[fieldOctahedralShear])
+        tensorInvariants (sigma, all, derived[fieldPrincipalStress], derived[fieldVonMises],
+                          derived[fieldHydroPressure], derived[fieldPrincipalShear],
+                          derived[fieldOctahedralShear]);
+
+    if (derived[fieldPrincipalStrain])
+        tensorInvariants (strain, all, derived[fieldPrincipalStrain], 0, 0, 0, 0);
 }
 
 
-void D3PlotGeometry::markDeleted (unsigned int cell)
+// Same arrays as createGrid produces, but nothing is copied: points,
+// connectivity and fields are picked from geometry buffers by the
+// writer. Only offsets, types and derived values are computed here.
+void D3PlotGeometry::createVTU (grid_kind_t kind, VTUWriter* w, const grid_piece_t* piece,
+                                float* const* derived)
 {
-    for (int i = 0; i < 3; i++)
-        if (cell > _cells[i].size ())
-            cell -= _cells[i].size ();
-        else {
-            _deleted[i][cell] = true;
-            break;
-        }
+    const CellArray& cells = _cells[kind];
+    const std::vector<unsigned int>& live = piece ? piece->cells : _liveCells[kind];
+    const std::vector<unsigned int>& conn = piece ? piece->conn : _localConn[kind];
+    unsigned int points = piece ? piece->local2global.size () : _l2g_size[kind];
+    const unsigned int* l2g = !points ? 0 : piece ? &piece->local2global[0] : &_local2global[kind][0];
+    const unsigned int* index = live.empty () ? 0 : &live[0];
+    size_t count = live.size (), i;
+
+    w->setCompression (_opts->codec (), _opts->level (), _pool);
+    w->setPoints ((const float*)_nodes, points, l2g);
+
+    unsigned int* offsets = w->allocate<unsigned int> (count);
+    unsigned char* types = w->allocate<unsigned char> (count);
+    unsigned int* elementTypes = w->allocate<unsigned int> (count);
+    unsigned int pos = 0;
+
+    for (i = 0; i < count; i++) {
+        pos += cells.nodesCount (index[i]);
+        offsets[i] = pos;
+        types[i] = elementTypes[i] = cells.type (index[i]);
+    }
+
+    w->setCells (count, conn.empty () ? 0 : &conn[0], offsets, types);
+    w->addCellArray ("PartID", VTUWriter::typeUInt32, 1, cells.partIDs (), index);
+    w->addCellArray ("ElementType", VTUWriter::typeUInt32, 1, elementTypes);
+
+    if (_opts->keepDeleted () && !_deleted[kind].empty ()) {
+        unsigned char* deleted = w->allocate<unsigned char> (count);
+
+        for (i = 0; i < count; i++)
+            deleted[i] = isDeleted (kind, index[i]);
+        w->addCellArray ("Deleted", VTUWriter::typeUInt8, 1, deleted);
+    }
+
+    if (!_stateMode)
+        return;
+
+    float* own[fieldsCount];
+
+    if (!derived) {
+        computeDerived (kind, w, own);
+        derived = own;
+    }
+
+    for (int id = 0; id < fieldsCount; id++) {
+        const field_info_t& info = fields_info[id];
+        const float* values = info.input >= 0 ? derived[id] : cellValues (kind, id);
+
+        if (!info.point && _outputField[id] && values)
+            w->addCellArray (info.name, VTUWriter::typeFloat32, info.components, values, index);
+    }
+
+    // nodal values
+    const float* nodal[4] = {
+        _vel.empty () ? 0 : (const float*)&_vel[0],
+        _accel.empty () ? 0 : (const float*)&_accel[0],
+        (const float*)_deltas,
+        (const float*)_nodes,
+    };
+    const int nodalFields[4] = { fieldVelocity, fieldAcceleration, fieldDeltas, fieldCoords };
+
+    for (i = 0; i < 4; i++)
+        if (_outputField[nodalFields[i]] && nodal[i])
+            w->addPointArray (fields_info[nodalFields[i]].name, VTUWriter::typeFloat32, 3,
+                              nodal[i], l2g);
+
+    // lossy fields, arrays which cannot meet their bound stay exact
+    for (int id = 0; id < fieldsCount; id++)
+        if (_quantBound[id] > 0)
+            w->quantizeArray (fields_info[id].name, _quantBound[id], _quantRelative[id]);
 }
 
 
-void D3PlotGeometry::movePoint (unsigned int id, float* data)
+// update maps local_pt->global_pt && global->local of one grid. Node
+// usage is reference counted, so only cells which became live or dead
+// since previous call are visited. New nodes get local IDs at the end,
+// released nodes are squeezed out keeping order of the rest.
+void D3PlotGeometry::updateMap (int grid)
 {
-    _deltas[id].x = data[0]-_nodes[id].x;
-    _deltas[id].y = data[1]-_nodes[id].y;
-    _deltas[id].z = data[2]-_nodes[id].z;
+    const CellArray& cells = _cells[grid];
+    std::vector<unsigned int>& g2l = _global2local[grid];
+    std::vector<unsigned int>& l2g = _local2global[grid];
+    std::vector<unsigned int>& refs = _nodeRefs[grid];
+    std::vector<unsigned char>& live = _live[grid];
+    unsigned int size = _l2g_size[grid];
+    bool changed = false, released = false;
+
+    if (live.empty ()) {
+        g2l.assign (_points, NO_NODE);
+        l2g.resize (_points);
+        refs.assign (_points, 0);
+        live.assign (cells.size (), 0);
+        changed = true;
+    }
+
+    for (unsigned int index = 0; index < cells.size (); index++) {
+        unsigned char alive = _opts->partIDCheck (cells.partID (index)) &&
+            (!_stateMode || _opts->keepDeleted () || !isDeleted (grid, index));
+
+        if (alive == live[index])
+            continue;
+
+        const unsigned int* nodes = cells.nodes (index);
+
+        live[index] = alive;
+        changed = true;
+
+        for (int i = 0; i < cells.nodesCount (index); i++) {
+            unsigned int g = nodes[i];
+
+            if (alive) {
+                if (!refs[g]++ && g2l[g] == NO_NODE) {
+                    g2l[g] = size;
+                    l2g[size++] = g;
+                }
+            }
+            else if (!--refs[g])
+                released = true;
+        }
+    }
+
+    if (released) {
+        unsigned int kept = 0;
+
+        for (unsigned int i = 0; i < size; i++) {
+            unsigned int g = l2g[i];
+
+            if (refs[g]) {
+                g2l[g] = kept;
+                l2g[kept++] = g;
+            }
+            else
+                g2l[g] = NO_NODE;
+        }
+        size = kept;
+    }
+
+    _l2g_size[grid] = size;
+
+    if (!changed)
+        return;
+
+    // connectivity of live cells in local IDs
+    _liveCells[grid].clear ();
+    _localConn[grid].clear ();
+    _liveCells[grid].reserve (cells.size () - deletedCount (grid));
 
-    _nodes[id].x = data[0];
-    _nodes[id].y = data[1];
-    _nodes[id].z = data[2];
+    for (unsigned int index = 0; index < cells.size (); index++)
+        if (live[index]) {
+            const unsigned int* nodes = cells.nodes (index);
+
+            _liveCells[grid].push_back (index);
+            for (int i = 0; i < cells.nodesCount (index); i++)
+                _localConn[grid].push_back (g2l[nodes[i]]);
+        }
+
+    _topoRev[grid]++;
+
+    // FNV-1a of live cells
+    uint64_t key = 14695981039346656037ull;
+
+    for (size_t i = 0; i < _liveCells[grid].size (); i++)
+        key = (key ^ _liveCells[grid][i]) * 1099511628211ull;
+    _topoKey[grid] = key;
 }
 
 
-void D3PlotGeometry::setVelocity (unsigned int node, float* val)
+// grids are independent, so they are processed in parallel
+void D3PlotGeometry::updateMaps ()
 {
-    _vel[node].x = val[0];
-    _vel[node].y = val[1];
-    _vel[node].z = val[2];
+    std::vector<int> grids;
+
+    for (int grid = 0; grid < 3; grid++)
+        if (_cells[grid].size ())
+            grids.push_back (grid);
+
+    runConcurrently (grids.size (), [&] (unsigned int i) { updateMap (grids[i]); });
 }
 
 
-void D3PlotGeometry::setAcceleration (unsigned int node, float* val)
+
+// spreads low 21 bits of v to every third bit
+static inline uint64_t spreadBits (uint64_t v)
 {
-    _accel[node].x = val[0];
-    _accel[node].y = val[1];
-    _accel[node].z = val[2];
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8)  & 0x100f00f00f00f00full;
+    v = (v | v << 4)  & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2)  & 0x1249249249249249ull;
+    return v;
 }
 
 
-void D3PlotGeometry::setSigma (int grid, unsigned int cell, float* val, shell_pos_t shellPos)
+// Orders cells of grid by Morton code of their centers in initial
+// coordinates, so runs of the order are compact in space. Parts are
+// assigned to pieces largest first, each to the smallest piece so far.
+void D3PlotGeometry::orderCells (int grid)
 {
-    if (shellPos != shellMiddle && grid != gridShells)
+    const CellArray& cells = _cells[grid];
+    std::vector<std::pair<uint64_t, unsigned int> > keys (cells.size ());
+    float lo[3], hi[3];
+    double scale[3];
+    unsigned int index;
+    int k;
+
+    const float* coords = (const float*)_nodes;
+
+    for (k = 0; k < 3; k++)
+        lo[k] = hi[k] = _points ? coords[k] : 0;
+
+    for (unsigned int i = 0; i < _points; i++)
+        for (k = 0; k < 3; k++) {
+            lo[k] = std::min (lo[k], coords[(size_t)i * 3 + k]);
+            hi[k] = std::max (hi[k], coords[(size_t)i * 3 + k]);
+        }
+
+    for (k = 0; k < 3; k++)
+        scale[k] = hi[k] > lo[k] ? 0x1fffff / ((double)hi[k] - lo[k]) : 0;
+
+    for (index = 0; index < cells.size (); index++) {
+        const unsigned int* nodes = cells.nodes (index);
+        int count = cells.nodesCount (index);
+        uint64_t code = 0;
+
+        for (k = 0; k < 3; k++) {
+            double center = 0;
+
+            for (int i = 0; i < count; i++)
+                center += coords[(size_t)nodes[i] * 3 + k];
+
+            // rounding may step out of the box a little
+            double q = (center / count - lo[k]) * scale[k];
+
+            code |= spreadBits ((uint64_t)std::max (0.0, std::min (q, (double)0x1fffff))) << k;
+        }
+
+        keys[index] = std::make_pair (code, index);
+    }
+
+    std::sort (keys.begin (), keys.end ());
+
+    _cellOrder[grid].resize (keys.size ());
+    for (index = 0; index < keys.size (); index++)
+        _cellOrder[grid][index] = keys[index].second;
+
+    if (_opts->pieceSplit () != splitPartID)
         return;
 
-    switch (shellPos) {
-    case shellMiddle:
-        for (int j = 0; j < 6; j++)
-            _sigma[grid][cell].val[j] = val[j];
-        break;
-    case shellInner:
-        for (int j = 0; j < 6; j++)
-            _innerSigma[cell].val[j] = val[j];
-        break;
-    case shellOuter:
-        for (int j = 0; j < 6; j++)
-            _outerSigma[cell].val[j] = val[j];
-        break;
+    std::map<unsigned int, unsigned int> sizes;
+    std::vector<std::pair<unsigned int, unsigned int> > parts;
+    std::vector<unsigned long long> loads (_opts->pieces (), 0);
+
+    for (index = 0; index < cells.size (); index++)
+        sizes[cells.partID (index)]++;
+
+    for (std::map<unsigned int, unsigned int>::iterator it = sizes.begin (); it != sizes.end (); ++it)
+        parts.push_back (std::make_pair (it->second, it->first));
+
+    std::sort (parts.rbegin (), parts.rend ());
+
+    for (size_t i = 0; i < parts.size (); i++) {
+        size_t piece = std::min_element (loads.begin (), loads.end ()) - loads.begin ();
+
+        _partPiece[grid][parts[i].second] = piece;
+        loads[piece] += parts[i].first;
     }
 }
 
 
-void D3PlotGeometry::setPlStrain (int grid, unsigned int cell, float val, shell_pos_t shellPos)
+// Splits live cells of grid into pieces and gives every piece its own
+// points in order of first use, done again only when topology changes.
+// Empty pieces are dropped.
+void D3PlotGeometry::splitGrid (int grid)
 {
-    if (shellPos != shellMiddle && grid != gridShells)
+    if (_piecesRev[grid] == _topoRev[grid] && !_pieces[grid].empty ())
         return;
 
-    switch (shellPos) {
-    case shellMiddle:
-        _pl_strain[grid][cell] = val;
-        break;
-    case shellInner:
-        _pl_innerStrain[cell] = val;
-        break;
-    case shellOuter:
-        _pl_outerStrain[cell] = val;
-        break;
+    const D3PlotGeometry* master = _master ? _master : this;
+    const CellArray& cells = _cells[grid];
+    const std::vector<unsigned int>& order = master->_cellOrder[grid];
+    const std::map<unsigned int, unsigned int>& partPiece = master->_partPiece[grid];
+    const std::vector<unsigned char>& live = _live[grid];
+    std::vector<grid_piece_t>& pieces = _pieces[grid];
+    unsigned int count = _opts->pieces ();
+    size_t liveCount = _liveCells[grid].size (), seen = 0, i;
+    bool byPart = _opts->pieceSplit () == splitPartID;
+
+    pieces.assign (count, grid_piece_t ());
+
+    for (i = 0; i < order.size (); i++) {
+        unsigned int index = order[i];
+
+        if (!live[index])
+            continue;
+
+        unsigned int piece = byPart ? partPiece.find (cells.partID (index))->second :
+                                      seen++ * count / liveCount;
+
+        pieces[piece].cells.push_back (index);
+    }
+
+    // global->local of one piece, reset through piece points
+    std::vector<unsigned int> g2l (_points, NO_NODE);
+
+    for (unsigned int p = 0; p < count; p++) {
+        grid_piece_t& piece = pieces[p];
+
+        for (i = 0; i < piece.cells.size (); i++) {
+            const unsigned int* nodes = cells.nodes (piece.cells[i]);
+
+            for (int j = 0; j < cells.nodesCount (piece.cells[i]); j++) {
+                unsigned int g = nodes[j];
+
+                if (g2l[g] == NO_NODE) {
+                    g2l[g] = piece.local2global.size ();
+                    piece.local2global.push_back (g);
+                }
+                piece.conn.push_back (g2l[g]);
+            }
+        }
+
+        for (i = 0; i < piece.local2global.size (); i++)
+            g2l[piece.local2global[i]] = NO_NODE;
     }
+
+    unsigned int kept = 0;
+
+    for (unsigned int p = 0; p < count; p++)
+        if (!pieces[p].cells.empty ()) {
+            if (p != kept)
+                std::swap (pieces[kept], pieces[p]);
+            kept++;
+        }
+
+    pieces.resize (std::max (kept, 1u));
+    _piecesRev[grid] = _topoRev[grid];
 }
 
 
-void D3PlotGeometry::setStrain   (int grid, unsigned int cell, float* val, shell_pos_t shellPos)
+
+void D3PlotGeometry::resetState ()
 {
-    if (shellPos != shellMiddle && grid != gridShells)
-        return;
+    int i;
 
-    switch (shellPos) {
-    case shellMiddle:
-        for (int j = 0; j < 6; j++)
-            _strain[grid][cell].val[j] = val[j];
-        break;
-    case shellInner:
-        for (int j = 0; j < 6; j++)
-            _innerStrain[cell].val[j] = val[j];
-        break;
-    case shellOuter:
-        for (int j = 0; j < 6; j++)
-            _outerStrain[cell].val[j] = val[j];
-        break;
+    for (i = 0; i < 3; i++) {
+        // bits are overwritten by setDeletion, without deletion
+        // data they stay clear
+        if (_deleted[i].empty ())
+            _deleted[i].assign ((_cells[i].size () + 63) / 64, 0);
+
+        // only decoded fields take memory
+        if (i != gridBeams) {
+            if (_decodeField[fieldSigma])
+                _sigma[i].resize (_cells[i].size ());
+            if (_decodeField[fieldPlStrain])
+                _pl_strain[i].resize (_cells[i].size ());
+            if (_ctl->istrn () && i != gridShells && _decodeField[fieldStrain])
+                _strain[i].resize (_cells[i].size ());
+        }
+    }
+
+    unsigned int shells = _cells[gridShells].size ();
+
+    if (_decodeField[fieldInnerSigma])
+        _innerSigma.resize (shells);
+    if (_decodeField[fieldOuterSigma])
+        _outerSigma.resize (shells);
+    if (_decodeField[fieldInnerPlStrain])
+        _pl_innerStrain.resize (shells);
+    if (_decodeField[fieldOuterPlStrain])
+        _pl_outerStrain.resize (shells);
+
+    if (_decodeField[fieldBendingMoment])
+        _bendingMoment.resize (shells);
+    if (_decodeField[fieldShearResultant])
+        _shearResultant.resize (shells);
+    if (_decodeField[fieldNormalResultant])
+        _normalResultant.resize (shells);
+    if (_decodeField[fieldThickness])
+        _thickness.resize (shells);
+    if (_decodeField[fieldElemDepValue])
+        _elemDepVar.resize (shells);
+    if (_decodeField[fieldEnergy])
+        _energy.resize (shells);
+    
+    if (_ctl->istrn ()) {
+        if (_decodeField[fieldInnerStrain])
+            _innerStrain.resize (shells);
+        if (_decodeField[fieldOuterStrain])
+            _outerStrain.resize (shells);
+    }
+
+    if (_ctl->velocities () && _decodeField[fieldVelocity])
+        _vel.resize (_ctl->nodes ());
+
+    if (_ctl->accelerations () && _decodeField[fieldAcceleration])
+        _accel.resize (_ctl->nodes ());
+
+    
+    _stateMode = true;
+}
+
+
+void D3PlotGeometry::setDeletion (const float* data)
+{
+    for (int i = 0; i < 3; i++) {
+        if (_cells[i].size ())
+            decodeDeletion (data, _cells[i].size (), &_deleted[i][0]);
+        data += _cells[i].size ();
     }
 }
 
 
+void D3PlotGeometry::movePoints (const node_coord_t* data)
+{
+    for (unsigned int id = 0; id < _points; id++) {
+        _deltas[id].x = data[id].x - _nodes[id].x;
+        _deltas[id].y = data[id].y - _nodes[id].y;
+        _deltas[id].z = data[id].z - _nodes[id].z;
+    }
+
+    memcpy (_nodes, data, _points * sizeof (node_coord_t));
+}
 
-void D3PlotGeometry::setBendingMoment (unsigned int localCell, float* val)
+
+void D3PlotGeometry::setCoords (const node_coord_t* data)
 {
-    for (int i = 0; i < 3; i++)
-        _bendingMoment[localCell].val[i] = val[i];
+    memcpy (_nodes, data, _points * sizeof (node_coord_t));
 }
 
 
-void D3PlotGeometry::setShearResultant (unsigned int localCell, float* val)
+void D3PlotGeometry::setVelocities (const node_coord_t* val)
 {
-    for (int i = 0; i < 2; i++)
-        _shearResultant[localCell].val[i] = val[i];
+    memcpy (&_vel[0], val, _vel.size () * sizeof (node_coord_t));
 }
 
 
-void D3PlotGeometry::setNormalResultant (unsigned int localCell, float* val)
+void D3PlotGeometry::setAccelerations (const node_coord_t* val)
 {
-    for (int i = 0; i < 3; i++)
-        _normalResultant[localCell].val[i] = val[i];
+    memcpy (&_accel[0], val, _accel.size () * sizeof (node_coord_t));
 }
 
 
-void D3PlotGeometry::setThickness (unsigned int localCell, float  val)
+// element values of state are written only into arrays of decoded
+// fields, every other value is left as is
+void D3PlotGeometry::decodeSolids (const float* data)
 {
-    _thickness[localCell] = val;
+    solid_targets_t t;
+
+    t.sigma     = _decodeField[fieldSigma] && !_sigma[gridSolids].empty () ? &_sigma[gridSolids][0] : 0;
+    t.pl_strain = _decodeField[fieldPlStrain] && !_pl_strain[gridSolids].empty () ? &_pl_strain[gridSolids][0] : 0;
+    t.strain    = _decodeField[fieldStrain] && !_strain[gridSolids].empty () ? &_strain[gridSolids][0] : 0;
+
+    if (t.sigma || t.pl_strain || t.strain)
+        _solidDecoder (data, _ctl->layout (), t);
 }
 
 
-void D3PlotGeometry::setElemDepVal (unsigned int localCell, float* val)
+// pointer to the first element of v, if field is decoded and present
+template <typename T>
+static T* target (std::vector<T>& v, bool decoded, int offset = 0)
 {
-    for (int i = 0; i < 2; i++)
-        _elemDepVar[localCell].val[i] = val[i];
+    return decoded && offset >= 0 && !v.empty () ? &v[0] : 0;
 }
 
 
-void D3PlotGeometry::setEnergy (unsigned int localCell, float  val)
+void D3PlotGeometry::decodeShells (const float* data)
 {
-    _energy[localCell] = val;
+    const state_layout_t& l = _ctl->layout ();
+    shell_targets_t t;
+
+    t.sigma[0]     = target (_sigma[gridShells], _decodeField[fieldSigma], l.shell_sigma);
+    t.sigma[1]     = target (_innerSigma, _decodeField[fieldInnerSigma], l.shell_sigma);
+    t.sigma[2]     = target (_outerSigma, _decodeField[fieldOuterSigma], l.shell_sigma);
+    t.pl_strain[0] = target (_pl_strain[gridShells], _decodeField[fieldPlStrain], l.shell_pl_strain);
+    t.pl_strain[1] = target (_pl_innerStrain, _decodeField[fieldInnerPlStrain], l.shell_pl_strain);
+    t.pl_strain[2] = target (_pl_outerStrain, _decodeField[fieldOuterPlStrain], l.shell_pl_strain);
+    t.bending      = target (_bendingMoment, _decodeField[fieldBendingMoment], l.shell_bending);
+    t.shear        = target (_shearResultant, _decodeField[fieldShearResultant], l.shell_shear);
+    t.normal       = target (_normalResultant, _decodeField[fieldNormalResultant], l.shell_normal);
+    t.thickness    = target (_thickness, _decodeField[fieldThickness], l.shell_thickness);
+    t.elem_dep     = target (_elemDepVar, _decodeField[fieldElemDepValue], l.shell_elem_dep);
+    t.strain[0]    = target (_innerStrain, _decodeField[fieldInnerStrain], l.shell_strain);
+    t.strain[1]    = target (_outerStrain, _decodeField[fieldOuterStrain], l.shell_strain);
+    t.energy       = target (_energy, _decodeField[fieldEnergy], l.shell_energy);
+
+    if (l.shells.count)
+        _shellDecoder (data, l, t);
 }
 
 
 
 // --------------------------------------------------
-// pvdwriter
+// PVDCollection
 // --------------------------------------------------
-PVDWriter::PVDWriter (const char* baseName, bool pvd_mode, int index)
-    : _baseName (baseName),
-      _pvd_mode (pvd_mode),
-      _index (index)
+static const char pvd_footer[] = "</Collection>\n</VTKFile>\n";
+
+
+PVDCollection::PVDCollection ()
+    : _f (0),
+      _end (0),
+      _merge (false)
+{
+}
+
+
+PVDCollection::~PVDCollection ()
 {
+    close ();
 }
 
 
-PVDWriter::~PVDWriter ()
+bool PVDCollection::open (const char* fileName, const char* compressor, bool extend)
 {
-    std::vector<vtkUnstructuredGrid*>::iterator it = _grids.begin ();
+    std::lock_guard<std::mutex> lock (_lock);
+
+    if (_f)
+        return true;
+
+    _fileName = fileName;
+    _header = "<?xml version=\"1.0\"?>\n"
+        "<VTKFile type=\"Collection\" version=\"0.1\" byte_order=\"LittleEndian\"";
+    if (compressor)
+        _header += std::string (" compressor=\"") + compressor + "\"";
+    _header += ">\n<Collection>\n";
+
+    // Series of the same output settings is extended by conversion of
+    // a range of states. Its entries are merged with new ones on the
+    // first append, until then the file stays as it is.
+    if (extend && (_f = fopen (fileName, "r+"))) {
+        std::string text;
+        char buf[4096];
+        size_t n;
+
+        while ((n = fread (buf, 1, sizeof (buf), _f)) > 0)
+            text.append (buf, n);
+
+        size_t end = text.rfind ("</Collection>");
+
+        if (end != std::string::npos && end >= _header.size () &&
+            !text.compare (0, _header.size (), _header)) {
+            size_t pos = _header.size ();
+
+            _old.clear ();
+            while (pos < end) {
+                size_t eol = text.find ('\n', pos);
+
+                if (eol == std::string::npos || eol > end)
+                    eol = end;
+                if (!text.compare (pos, 9, "<DataSet "))
+                    _old.push_back (text.substr (pos, eol - pos));
+                pos = eol + 1;
+            }
+
+            _end = end;
+            _merge = true;
+            return true;
+        }
 
-    while (it != _grids.end ()) {
-        (*it)->Delete ();
-        it++;
+        // other settings or not a collection written by us
+        fclose (_f);
     }
-}
 
+    _f = fopen (fileName, "w+");
+
+    if (!_f)
+        return false;
+
+    _end = _header.size ();
+    fputs (_header.c_str (), _f);
+    fputs (pvd_footer, _f);
+
+    return fflush (_f) == 0;
+}
 
 
-void PVDWriter::appendPart (const char* baseName, vtkUnstructuredGrid* grid)
+void PVDCollection::close ()
 {
-    _names.push_back (baseName);
-    _grids.push_back (grid);
+    if (_f)
+        fclose (_f);
+    _f = 0;
+    _merge = false;
+    _old.clear ();
 }
 
 
-void PVDWriter::write ()
+// value of attribute of DataSet entry, empty if there is none
+static std::string pvdAttribute (const std::string& entry, const char* name)
 {
-    static char buf[1024];
+    std::string key = std::string (" ") + name + "=\"";
+    size_t pos = entry.find (key);
 
-    if (_pvd_mode) {
-        // create parts directory
-        mkdir (_baseName, 0777);
+    if (pos == std::string::npos)
+        return std::string ();
 
-        // create pvd file
-        sprintf (buf, "%s.pvd", _baseName);
-        FILE* f = fopen (buf, "w+");
+    pos += key.size ();
+    return entry.substr (pos, entry.find ('"', pos) - pos);
+}
 
-        if (!f)
-            // throw an exception (TODO)
-            return;
 
-        // header
-        fprintf (f, "<?xml version=\"1.0\"?>\n");
-        fprintf (f, "<VTKFile type=\"Collection\" version=\"0.1\" byte_order=\"LittleEndian\" compressor=\"vtkZLibDataCompressor\">\n");
-        fprintf (f, "<Collection>\n");
+// Old entries of the same files, or at or past the first new state,
+// are dropped (converted again). The rest goes into a new file with
+// the new entries, renamed over the old one.
+bool PVDCollection::merge (float time, const std::vector<std::string>& files,
+                           const std::string& text)
+{
+    std::string all = _header;
 
-        // body
-        int index = 0;
-        std::vector<const char*>::const_iterator it = _names.begin ();
+    for (size_t i = 0; i < _old.size (); i++) {
+        std::string file = pvdAttribute (_old[i], "file");
 
-        const char* p = strrchr (_baseName, '/');
+        if (atof (pvdAttribute (_old[i], "timestep").c_str ()) >= time ||
+            std::find (files.begin (), files.end (), file) != files.end ())
+            continue;
+        all += _old[i] + "\n";
+    }
 
-        if (!p)
-            p = _baseName;
-        else
-            p++;
+    std::string tmpName = _fileName + ".tmp";
+    FILE* f = fopen (tmpName.c_str (), "w+");
 
-        while (it != _names.end ()) {
-            fprintf (f, "<DataSet part=\"%d\" file=\"%s/%s.vtu\"/>\n", index, p, *it);
-            it++;
-            index++;
-        }
+    if (!f)
+        return false;
 
-        // footer
-        fprintf (f, "</Collection>\n");
-        fprintf (f, "</VTKFile>\n");
+    size_t end = all.size () + text.size ();
 
+    all += text + pvd_footer;
+    if (fwrite (all.data (), 1, all.size (), f) != all.size () || fflush (f) ||
+        rename (tmpName.c_str (), _fileName.c_str ())) {
         fclose (f);
+        unlink (tmpName.c_str ());
+        return false;
+    }
 
-        // write datasets
-        std::vector<vtkUnstructuredGrid*>::const_iterator _it = _grids.begin ();
-        it = _names.begin ();
+    fclose (_f);
+    _f = f;
+    _end = end;
+    _merge = false;
+    _old.clear ();
 
-        while (_it != _grids.end ()) {
-            vtkXMLUnstructuredGridWriter* writer = vtkXMLUnstructuredGridWriter::New ();
+    return true;
+}
 
-            if (_index >= 0)
-                sprintf (buf, "%s/%s_%05d.vtu", _baseName, *it, _index);
-            else
-                sprintf (buf, "%s/%s.vtu", _baseName, *it);
-
-            writer->SetInput (*_it);
-            writer->SetFileName (buf);
-            writer->Write ();
-            writer->Delete ();
-            _it++;
-            it++;
-        }
-    } else {                    // if not pvd_mode
-        std::vector<vtkUnstructuredGrid*>::const_iterator _it = _grids.begin ();
-        std::vector<const char*>::const_iterator it = _names.begin ();
 
-        while (_it != _grids.end ()) {
-            vtkXMLUnstructuredGridWriter* writer = vtkXMLUnstructuredGridWriter::New ();
+// Entries and footer go by single write over the old footer, so the
+// file is never shorter than before and ends by footer once flushed.
+bool PVDCollection::append (float time, const std::vector<std::string>& files)
+{
+    std::string text;
+    char buf[64];
 
-            if (_index >= 0)
-                sprintf (buf, "%s_%s_%05d.vtu", _baseName, *it, _index);
-            else
-                sprintf (buf, "%s_%s.vtu", _baseName, *it);
-
-            writer->SetInput (*_it);
-            writer->SetFileName (buf);
-            writer->Write ();
-            writer->Delete ();
-            _it++;
-            it++;
-        }
+    for (size_t i = 0; i < files.size (); i++) {
+        sprintf (buf, "<DataSet timestep=\"%.9g\" part=\"%u\" ", time, (unsigned int)i);
+        text += buf;
+        text += "file=\"" + files[i] + "\"/>\n";
     }
 
+    std::lock_guard<std::mutex> lock (_lock);
+
+    if (!_f)
+        return false;
+
+    if (_merge)
+        return merge (time, files, text);
+
+    if (fseek (_f, _end, SEEK_SET))
+        return false;
+
+    size_t size = text.size ();
+
+    text += pvd_footer;
+    if (fwrite (text.data (), 1, text.size (), _f) != text.size () || fflush (_f))
+        return false;
+
+    _end += size;
+
+    return true;
 }
 
 
 // --------------------------------------------------
-// D3PlotState
+// D3PlotPrefetcher
 // --------------------------------------------------
-D3PlotState::D3PlotState (StateOptions* opts, D3PlotControl* ctl, D3PlotGeometry* geo, D3PlotFile* f)
-    : _opts (opts),
+D3PlotPrefetcher::D3PlotPrefetcher (D3PlotFile* f, D3PlotControl* ctl, unsigned int depth,
+                                    unsigned long long memCap, const D3PlotIndex* idx,
+                                    int first, int last, const std::vector<byte_range_t>* ranges)
+    : _f (f),
       _ctl (ctl),
-      _geo (geo),
-      _f (f)
+      _idx (idx),
+      _next (first),
+      _last (last),
+      _current (0),
+      _done (false),
+      _stop (false)
 {
-    _time = f->readFloat ();
-
-    if (_time < 0) {
-        if (!f->openNextFile ())
-            throw 0;            // End Of State
-        _time = f->readFloat ();
+    // mapped states are not copied, so memory cap only matters
+    // for plain reads
+    unsigned long long stateBytes = ctl->state_words () * WORD_SIZE;
+
+    if (ranges)
+        _ranges = *ranges;
+    else {
+        byte_range_t all = { 0, (size_t)(stateBytes - WORD_SIZE) };
+        _ranges.push_back (all);
     }
+
+    if (!f->mapped () && memCap && depth * stateBytes > memCap)
+        depth = memCap / stateBytes;
+    if (!depth)
+        depth = 1;
+
+    // one more buffer is held by consumer
+    _slots.resize (depth + 1);
+    for (unsigned int i = 0; i < _slots.size (); i++)
+        _free.push_back (&_slots[i]);
+
+    _thread = std::thread (&D3PlotPrefetcher::run, this);
 }
 
 
-D3PlotState::~D3PlotState ()
+D3PlotPrefetcher::~D3PlotPrefetcher ()
 {
+    {
+        std::unique_lock<std::mutex> lock (_lock);
+        _stop = true;
+    }
+    _cond.notify_all ();
+    _thread.join ();
 }
 
 
-void D3PlotState::read ()
+bool D3PlotPrefetcher::fetch (state_buffer_t* buf)
 {
-    int i;
+    if (_idx) {
+        if ((_last >= 0 && _next > _last) || _next >= (int)_idx->size ())
+            return false;
+        if (!_f->seek (_idx->state (_next).pos))
+            return false;
+    }
+    buf->index = _next++;
 
-    _f->skip (_ctl->num_global_vars () * 4);
+    if (!_f->readTime (&buf->time))
+        return false;
 
-    // here we must fetch deleted nodes/cells set to prevent their
-    // insertion into the fields
-    unsigned int skipWords =
-        _ctl->nodes () * 3 +
-        _ctl->velocities () * _ctl->nodes () * 3 +
-        _ctl->accelerations () * _ctl->nodes () * 3 +
-        (_ctl->num_8_node_elems () + _ctl->thick_shell_elems ()) * (7 + _ctl->num_8_node_add ()) +
-        _ctl->num_2_node_elems () * (7+6) +
-        _ctl->num_4_node_elems () * _ctl->num_4_node_vals ();
-
-    _f->pushPos ();
-    _f->skip (skipWords * 4);
-    for (i = 0; i < _ctl->total_cells (); i++)
-        if (_f->readFloat () < 0.5)
-            _geo->markDeleted (i);
-    _f->popPos ();
-
-    // read new nodes coordinates
-    for (i = 0; i < _ctl->nodes (); i++) {
-        float x[3];
-        _f->readBlock (x, sizeof (x));
-        _geo->movePoint (i, x);
-    }
-
-    if (_ctl->velocities ()) {
-        for (i = 0; i < _ctl->nodes (); i++) {
-            float v[3];
-            _f->readBlock (v, sizeof (v));
-            _geo->setVelocity (i, v);
-        }
-    }
+    size_t size = (_ctl->state_words () - 1) * WORD_SIZE;
 
-    if (_ctl->accelerations ()) {
-        for (i = 0; i < _ctl->nodes (); i++) {
-            float a[3];
-            _f->readBlock (a, sizeof (a));
-            _geo->setAcceleration (i, a);
-        }
+    // truncated state ends the family
+    if (!(buf->data = (const float*)_f->mapRanges (size, _ranges, buf->scratch)))
+        return false;
+
+    // mapped data: fault pages in now, not in the decoder
+    if (_f->mapped ()) {
+        volatile const char* p = (const char*)buf->data;
+        char sum = 0;
+
+        for (size_t r = 0; r < _ranges.size (); r++)
+            for (size_t i = 0; i < _ranges[r].size; i += 4096)
+                sum += p[_ranges[r].offset + i];
+        (void)sum;
     }
 
-    _geo->updateMaps ();
+    return true;
+}
 
-    bool istrn = _ctl->istrn ();
-    int rest;
 
-    rest = _ctl->num_8_node_add ();
-    if (_ctl->num_8_node_add () >= 6)
-        rest -= 6;
-    
-    for (i = 0; i < _ctl->num_8_node_elems () + _ctl->thick_shell_elems (); i++) {
-        float v[6], strain;
+void D3PlotPrefetcher::run ()
+{
+    while (1) {
+        state_buffer_t* buf;
+
+        {
+            std::unique_lock<std::mutex> lock (_lock);
+
+            while (!_stop && _free.empty ())
+                _cond.wait (lock);
+            if (_stop)
+                return;
+            buf = _free.front ();
+            _free.pop_front ();
+        }
 
-        _f->readBlock (v, sizeof (v));
-        strain = _f->readFloat ();
+        bool ok = fetch (buf);
 
-        _geo->setSigma (gridSolids, i, v);
-        _geo->setPlStrain (gridSolids, i, strain);
+        {
+            std::unique_lock<std::mutex> lock (_lock);
 
-        if (istrn && _ctl->num_8_node_add () >= 6) {
-            _f->readBlock (v, sizeof (v));
-            _geo->setStrain (gridSolids, i, v);
+            if (ok)
+                _ready.push_back (buf);
+            else {
+                _free.push_back (buf);
+                _done = true;
+            }
         }
+        _cond.notify_all ();
 
-        // additional values skipped (TODO)
-        _f->skip (rest * sizeof (float));
+        if (!ok)
+            return;
     }
+}
 
-    for (i = 0; i < _ctl->num_2_node_elems (); i++) {
-//         float v[6], strain;
 
-//         _f->readBlock (v, sizeof (v));
-//         strain = _f->readFloat ();
+const state_buffer_t* D3PlotPrefetcher::next ()
+{
+    // previous buffer could be reused now
+    if (_current)
+        release (_current);
 
-        // beam elements data are skipped completely (TODO)
-        _f->skip (6*sizeof (float));
+    _current = (state_buffer_t*)take ();
+    return _current;
+}
 
-    }
 
-    for (i = 0; i < _ctl->num_4_node_elems (); i++) {
-        float v[6], strain;
-        rest = _ctl->num_4_node_vals ();
+const state_buffer_t* D3PlotPrefetcher::take ()
+{
+    std::unique_lock<std::mutex> lock (_lock);
 
-        for (int j = 0; j < 3; j++) {
-            _f->readBlock (v, sizeof (v));
-            strain = _f->readFloat ();
+    while (_ready.empty () && !_done)
+        _cond.wait (lock);
 
-            _geo->setSigma (gridShells, i, v, (shell_pos_t)j);
-            _geo->setPlStrain (gridShells, i, strain, (shell_pos_t)j);
+    if (_ready.empty ())
+        return 0;
 
-            _f->skip (_ctl->num_4_node_add ()*4);
-            rest -= 7;
-        }
+    state_buffer_t* buf = _ready.front ();
+
+    _ready.pop_front ();
+    return buf;
+}
+
+
+void D3PlotPrefetcher::release (const state_buffer_t* buf)
+{
+    {
+        std::unique_lock<std::mutex> lock (_lock);
+
+        _free.push_back ((state_buffer_t*)buf);
+    }
+    _cond.notify_all ();
+}
 
-        float v3[3], v2[2];
-        
-        _f->readBlock (v3, sizeof (v3));
-        _geo->setBendingMoment (i, v3);
-        _f->readBlock (v2, sizeof (v2));
-        _geo->setShearResultant (i, v2);
-        _f->readBlock (v3, sizeof (v3));
-        _geo->setNormalResultant (i, v3);
-
-        _geo->setThickness (i, _f->readFloat ());
-
-        _f->readBlock (v2, sizeof (v2));
-        _geo->setElemDepVal (i, v2);
-        
-        rest -= 11;
-        
-        if (istrn) {
-            _f->readBlock (v, sizeof (v));
-            _geo->setStrain (gridShells, i, v, shellInner);
-            _f->readBlock (v, sizeof (v));
-            _geo->setStrain (gridShells, i, v, shellOuter);
-            rest -= 12;
-        }
 
-        _geo->setEnergy (i, _f->readFloat ());
-        rest--;
 
-        if (rest > 0)
-            _f->skip (rest*4);
+// --------------------------------------------------
+// D3PlotState
+// --------------------------------------------------
+D3PlotState::D3PlotState (StateOptions* opts, D3PlotControl* ctl, D3PlotGeometry* geo, D3PlotFile* f, const state_buffer_t* buf)
+    : _opts (opts),
+      _ctl (ctl),
+      _geo (geo),
+      _f (f),
+      _data (0)
+{
+    if (buf) {
+        _time = buf->time;
+        _data = buf->data;
     }
+    else if (!f->readTime (&_time))
+        throw 0;                // End Of State
+}
+
+
+D3PlotState::~D3PlotState ()
+{
+}
 
-    _f->skip (_ctl->total_cells () * 4);
+
+static void appendSection (std::vector<byte_range_t>& ranges, const state_section_t& s)
+{
+    if (!s.words ())
+        return;
+
+    byte_range_t r = { (size_t)s.offset * WORD_SIZE, (size_t)s.words () * WORD_SIZE };
+
+    // adjacent sections are joined
+    if (!ranges.empty () && ranges.back ().offset + ranges.back ().size == r.offset)
+        ranges.back ().size += r.size;
+    else
+        ranges.push_back (r);
 }
 
 
+void D3PlotState::neededRanges (const D3PlotControl* ctl, const D3PlotGeometry* geo,
+                                std::vector<byte_range_t>& ranges)
+{
+    const state_layout_t& l = ctl->layout ();
+    bool sigma = geo->decodeField (fieldSigma) || geo->decodeField (fieldPlStrain);
+
+    ranges.clear ();
+
+    // coordinates are always needed, they move the grid
+    appendSection (ranges, l.coords);
+
+    if (geo->decodeField (fieldVelocity))
+        appendSection (ranges, l.vel);
+    if (geo->decodeField (fieldAcceleration))
+        appendSection (ranges, l.accel);
+
+    if (sigma || (geo->decodeField (fieldStrain) && l.solid_strain >= 0))
+        appendSection (ranges, l.solids);
+    if (sigma)
+        appendSection (ranges, l.thick_shells);
+
+    static const field_id_t shellFields[] = {
+        fieldInnerSigma, fieldOuterSigma, fieldInnerPlStrain, fieldOuterPlStrain,
+        fieldInnerStrain, fieldOuterStrain, fieldBendingMoment, fieldShearResultant,
+        fieldNormalResultant, fieldThickness, fieldElemDepValue, fieldEnergy,
+    };
+    bool shells = sigma;
+
+    for (unsigned int i = 0; i < sizeof (shellFields) / sizeof (shellFields[0]); i++)
+        shells = shells || geo->decodeField (shellFields[i]);
+    if (shells)
+        appendSection (ranges, l.shells);
+
+    if (ctl->elems_deletion () == 2)
+        appendSection (ranges, l.deletion);
+}
+
 
-void D3PlotState::save (const char* baseName, int index)
+void D3PlotState::read ()
 {
-    _geo->save (baseName, index);
+    const state_layout_t& l = _ctl->layout ();
+
+    // the rest of state (after time word) is mapped or read at once,
+    // only sections holding selected fields are actually fetched
+    const float* data = _data;
+
+    if (!data) {
+        std::vector<byte_range_t> ranges;
+
+        neededRanges (_ctl, _geo, ranges);
+        if (!(data = (const float*)_f->mapRanges (l.words * WORD_SIZE, ranges)))
+            throw 0;            // truncated state, End Of State
+    }
+
+    // here we must fetch deleted cells set to prevent their
+    // insertion into the fields
+    if (_ctl->elems_deletion () == 2)
+        _geo->setDeletion (data + l.deletion.offset);
+
+    // new nodes coordinates
+    _geo->movePoints ((const node_coord_t*)(data + l.coords.offset));
+
+    // temperatures are skipped (TODO)
+    if (l.vel.count && _geo->decodeField (fieldVelocity))
+        _geo->setVelocities ((const node_coord_t*)(data + l.vel.offset));
+
+    if (l.accel.count && _geo->decodeField (fieldAcceleration))
+        _geo->setAccelerations ((const node_coord_t*)(data + l.accel.offset));
+
+    _geo->updateMaps ();
+
+    // only fields selected by user (and inputs of derived ones) are
+    // decoded, the rest is stepped over. Beam elements data are skipped
+    // completely (TODO)
+    _geo->decodeSolids (data);
+    _geo->decodeShells (data);
 }
@@ -25,43 +25,172 @@
 #ifndef __D3PLOT_H__
 #define __D3PLOT_H__
 
+#include "archive.h"
+#include "kernels.h"
 #include "options.h"
+#include "threadpool.h"
+#include "vtuwriter.h"
 
 
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <map>
+#include <mutex>
 #include <set>
+#include <string>
+#include <thread>
 #include <vector>
 
+// VTK objects are built by d3plot_output.cpp only, the rest of reading
+// code (and libdyna2lz) compiles without VTK headers
+class vtkDataArray;
+class vtkFloatArray;
+class vtkPoints;
+class vtkUnstructuredGrid;
+
 #define WORD_SIZE 4
 
+#define NO_NODE 0xFFFFFFFFu
+
+// position inside of d3plot family
+typedef struct {
+  unsigned int file;
+  long long offset;
+} file_pos_t;
+
+// part of block, in bytes from its start
+typedef struct {
+  size_t offset;
+  size_t size;
+} byte_range_t;
+
+// one memory-mapped file of the family
+typedef struct {
+  const char *data;
+  size_t size;
+} mapped_file_t;
+
 // input source for bunch of d3plots
 class D3PlotFile {
 private:
   char *_baseName;
   FILE *_f;
+  long long _fileSize; // size of file _f refers to
   unsigned int _index;
-  std::vector<long> _pos_stack;
+  std::vector<file_pos_t> _pos_stack;
+
+  // mmap mode: whole family is mapped at once, _cur is the file
+  // we are reading from, _offset is the position inside of it
+  bool _mapped;
+  std::vector<mapped_file_t> _maps;
+  unsigned int _cur;
+  size_t _offset;
+
+  std::vector<char> _scratch; // used by map() without explicit scratch
+
+protected:
+  bool mapFamily();
+  void unmapFamily();
+  void fileName(unsigned int index, char *buf) const;
 
 public:
-  D3PlotFile(const char *fileName);
+  D3PlotFile(const char *fileName, bool useMmap = false);
   ~D3PlotFile();
 
+  bool mapped() const { return _mapped; };
+  const char *baseName() const { return _baseName; };
+
   bool readBool();
   unsigned int readUInt();
   int readInt();
   float readFloat();
-  void readBlock(void *buf, unsigned int size);
-  void skip(unsigned int size);
+  bool readBlock(void *buf, size_t size);
+  // Moves position forward by size bytes without reading, crossing
+  // into next files of family when needed. Returns amount of bytes
+  // skipped, which is less than size only at the end of family.
+  unsigned long long skip(unsigned long long size);
   void sayPos();
+  bool openFile(unsigned int index);
   bool openNextFile();
 
+  // sizes of family files, stops at the first missing one
+  void familySizes(std::vector<long long> &sizes) const;
+
+  file_pos_t tell() const;
+  bool seek(const file_pos_t &pos);
+
+  // reads time word of the next state, passing end of file marker.
+  // Returns false at the end of family.
+  bool readTime(float *time);
+
+  // Returns pointer to the next size bytes and advances position. In
+  // mmap mode pointer refers directly into the mapping, if block
+  // straddles two family files (or mmap mode is off) data is copied
+  // into scratch. Result is valid until scratch is changed or file
+  // is destroyed, 0 is returned if family ends before size bytes.
+  const void *mapBlock(size_t size, std::vector<char> &scratch);
+
+  const void *mapBlock(size_t size) { return mapBlock(size, _scratch); };
+
+  // The same as mapBlock, but only sorted ranges of the block are
+  // needed. Gaps between them are seeked over when data is read into
+  // scratch and stay undefined there.
+  const void *mapRanges(size_t size, const std::vector<byte_range_t> &ranges,
+                        std::vector<char> &scratch);
+
+  const void *mapRanges(size_t size, const std::vector<byte_range_t> &ranges) {
+    return mapRanges(size, ranges, _scratch);
+  };
+
+  template <typename T>
+  const T *map(size_t count, std::vector<char> &scratch) {
+    return (const T *)mapBlock(count * sizeof(T), scratch);
+  };
+
+  template <typename T> const T *map(size_t count) {
+    return (const T *)mapBlock(count * sizeof(T), _scratch);
+  };
+
   void pushPos();
   void popPos();
 };
 
+// section of state data: count records of stride words, offset is in
+// words from the word following state time
+typedef struct {
+  unsigned long long offset;
+  unsigned int count;
+  unsigned int stride;
+
+  unsigned long long words() const {
+    return (unsigned long long)count * stride;
+  };
+} state_section_t;
+
+// Layout of one state. Positions of values inside element records are
+// in words from record start, -1 if the value is not written.
+typedef struct {
+  state_section_t globals, coords, temps, vel, accel;
+  state_section_t solids, thick_shells, beams, shells, deletion;
+
+  // solids and thick shells
+  int solid_sigma, solid_pl_strain, solid_strain;
+
+  // shells: integration point records first
+  unsigned int shell_layers, shell_layer_stride;
+  int shell_sigma, shell_pl_strain; // inside of layer record
+  int shell_bending, shell_shear, shell_normal;
+  int shell_thickness, shell_elem_dep;
+  int shell_strain; // inner layer, outer follows it
+  int shell_energy;
+
+  unsigned long long words; // without time word
+} state_layout_t;
+
 class D3PlotControl {
 private:
   char _model_descr[10 * 4 + 1];
@@ -113,7 +242,11 @@ private:
   unsigned int _cfd_nodal_flags1;
   unsigned int _cfd_nodal_flags2;
 
+  state_layout_t _layout;
+
 protected:
+  void buildLayout();
+
   bool readBool(FILE *f) const;
   unsigned int readUInt(FILE *f) const;
   int readInt(FILE *f) const;
@@ -172,6 +305,48 @@ public:
   };
 
   bool istrn() const;
+
+  // words of deletion data at the end of each state
+  unsigned long long deletion_words() const;
+
+  // size of one state in words, including time word
+  unsigned long long state_words() const { return 1 + _layout.words; };
+
+  const state_layout_t &layout() const { return _layout; };
+};
+
+// position and time of one state inside of family
+typedef struct {
+  file_pos_t pos;
+  float time;
+} state_entry_t;
+
+// table of states of the family. Built by one pass over the data
+// (without decoding) and stored as small sidecar file next to d3plot.
+class D3PlotIndex {
+private:
+  std::vector<state_entry_t> _states;
+  std::vector<long long> _sizes; // family file sizes index is built for
+  unsigned long long _stateWords;
+  unsigned int _nodes, _cells;
+
+public:
+  D3PlotIndex();
+
+  // file must be positioned at the begining of the first state
+  void scan(D3PlotFile *f, D3PlotControl *ctl);
+
+  // fails if index file is missing or does not match the family
+  bool load(const char *fileName, D3PlotFile *f, D3PlotControl *ctl);
+  bool save(const char *fileName) const;
+
+  unsigned int size() const { return _states.size(); };
+  const state_entry_t &state(unsigned int index) const {
+    return _states[index];
+  };
+
+  // index of state with time nearest to given one, -1 if empty
+  int findTime(float time) const;
 };
 
 typedef struct { float x, y, z; } node_coord_t;
@@ -180,26 +355,60 @@ typedef struct { float val[3]; } vector_3_t;
 
 typedef struct { float val[2]; } vector_2_t;
 
-// abstract generic cell - collection of node IDs
-class GenericCell {
+/* types of cells, values are the ones of VTK cell types */
+typedef enum {
+  cellLine = 3,
+  cellTriangle = 5,
+  cellQuad = 9,
+  cellTetra = 10,
+  cellHexahedron = 12,
+  cellWedge = 13,
+  cellPyramid = 14,
+} cell_type_t;
+
+// cells of one grid in flat (CSR) form: nodes of cell i are
+// conn[offsets[i]] .. conn[offsets[i+1]-1]. Arrays are either kept in
+// own buffers filled by append(), or attached to external memory such
+// as mapped geometry cache.
+class CellArray {
 private:
-  unsigned int _nodes[8];
-  unsigned char _pts;
-  unsigned int _partID;
-  unsigned int _elemKind;
-
-public:
-  GenericCell(unsigned int *nodes, unsigned char pts, unsigned int partID,
-              unsigned int elemKind);
-  ~GenericCell();
+  std::vector<unsigned int> _offsetsBuf, _connBuf, _partIDsBuf;
+  std::vector<unsigned char> _typesBuf;
 
-  unsigned char nodesCount() const { return _pts; };
+  const unsigned int *_offsets; // size() + 1 entries
+  const unsigned int *_conn;    // global node IDs
+  const unsigned int *_partIDs;
+  const unsigned char *_types; // VTK cell types
+  unsigned int _count;
 
-  unsigned int partID() const { return _partID; };
+public:
+  CellArray();
 
-  unsigned int node(unsigned char index) const { return _nodes[index]; };
+  unsigned int size() const { return _count; };
+  unsigned int connSize() const { return _offsets[_count]; };
 
-  unsigned int elemKind() const { return _elemKind; };
+  unsigned char nodesCount(unsigned int cell) const {
+    return _offsets[cell + 1] - _offsets[cell];
+  };
+  const unsigned int *nodes(unsigned int cell) const {
+    return _conn + _offsets[cell];
+  };
+  unsigned int partID(unsigned int cell) const { return _partIDs[cell]; };
+  unsigned char type(unsigned int cell) const { return _types[cell]; };
+
+  const unsigned int *offsets() const { return _offsets; };
+  const unsigned int *conn() const { return _conn; };
+  const unsigned int *partIDs() const { return _partIDs; };
+  const unsigned char *types() const { return _types; };
+
+  void reserve(unsigned int cells, unsigned int nodes);
+  void append(const unsigned int *nodes, unsigned char pts,
+              unsigned int partID, unsigned char type);
+
+  // arrays must outlive this object
+  void attach(unsigned int count, const unsigned int *offsets,
+              const unsigned int *conn, const unsigned int *partIDs,
+              const unsigned char *types);
 };
 
 typedef struct {
@@ -221,11 +430,112 @@ typedef enum {
   gridBeams = 2,
 } grid_kind_t;
 
+/* live cells of one piece of partitioned grid and its own points */
+typedef struct {
+  std::vector<unsigned int> cells;        // cell indices in grid
+  std::vector<unsigned int> local2global; // piece points
+  std::vector<unsigned int> conn;         // connectivity in piece points
+} grid_piece_t;
+
+/* destination arrays of element decoders, 0 if value is not decoded */
+typedef struct {
+  tensor_t *sigma;
+  float *pl_strain;
+  tensor_t *strain;
+} solid_targets_t;
+
+typedef struct {
+  tensor_t *sigma[3]; // middle, inner and outer layers
+  float *pl_strain[3];
+  vector_3_t *bending;
+  vector_2_t *shear;
+  vector_3_t *normal;
+  float *thickness;
+  vector_2_t *elem_dep;
+  tensor_t *strain[2]; // inner and outer
+  float *energy;
+} shell_targets_t;
+
+typedef void (*solid_decoder_t)(const float *data, const state_layout_t &l,
+                                const solid_targets_t &t);
+typedef void (*shell_decoder_t)(const float *data, const state_layout_t &l,
+                                const shell_targets_t &t);
+
+/* fields of state grids. Raw ones are decoded from state data, derived
+   ones are computed from their input field */
 typedef enum {
-  shellMiddle = 0,
-  shellInner = 1,
-  shellOuter = 2,
-} shell_pos_t;
+  fieldSigma = 0,
+  fieldVonMises,
+  fieldPrincipalStress,
+  fieldHydroPressure,
+  fieldPrincipalShear,
+  fieldOctahedralShear,
+  fieldPlStrain,
+  fieldStrain,
+  fieldPrincipalStrain,
+  fieldInnerSigma,
+  fieldOuterSigma,
+  fieldInnerPlStrain,
+  fieldOuterPlStrain,
+  fieldInnerStrain,
+  fieldOuterStrain,
+  fieldBendingMoment,
+  fieldShearResultant,
+  fieldNormalResultant,
+  fieldThickness,
+  fieldElemDepValue,
+  fieldEnergy,
+  fieldVelocity,
+  fieldAcceleration,
+  fieldDeltas,
+  fieldCoords,
+  fieldsCount,
+} field_id_t;
+
+typedef struct {
+  const char *name;  // array name in output
+  const char *alias; // also accepted in field lists, may be 0
+  unsigned int components;
+  bool point; // point or cell data
+  int input; // field it is computed from, -1 for raw ones
+} field_info_t;
+
+const field_info_t &fieldInfo(int field);
+
+// field with such name or alias, -1 if there is none
+int findField(const char *name);
+
+// Time series <baseName>.pvd of pvd mode. Every saved state appends
+// its parts in place of the footer, which is written again after them,
+// so the file is complete (and loadable) after every state.
+class PVDCollection {
+private:
+  FILE *_f;
+  long _end; // where footer starts
+  std::string _fileName, _header;
+  // entries of extended series not merged with new ones yet
+  std::vector<std::string> _old;
+  bool _merge;
+  std::mutex _lock;
+
+protected:
+  bool merge(float time, const std::vector<std::string> &files,
+             const std::string &text);
+
+public:
+  PVDCollection();
+  ~PVDCollection();
+
+  // Creates the file, does nothing if it is open already. With extend
+  // existing collection of the same compressor is kept: its entries of
+  // other files and earlier times stay before the appended ones.
+  bool open(const char *fileName, const char *compressor = 0,
+            bool extend = false);
+  void close();
+
+  // files are relative to the collection, one DataSet per part
+  bool append(float time, const std::vector<std::string> &files);
+};
 
 class D3PlotGeometry {
 private:
@@ -239,16 +549,35 @@ private:
   // geometry
   node_coord_t *_nodes;
   node_coord_t *_deltas;
-  std::vector<GenericCell *> _cells[3];
+  CellArray _cells[3];
 
-  // nodes maps
-  unsigned int *_local2global[3];
+  // nodes maps, both are dense arrays of ctl->nodes() entries,
+  // global nodes not used by grid are NO_NODE in _global2local
+  std::vector<unsigned int> _local2global[3];
   unsigned int _l2g_size[3];
 
-  std::map<unsigned int, unsigned int> _global2local[3];
+  std::vector<unsigned int> _global2local[3];
+
+  // amount of live cells using each node, live flags of cells and
+  // connectivity of live cells in local IDs. Only cells whose flag
+  // flips are touched on update, unchanged grid keeps everything.
+  std::vector<unsigned int> _nodeRefs[3];
+  std::vector<unsigned char> _live[3];
+  std::vector<unsigned int> _liveCells[3];
+  std::vector<unsigned int> _localConn[3];
+  unsigned int _topoRev[3];
+  uint64_t _topoKey[3];
+
+  // partitioned output: cells of every grid ordered along space filling
+  // curve and piece of every part (master only), pieces of live cells
+  // built for topology revision _piecesRev
+  std::vector<unsigned int> _cellOrder[3];
+  std::map<unsigned int, unsigned int> _partPiece[3];
+  std::vector<grid_piece_t> _pieces[3];
+  unsigned int _piecesRev[3];
 
   // state variables
-  bool *_deleted[3];
+  std::vector<uint64_t> _deleted[3]; // bitset, empty until state mode
   std::vector<node_coord_t> _vel;
   std::vector<node_coord_t> _accel;
   std::vector<tensor_t> _sigma[3];
@@ -272,18 +601,79 @@ private:
 
   bool _stateMode;
 
+  // fields written to output and fields decoded from states, the
+  // latter includes inputs of derived ones
+  bool _outputField[fieldsCount];
+  bool _decodeField[fieldsCount];
+
+  // error bounds of fields written as quantized codes, 0 for exact
+  // ones, relative bounds are fractions of range of values
+  double _quantBound[fieldsCount];
+  bool _quantRelative[fieldsCount];
+
+  // decoders specialized for state layout of the family
+  solid_decoder_t _solidDecoder;
+  shell_decoder_t _shellDecoder;
+
+  // mapped geometry cache, cells arrays are attached to it
+  void *_cacheMap;
+  size_t _cacheSize;
+
+  // container of archive output mode, opened by first save
+  ArchiveWriter _archive;
+
+  // collection of pvd mode, opened by first saved state
+  PVDCollection _collection;
+
+  // threads compressing output blocks, only if compression is on
+  ThreadPool *_pool;
+
+  // geometry this replica was made of (owner of archive, collection
+  // and pool), 0 for the original one
+  D3PlotGeometry *_master;
+
 protected:
+  void readGeometry(D3PlotFile *f);
+  bool loadCache(const char *fileName, D3PlotFile *f);
+  bool saveCache(const char *fileName, D3PlotFile *f) const;
+
+  void updateMap(int grid);
+
+  void orderCells(int grid);
+  void splitGrid(int grid);
+
   vtkUnstructuredGrid *createGrid(grid_kind_t kind);
 
   vtkPoints *getPoints(grid_kind_t grid);
 
-  void resolveInvariants(float *res, const tensor_t &data);
-
   void appendCellArray(vtkUnstructuredGrid *grid, vtkDataArray *array);
   vtkFloatArray *createArray(const char *name, unsigned int components = 1);
+  vtkFloatArray *createField(int field);
+
+  // raw values of cell field, 0 if grid has no such field
+  const float *cellValues(grid_kind_t kind, int field);
+
+  // derived fields of all cells of grid, allocated in store
+  void computeDerived(grid_kind_t kind, VTUWriter *store,
+                      float *derived[fieldsCount]);
+
+  // fills writer with grid arrays, which refer to geometry buffers
+  // until written. Piece limits them to its cells and points, derived
+  // fields computed before may be shared by pieces.
+  void createVTU(grid_kind_t kind, VTUWriter *w,
+                 const grid_piece_t *piece = 0,
+                 float *const *derived = 0);
 
 public:
-  D3PlotGeometry(D3PlotFile *f, D3PlotControl *ctl, StateOptions *opts);
+  // If cacheName is given, parsed geometry is taken from this file
+  // when it matches the family, otherwise the cache is (re)created.
+  D3PlotGeometry(D3PlotFile *f, D3PlotControl *ctl, StateOptions *opts,
+                 const char *cacheName = 0);
+
+  // Replica for decoding states concurrently: takes current maps and
+  // coordinates of geo and shares its cells, so geo must outlive it.
+  // States saved into archive or pvd collection go to the ones of geo.
+  explicit D3PlotGeometry(D3PlotGeometry *geo);
 
   ~D3PlotGeometry();
 
@@ -296,30 +686,59 @@ public:
   unsigned int getTetrasCount() const { return _tetras; };
   unsigned int getWedgesCount() const { return _wedges; };
 
-  bool save(const char *baseName, int index = -1);
+  // cells of grid in file order, global node IDs
+  const CellArray &cells(int grid) const { return _cells[grid]; };
+
+  // Writes grids of state index (of geometry if index < 0). In pvd
+  // mode beforeAppend, if given, is called once part files are written
+  // and before they are added to the time series.
+  bool save(const char *baseName, int index = -1, float time = 0.0,
+            const std::function<void()> &beforeAppend = nullptr);
+
+  // Finishes container of archive output mode (index and footer),
+  // false if it could not be written. Destructor does the same
+  // silently.
+  bool closeOutput();
+
+  // incremented every time set of live cells of grid changes
+  unsigned int topologyRevision(int grid) const { return _topoRev[grid]; };
+
+  // hash of set of live cells, equal for equal sets in any replica
+  uint64_t topologyKey(int grid) const { return _topoKey[grid]; };
+
+  bool outputField(int field) const { return _outputField[field]; };
+  bool decodeField(int field) const { return _decodeField[field]; };
 
   void updateMaps();
   void resetState();
 
-  void markDeleted(unsigned int cell);
-  void setVelocity(unsigned int node, float *val);
-  void setAcceleration(unsigned int node, float *val);
-
-  void setSigma(int grid, unsigned int localCell, float *val,
-                shell_pos_t shellPos = shellMiddle);
-  void setPlStrain(int grid, unsigned int localCell, float val,
-                   shell_pos_t shellPos = shellMiddle);
-  void setStrain(int grid, unsigned int localCell, float *val,
-                 shell_pos_t shellPos = shellMiddle);
-
-  void setBendingMoment(unsigned int localCell, float *val);
-  void setShearResultant(unsigned int localCell, float *val);
-  void setNormalResultant(unsigned int localCell, float *val);
-  void setThickness(unsigned int localCell, float val);
-  void setElemDepVal(unsigned int localCell, float *val);
-  void setEnergy(unsigned int localCell, float val);
-
-  void movePoint(unsigned int id, float *data);
+  // takes MDLOPT deletion block of all cells in grids order
+  void setDeletion(const float *data);
+
+  bool isDeleted(int grid, unsigned int cell) const {
+    return !_deleted[grid].empty() &&
+           ((_deleted[grid][cell >> 6] >> (cell & 63)) & 1);
+  };
+
+  // amount of deleted cells of grid in current state
+  unsigned int deletedCount(int grid) const {
+    return _deleted[grid].empty()
+               ? 0
+               : countBits(&_deleted[grid][0], _cells[grid].size());
+  };
+  void setVelocities(const node_coord_t *val);
+  void setAccelerations(const node_coord_t *val);
+
+  // decode element records of state data (following time word)
+  // straight into state arrays of decoded fields
+  void decodeSolids(const float *data);
+  void decodeShells(const float *data);
+
+  void movePoints(const node_coord_t *data);
+
+  // coordinates the next movePoints computes deltas against
+  const node_coord_t *coords() const { return _nodes; };
+  void setCoords(const node_coord_t *data);
 };
 
 // class helps to write multipart results data
@@ -327,17 +746,87 @@ class PVDWriter {
 private:
   const char *_baseName;
   std::vector<const char *> _names;
+  // one of grid, vtu and pieces is set
   std::vector<vtkUnstructuredGrid *> _grids;
+  std::vector<VTUWriter *> _vtus;
+  std::vector<std::vector<VTUWriter *> > _pieces;
   bool _pvd_mode;
   int _index;
 
+protected:
+  void writePart(unsigned int part, int piece, const char *fileName);
+
+  // file of part or of its piece if piece >= 0
+  void fileName(unsigned int part, int piece, const char *ext,
+                char *buf) const;
+
 public:
   PVDWriter(const char *baseName, bool pvd_mode, int index);
   ~PVDWriter();
 
   void appendPart(const char *baseName, vtkUnstructuredGrid *grid);
+  void appendPart(const char *baseName, VTUWriter *vtu);
+  void appendPart(const char *baseName, const std::vector<VTUWriter *> &pieces);
 
-  void write();
+  // part files are written at once, on pool if given
+  void write(ThreadPool *pool = 0);
+
+  // adds written parts to time series of pvd mode
+  bool appendTo(PVDCollection &collection, float time) const;
+};
+
+// raw state data fetched ahead of decoding
+struct state_buffer_t {
+  int index; // of state in family
+  float time;
+  const float *data; // state words following time word
+  std::vector<char> scratch;
+};
+
+// reads states in background thread into bounded ring of buffers, so
+// I/O overlaps with decoding and writing of the current state. While
+// prefetcher exists file must not be touched by anyone else.
+class D3PlotPrefetcher {
+private:
+  D3PlotFile *_f;
+  D3PlotControl *_ctl;
+  const D3PlotIndex *_idx; // optional, states first..last are read then
+  int _next, _last;
+  std::vector<byte_range_t> _ranges; // parts of states to be read
+
+  std::vector<state_buffer_t> _slots;
+  std::deque<state_buffer_t *> _free;
+  std::deque<state_buffer_t *> _ready;
+  state_buffer_t *_current; // buffer owned by next() consumer
+  bool _done, _stop;
+
+  std::mutex _lock;
+  std::condition_variable _cond;
+  std::thread _thread;
+
+protected:
+  void run();
+  bool fetch(state_buffer_t *buf);
+
+public:
+  // If ranges are given (see D3PlotState::neededRanges), only they
+  // are fetched from each state
+  D3PlotPrefetcher(D3PlotFile *f, D3PlotControl *ctl, unsigned int depth,
+                   unsigned long long memCap, const D3PlotIndex *idx = 0,
+                   int first = 0, int last = -1,
+                   const std::vector<byte_range_t> *ranges = 0);
+  ~D3PlotPrefetcher();
+
+  unsigned int depth() const { return _slots.size() - 1; };
+
+  // Blocks until next state is fetched, returns 0 at the end of data.
+  // Buffer is valid until the next call.
+  const state_buffer_t *next();
+
+  // Same for several consumers, buffer is valid until released.
+  // Slots beyond depth are not fetched while consumers hold them.
+  const state_buffer_t *take();
+  void release(const state_buffer_t *buf);
 };
 
 class D3PlotState {
@@ -347,12 +836,20 @@ private:
   D3PlotGeometry *_geo;
   float _time;
   D3PlotFile *_f;
+  const float *_data;
 
 public:
+  // state is read from file f, or taken from prefetched buf if given
   D3PlotState(StateOptions *opts, D3PlotControl *ctl, D3PlotGeometry *geo,
-              D3PlotFile *f);
+              D3PlotFile *f, const state_buffer_t *buf = 0);
   ~D3PlotState();
 
+  // byte ranges of state data following time word which hold fields
+  // geo decodes, sorted
+  static void neededRanges(const D3PlotControl *ctl, const D3PlotGeometry *geo,
+                           std::vector<byte_range_t> &ranges);
+
+  // throws 0 (end of states) if state data is truncated
   void read();
 
   float time() const { return _time; };
@@ -360,4 +857,54 @@ public:
   void save(const char *baseName, int index);
 };
 
+// Converts states on several threads: prefetcher reads them, workers
+// decode them into geometry replicas, one per state in flight, and
+// writers save them. Every state gets the same output as by sequential
+// conversion, archive blocks and pvd entries are written in states order.
+class D3PlotPipeline {
+private:
+  typedef struct {
+    D3PlotGeometry *geo;
+    int index; // of state in family
+    float time;
+  } slot_t;
+
+  StateOptions *_opts;
+  D3PlotControl *_ctl;
+  D3PlotPrefetcher *_prefetch;
+  const char *_baseName;
+  unsigned int _workers, _writers;
+
+  std::vector<slot_t> _slots;
+  std::deque<slot_t *> _free;
+  std::map<unsigned int, slot_t *> _decoded; // by sequence number
+
+  // coordinates of the last state taken, deltas of the next one are
+  // computed against them. Guarded by _takeLock.
+  std::vector<node_coord_t> _coords;
+
+  unsigned int _taken, _claimed, _written; // sequence numbers
+  bool _end;
+
+  std::mutex _lock;
+  std::mutex _takeLock; // orders taking of states from prefetcher
+  std::condition_variable _cond;
+
+protected:
+  void decode();
+  void write();
+
+public:
+  // inFlight limits states being decoded or written, every one of
+  // them holds a replica of geo
+  D3PlotPipeline(StateOptions *opts, D3PlotControl *ctl, D3PlotGeometry *geo,
+                 D3PlotPrefetcher *prefetch, const char *baseName,
+                 unsigned int workers, unsigned int writers,
+                 unsigned int inFlight);
+  ~D3PlotPipeline();
+
+  // converts all states prefetcher delivers, returns their count
+  unsigned int run();
+};
+
 #endif
@@ -0,0 +1,760 @@
+//
+// Output of states: VTK objects, part files and time series, and the
+// conversion pipeline writing them. Everything else of d3plot reading
+// lives in d3plot.cpp, which builds into libdyna2lz without VTK.
+//
+#include "d3plot.h"
+
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+
+
+// --------------------------------------------------
+// D3PlotGeometry output
+// --------------------------------------------------
+void D3PlotGeometry::appendCellArray (vtkUnstructuredGrid* grid, vtkDataArray* array)
+{
+    if (array) {
+        grid->GetCellData ()->AddArray (array);
+        array->Delete ();
+    }
+}
+
+
+vtkFloatArray* D3PlotGeometry::createArray (const char* name, unsigned int components)
+{
+    vtkFloatArray* res = vtkFloatArray::New ();
+
+    res->SetName (name);
+    res->SetNumberOfComponents (components);
+
+    return res;
+}
+
+
+// array of registry field, 0 if field is not selected for output
+vtkFloatArray* D3PlotGeometry::createField (int field)
+{
+    if (!_outputField[field])
+        return 0;
+
+    return createArray (fieldInfo (field).name, fieldInfo (field).components);
+}
+
+
+
+vtkUnstructuredGrid* D3PlotGeometry::createGrid (grid_kind_t kind)
+{
+    vtkUnstructuredGrid* grid = vtkUnstructuredGrid::New ();
+    vtkPoints* points = getPoints (kind);
+
+    grid->SetPoints (points);
+    points->Delete ();
+
+    // cells
+    const CellArray& cells = _cells[kind];
+    vtkUnsignedIntArray* partIDField      = vtkUnsignedIntArray::New ();
+    vtkUnsignedIntArray* elementTypeField = vtkUnsignedIntArray::New ();
+
+    partIDField->SetName ("PartID");
+    elementTypeField->SetName ("ElementType");
+
+    // arrays are created only for selected fields
+    vtkFloatArray* sigmaField = 0;
+    vtkFloatArray* vm_stressField = 0;
+    vtkFloatArray* pri_stressField = 0;
+    vtkFloatArray* hydroPressureField = 0;
+    vtkFloatArray* pri_shearStressField = 0;
+    vtkFloatArray* oct_shearStressField = 0;
+    vtkFloatArray* plStrainField = 0;
+    vtkFloatArray* strainField = 0;
+    vtkFloatArray* pri_strainField = 0;
+
+    if (_stateMode && _sigma[kind].size ()) {
+        sigmaField           = createField (fieldSigma);
+        vm_stressField       = createField (fieldVonMises);
+        pri_stressField      = createField (fieldPrincipalStress);
+        hydroPressureField   = createField (fieldHydroPressure);
+        pri_shearStressField = createField (fieldPrincipalShear);
+        oct_shearStressField = createField (fieldOctahedralShear);
+    }
+
+    if (_stateMode && _pl_strain[kind].size ())
+        plStrainField = createField (fieldPlStrain);
+
+    if (_stateMode && _ctl->istrn () && _strain[kind].size ()) {
+        strainField = createField (fieldStrain);
+        pri_strainField = createField (fieldPrincipalStrain);
+    }
+
+    vtkUnsignedCharArray* deletedField = 0;
+
+    if (_opts->keepDeleted () && !_deleted[kind].empty ()) {
+        deletedField = vtkUnsignedCharArray::New ();
+        deletedField->SetName ("Deleted");
+    }
+
+    // shell-specific fields
+    vtkFloatArray* innerSigmaField = 0;
+    vtkFloatArray* outerSigmaField = 0;
+    vtkFloatArray* innerPlStrainField = 0;
+    vtkFloatArray* outerPlStrainField = 0;
+    vtkFloatArray* innerStrainField = 0;
+    vtkFloatArray* outerStrainField = 0;
+
+    vtkFloatArray* bendingMomentField = 0;
+    vtkFloatArray* shearResultantField = 0;
+    vtkFloatArray* normalResultantField = 0;
+    vtkFloatArray* thicknessField = 0;
+    vtkFloatArray* elemDepValField = 0;
+    vtkFloatArray* energyField = 0;
+    
+    if (_stateMode && kind == gridShells) {
+        innerSigmaField = createField (fieldInnerSigma);
+        outerSigmaField = createField (fieldOuterSigma);
+        innerPlStrainField = createField (fieldInnerPlStrain);
+        outerPlStrainField = createField (fieldOuterPlStrain);
+
+        bendingMomentField = createField (fieldBendingMoment);
+        shearResultantField = createField (fieldShearResultant);
+        normalResultantField = createField (fieldNormalResultant);
+        thicknessField = createField (fieldThickness);
+        elemDepValField = createField (fieldElemDepValue);
+        energyField = createField (fieldEnergy);
+        
+        if (_ctl->istrn ()) {
+            innerStrainField = createField (fieldInnerStrain);
+            outerStrainField = createField (fieldOuterStrain);
+        }
+    }
+
+    // derived values are computed for the whole grid at once, vector
+    // kernels are much faster this way than cell by cell
+    std::vector<float> vm_stress, hydro, pri_stress, pri_shear, oct_shear, pri_strain;
+
+    if (vm_stressField || pri_stressField || hydroPressureField ||
+        pri_shearStressField || oct_shearStressField) {
+        size_t n = _sigma[kind].size ();
+
+        if (vm_stressField)
+            vm_stress.resize (n);
+        if (hydroPressureField)
+            hydro.resize (n);
+        if (pri_stressField)
+            pri_stress.resize (n * 3);
+        if (pri_shearStressField)
+            pri_shear.resize (n * 3);
+        if (oct_shearStressField)
+            oct_shear.resize (n);
+        tensorInvariants (_sigma[kind][0].val, n,
+                          pri_stressField ? &pri_stress[0] : 0,
+                          vm_stressField ? &vm_stress[0] : 0,
+                          hydroPressureField ? &hydro[0] : 0,
+                          pri_shearStressField ? &pri_shear[0] : 0,
+                          oct_shearStressField ? &oct_shear[0] : 0);
+    }
+
+    if (pri_strainField) {
+        pri_strain.resize (_strain[kind].size () * 3);
+        tensorInvariants (_strain[kind][0].val, _strain[kind].size (), &pri_strain[0], 0, 0, 0, 0);
+    }
+
+    // only live cells are output, their connectivity in local IDs
+    // is kept by updateMaps
+    const std::vector<unsigned int>& live = _liveCells[kind];
+    const unsigned int* conn = _localConn[kind].empty () ? 0 : &_localConn[kind][0];
+    unsigned int j, index, i;
+
+    for (j = 0; j < live.size (); j++) {
+        vtkIdType pts[8];
+
+        index = live[j];
+
+        for (i = 0; i < cells.nodesCount (index); i++)
+            pts[i] = *(conn++);
+
+        grid->InsertNextCell (cells.type (index), cells.nodesCount (index), pts);
+        partIDField->InsertNextValue (cells.partID (index));
+        elementTypeField->InsertNextValue (cells.type (index));
+
+        if (deletedField)
+            deletedField->InsertNextValue (isDeleted (kind, index));
+        
+        if (sigmaField)
+            sigmaField->InsertNextTuple (_sigma[kind][index].val);
+        if (vm_stressField)
+            vm_stressField->InsertNextValue (vm_stress[index]);
+        if (hydroPressureField)
+            hydroPressureField->InsertNextValue (hydro[index]);
+        if (pri_stressField)
+            pri_stressField->InsertNextTuple (&pri_stress[index * 3]);
+        if (oct_shearStressField)
+            oct_shearStressField->InsertNextValue (oct_shear[index]);
+        if (pri_shearStressField)
+            pri_shearStressField->InsertNextTuple (&pri_shear[index * 3]);
+
+        if (plStrainField)
+            plStrainField->InsertNextValue (_pl_strain[kind][index]);
+        if (strainField)
+            strainField->InsertNextTuple (_strain[kind][index].val);
+        if (pri_strainField)
+            pri_strainField->InsertNextTuple (&pri_strain[index * 3]);
+
+        if (innerSigmaField)
+            innerSigmaField->InsertNextTuple (_innerSigma[index].val);
+        if (outerSigmaField)
+            outerSigmaField->InsertNextTuple (_outerSigma[index].val);
+        if (innerPlStrainField)
+            innerPlStrainField->InsertNextValue (_pl_innerStrain[index]);
+        if (outerPlStrainField)
+            outerPlStrainField->InsertNextValue (_pl_outerStrain[index]);
+        if (innerStrainField)
+            innerStrainField->InsertNextTuple (_innerStrain[index].val);
+        if (outerStrainField)
+            outerStrainField->InsertNextTuple (_outerStrain[index].val);
+            
+        if (bendingMomentField)
+            bendingMomentField->InsertNextTuple (_bendingMoment[index].val);
+        if (shearResultantField)
+            shearResultantField->InsertNextTuple (_shearResultant[index].val);
+        if (normalResultantField)
+            normalResultantField->InsertNextTuple (_normalResultant[index].val);
+        if (thicknessField)
+            thicknessField->InsertNextValue (_thickness[index]);
+        if (elemDepValField)
+            elemDepValField->InsertNextTuple (_elemDepVar[index].val);
+        if (energyField)
+            energyField->InsertNextValue (_energy[index]);
+    }
+
+    appendCellArray (grid, partIDField);
+    appendCellArray (grid, elementTypeField);
+    appendCellArray (grid, deletedField);
+    appendCellArray (grid, sigmaField);
+    appendCellArray (grid, vm_stressField);
+    appendCellArray (grid, pri_stressField);
+    appendCellArray (grid, hydroPressureField);
+    appendCellArray (grid, pri_shearStressField);
+    appendCellArray (grid, oct_shearStressField);
+    appendCellArray (grid, plStrainField);
+    appendCellArray (grid, strainField);
+    appendCellArray (grid, pri_strainField);
+
+    appendCellArray (grid, innerSigmaField);
+    appendCellArray (grid, outerSigmaField);
+    appendCellArray (grid, innerPlStrainField);
+    appendCellArray (grid, outerPlStrainField);
+    appendCellArray (grid, innerStrainField);
+    appendCellArray (grid, outerStrainField);
+
+    appendCellArray (grid, bendingMomentField);
+    appendCellArray (grid, shearResultantField);
+    appendCellArray (grid, normalResultantField);
+    appendCellArray (grid, thicknessField);
+    appendCellArray (grid, elemDepValField);
+    appendCellArray (grid, energyField);
+    
+    if (_stateMode) {
+        vtkFloatArray* velField = 0;
+        vtkFloatArray* accField = 0;
+        vtkFloatArray* deltaField = 0;
+        vtkFloatArray* coordsField = 0;
+        
+        if (_ctl->velocities ())
+            velField = createField (fieldVelocity);
+
+        if (_ctl->accelerations ())
+            accField = createField (fieldAcceleration);
+
+        deltaField  = createField (fieldDeltas);
+        coordsField = createField (fieldCoords);
+
+        // nodal values
+        for (int i = 0; i < _l2g_size[kind]; i++) {
+            unsigned int id = _local2global[kind][i];
+            if (velField)
+                velField->InsertNextTuple ((float*)&_vel[id]);
+            if (accField)
+                accField->InsertNextTuple ((float*)&_accel[id]);
+
+            if (deltaField)
+                deltaField->InsertNextTuple ((float*)&_deltas[id]);
+            if (coordsField)
+                coordsField->InsertNextTuple ((float*)&_nodes[id]);
+        }
+
+        if (velField) {
+            grid->GetPointData ()->AddArray (velField);
+            velField->Delete ();
+        }
+        if (accField) {
+            grid->GetPointData ()->AddArray (accField);
+            accField->Delete ();
+        }
+
+        if (deltaField) {
+            grid->GetPointData ()->AddArray (deltaField);
+            deltaField->Delete ();
+        }
+        if (coordsField) {
+            grid->GetPointData ()->AddArray (coordsField);
+            coordsField->Delete ();
+        }
+    }
+
+    return grid;
+}
+
+
+vtkPoints* D3PlotGeometry::getPoints (grid_kind_t grid)
+{
+    vtkPoints* points = vtkPoints::New ();
+
+    for (int i = 0; i < _l2g_size[grid]; i++)
+        points->InsertNextPoint ((float*)&_nodes[_local2global[grid][i]]);
+
+    return points;
+}
+
+
+
+bool D3PlotGeometry::save (const char* baseName, int index, float time,
+                           const std::function<void ()>& beforeAppend)
+{
+    // grids share only read-only node data, so they are built (and
+    // written into part files) concurrently
+    std::vector<grid_kind_t> grids;
+
+    for (int i = 0; i < 3; i++)
+        if (_cells[i].size ())
+            grids.push_back ((grid_kind_t)i);
+
+    // topology goes to the container only when it changes, every
+    // state adds points and fields
+    if (_opts->outputMode () == outputArchive) {
+        ArchiveWriter& archive = _master ? _master->_archive : _archive;
+
+        if (!archive.isOpen ()) {
+            char buf[1024];
+
+            sprintf (buf, "%s.d2l", baseName);
+            if (!archive.open (buf))
+                return false;
+            archive.setCompression (_opts->codec (), _opts->level (), _pool);
+            archive.setKeyframes (_opts->keyframes ());
+        }
+
+        // grids are built at once, container takes them in order
+        VTUWriter vtus[3];
+
+        runConcurrently (grids.size (), [&] (unsigned int i) {
+            createVTU (grids[i], &vtus[grids[i]]);
+        });
+
+        for (size_t i = 0; i < grids.size (); i++)
+            if (!archive.writeGrid (grids[i], _topoKey[grids[i]], index, time, vtus[grids[i]]))
+                return false;
+
+        return true;
+    }
+
+    PVDWriter writer (baseName, _opts->pvdMode (), index);
+    const char* names[] = { "solids", "shells", "beams" };
+    vtkUnstructuredGrid* vtkGrids[3] = { 0 };
+    VTUWriter* vtus[3] = { 0 };
+    std::vector<VTUWriter*> pieces[3];
+    bool partitioned = _opts->outputMode () == outputVTU && _opts->pieces () > 1;
+
+    runConcurrently (grids.size (), [&] (unsigned int i) {
+        grid_kind_t kind = grids[i];
+
+        if (_opts->outputMode () == outputVTK)
+            vtkGrids[kind] = createGrid (kind);
+        else if (partitioned) {
+            // derived fields are computed once for the whole grid,
+            // first piece keeps them
+            float* derived[fieldsCount];
+
+            splitGrid (kind);
+            for (size_t p = 0; p < _pieces[kind].size (); p++)
+                pieces[kind].push_back (new VTUWriter);
+            if (_stateMode)
+                computeDerived (kind, pieces[kind][0], derived);
+            for (size_t p = 0; p < _pieces[kind].size (); p++)
+                createVTU (kind, pieces[kind][p], &_pieces[kind][p], _stateMode ? derived : 0);
+        }
+        else {
+            vtus[kind] = new VTUWriter;
+            createVTU (kind, vtus[kind]);
+        }
+    });
+
+    for (size_t i = 0; i < grids.size (); i++)
+        if (vtkGrids[grids[i]])
+            writer.appendPart (names[grids[i]], vtkGrids[grids[i]]);
+        else if (partitioned)
+            writer.appendPart (names[grids[i]], pieces[grids[i]]);
+        else
+            writer.appendPart (names[grids[i]], vtus[grids[i]]);
+
+    writer.write (_pool);
+
+    // geometry alone has no time, only states make the series
+    if (!_opts->pvdMode () || index < 0)
+        return true;
+
+    // writers of several states may get here at once, the first one
+    // creates the file. VTK writer compresses by zlib unless told otherwise.
+    PVDCollection& collection = _master ? _master->_collection : _collection;
+    const char* compressor = _opts->outputMode () == outputVTK ? "vtkZLibDataCompressor" : codecVTKName (_opts->codec ());
+    char buf[1024];
+
+    if (beforeAppend)
+        beforeAppend ();
+
+    sprintf (buf, "%s.pvd", baseName);
+    if (!collection.open (buf, compressor, _opts->extendSeries ()))
+        return false;
+
+    return writer.appendTo (collection, time);
+}
+
+
+
+// --------------------------------------------------
+// pvdwriter
+// --------------------------------------------------
+PVDWriter::PVDWriter (const char* baseName, bool pvd_mode, int index)
+    : _baseName (baseName),
+      _pvd_mode (pvd_mode),
+      _index (index)
+{
+}
+
+
+PVDWriter::~PVDWriter ()
+{
+    for (unsigned int i = 0; i < _names.size (); i++) {
+        if (_grids[i])
+            _grids[i]->Delete ();
+        delete _vtus[i];
+        for (size_t p = 0; p < _pieces[i].size (); p++)
+            delete _pieces[i][p];
+    }
+}
+
+
+
+void PVDWriter::appendPart (const char* baseName, vtkUnstructuredGrid* grid)
+{
+    _names.push_back (baseName);
+    _grids.push_back (grid);
+    _vtus.push_back (0);
+    _pieces.push_back (std::vector<VTUWriter*> ());
+}
+
+
+void PVDWriter::appendPart (const char* baseName, VTUWriter* vtu)
+{
+    _names.push_back (baseName);
+    _grids.push_back (0);
+    _vtus.push_back (vtu);
+    _pieces.push_back (std::vector<VTUWriter*> ());
+}
+
+
+void PVDWriter::appendPart (const char* baseName, const std::vector<VTUWriter*>& pieces)
+{
+    _names.push_back (baseName);
+    _grids.push_back (0);
+    _vtus.push_back (0);
+    _pieces.push_back (pieces);
+}
+
+
+void PVDWriter::writePart (unsigned int part, int piece, const char* fileName)
+{
+    if (piece >= 0) {
+        _pieces[part][piece]->write (fileName);
+        return;
+    }
+
+    if (_vtus[part]) {
+        _vtus[part]->write (fileName);
+        return;
+    }
+
+    vtkXMLUnstructuredGridWriter* writer = vtkXMLUnstructuredGridWriter::New ();
+
+    writer->SetInput (_grids[part]);
+    writer->SetFileName (fileName);
+    writer->Write ();
+    writer->Delete ();
+}
+
+
+void PVDWriter::fileName (unsigned int part, int piece, const char* ext, char* buf) const
+{
+    buf += sprintf (buf, _pvd_mode ? "%s/%s" : "%s_%s", _baseName, _names[part]);
+    if (_index >= 0)
+        buf += sprintf (buf, "_%05d", _index);
+    if (piece >= 0)
+        buf += sprintf (buf, "_%d", piece);
+    sprintf (buf, ".%s", ext);
+}
+
+
+void PVDWriter::write (ThreadPool* pool)
+{
+    char buf[1024];
+
+    // create parts directory
+    if (_pvd_mode)
+        mkdir (_baseName, 0777);
+
+    // partitioned parts get index of their pieces, which are next
+    // to it
+    std::vector<std::pair<unsigned int, int> > files;
+
+    for (unsigned int i = 0; i < _names.size (); i++) {
+        if (_pieces[i].empty ()) {
+            files.push_back (std::make_pair (i, -1));
+            continue;
+        }
+
+        std::vector<std::string> sources;
+
+        for (size_t p = 0; p < _pieces[i].size (); p++) {
+            fileName (i, p, "vtu", buf);
+
+            const char* source = strrchr (buf, '/');
+
+            sources.push_back (source ? source + 1 : buf);
+            files.push_back (std::make_pair (i, (int)p));
+        }
+
+        fileName (i, -1, "pvtu", buf);
+        _pieces[i][0]->writePVTU (buf, sources);
+    }
+
+    // every part or piece goes to its own file on its own thread
+    auto task = [&] (size_t k) {
+        char name[1024];
+
+        fileName (files[k].first, files[k].second, "vtu", name);
+        writePart (files[k].first, files[k].second, name);
+    };
+
+    if (pool)
+        pool->run (files.size (), task);
+    else
+        runConcurrently (files.size (), task);
+}
+
+
+bool PVDWriter::appendTo (PVDCollection& collection, float time) const
+{
+    const char* p = strrchr (_baseName, '/');
+    std::vector<std::string> files;
+    char buf[1024];
+
+    if (!p)
+        p = _baseName;
+    else
+        p++;
+
+    // part files are <baseName>/..., collection is next to the directory
+    for (unsigned int i = 0; i < _names.size (); i++) {
+        fileName (i, -1, _pieces[i].empty () ? "vtu" : "pvtu", buf);
+        files.push_back (std::string (p) + (buf + strlen (_baseName)));
+    }
+
+    return collection.append (time, files);
+}
+
+
+
+// --------------------------------------------------
+// D3PlotState output
+// --------------------------------------------------
+void D3PlotState::save (const char* baseName, int index)
+{
+    _geo->save (baseName, index, _time);
+}
+
+
+
+// --------------------------------------------------
+// D3PlotPipeline
+// --------------------------------------------------
+D3PlotPipeline::D3PlotPipeline (StateOptions* opts, D3PlotControl* ctl, D3PlotGeometry* geo,
+                                D3PlotPrefetcher* prefetch, const char* baseName,
+                                unsigned int workers, unsigned int writers, unsigned int inFlight)
+    : _opts (opts),
+      _ctl (ctl),
+      _prefetch (prefetch),
+      _baseName (baseName),
+      _workers (workers ? workers : 1),
+      _writers (writers ? writers : 1),
+      _coords (geo->coords (), geo->coords () + ctl->nodes ()),
+      _taken (0),
+      _claimed (0),
+      _written (0),
+      _end (false)
+{
+    if (!inFlight)
+        inFlight = 1;
+
+    _slots.resize (inFlight);
+    for (unsigned int i = 0; i < _slots.size (); i++) {
+        _slots[i].geo = new D3PlotGeometry (geo);
+        _free.push_back (&_slots[i]);
+    }
+}
+
+
+D3PlotPipeline::~D3PlotPipeline ()
+{
+    for (unsigned int i = 0; i < _slots.size (); i++)
+        delete _slots[i].geo;
+}
+
+
+void D3PlotPipeline::decode ()
+{
+    while (1) {
+        const state_buffer_t* buf;
+        slot_t* slot;
+        unsigned int seq;
+
+        {
+            // states are taken in order under the take lock, so every one
+            // gets coordinates of its predecessor. Waiting for prefetcher
+            // does not hold the pipeline lock, writers go on meanwhile.
+            std::unique_lock<std::mutex> take (_takeLock);
+
+            {
+                std::unique_lock<std::mutex> lock (_lock);
+
+                while (_free.empty () && !_end)
+                    _cond.wait (lock);
+                if (_end)
+                    return;
+
+                slot = _free.front ();
+                _free.pop_front ();
+            }
+
+            buf = _prefetch->take ();
+
+            {
+                std::unique_lock<std::mutex> lock (_lock);
+
+                if (!buf) {
+                    _free.push_back (slot);
+                    _end = true;
+                }
+                else
+                    seq = _taken++;
+            }
+
+            if (!buf) {
+                _cond.notify_all ();
+                return;
+            }
+
+            slot->geo->setCoords (&_coords[0]);
+            memcpy (&_coords[0], buf->data + _ctl->layout ().coords.offset,
+                    _coords.size () * sizeof (node_coord_t));
+        }
+
+        slot->index = buf->index;
+        slot->time = buf->time;
+        slot->geo->resetState ();
+
+        D3PlotState state (_opts, _ctl, slot->geo, 0, buf);
+
+        state.read ();
+        _prefetch->release (buf);
+
+        {
+            std::unique_lock<std::mutex> lock (_lock);
+
+            _decoded[seq] = slot;
+        }
+        _cond.notify_all ();
+    }
+}
+
+
+void D3PlotPipeline::write ()
+{
+    // container takes blocks in states order only, time series takes
+    // entries in states order, part files are written in any order
+    bool ordered = _opts->outputMode () == outputArchive;
+    bool series = _opts->pvdMode ();
+
+    while (1) {
+        slot_t* slot;
+        unsigned int seq;
+
+        {
+            std::unique_lock<std::mutex> lock (_lock);
+            seq = _claimed++;
+
+            while (!_decoded.count (seq) && !(_end && seq >= _taken))
+                _cond.wait (lock);
+            if (!_decoded.count (seq))
+                return;
+
+            slot = _decoded[seq];
+            _decoded.erase (seq);
+
+            while (ordered && _written != seq)
+                _cond.wait (lock);
+        }
+
+        bool ok = slot->geo->save (_baseName, slot->index, slot->time, [&] () {
+            std::unique_lock<std::mutex> lock (_lock);
+
+            while (_written != seq)
+                _cond.wait (lock);
+        });
+
+        printf ("State %d (t = %.6f)... %s\n", slot->index, slot->time, ok ? "done" : "failed");
+
+        {
+            std::unique_lock<std::mutex> lock (_lock);
+
+            // states are counted in order, also if save ended early
+            while (series && _written != seq)
+                _cond.wait (lock);
+            _written++;
+            _free.push_back (slot);
+        }
+        _cond.notify_all ();
+    }
+}
+
+
+unsigned int D3PlotPipeline::run ()
+{
+    std::vector<std::thread> threads;
+    unsigned int i;
+
+    for (i = 0; i < _workers; i++)
+        threads.push_back (std::thread (&D3PlotPipeline::decode, this));
+    for (i = 0; i < _writers; i++)
+        threads.push_back (std::thread (&D3PlotPipeline::write, this));
+
+    for (i = 0; i < threads.size (); i++)
+        threads[i].join ();
+
+    return _written;
+}
@@ -0,0 +1,457 @@
+#include "dyna2lz.h"
+#include "kernels.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+
+// --------------------------------------------------
+// Raw fields of state layout
+// --------------------------------------------------
+// Blocks of records holding values of raw field for grid, offsets are
+// moved to the first value of the field. Solids are followed by thick
+// shells, the latter have no strains, so their cells read as zero then
+// (the same as in converted output). Returns amount of blocks, 0 if the
+// family has no such values.
+static unsigned int fieldBlocks (const D3PlotControl* ctl, int field, int grid,
+                                 state_section_t blocks[2])
+{
+    const state_layout_t& l = ctl->layout ();
+    const field_info_t& info = fieldInfo (field);
+    int pos = -1;
+
+    if (info.input >= 0)
+        return 0;
+
+    if (info.point) {
+        const state_section_t* s = field == fieldCoords ? &l.coords :
+                                   field == fieldVelocity ? &l.vel :
+                                   field == fieldAcceleration ? &l.accel : 0;
+
+        if (!s || !s->count)
+            return 0;
+        blocks[0] = *s;
+        return 1;
+    }
+
+    if (grid == gridSolids) {
+        switch (field) {
+        case fieldSigma:    pos = l.solid_sigma; break;
+        case fieldPlStrain: pos = l.solid_pl_strain; break;
+        case fieldStrain:   pos = l.solid_strain; break;
+        }
+
+        if (pos < 0)
+            return 0;
+
+        blocks[0] = l.solids;
+        blocks[0].offset += pos;
+        if (field == fieldStrain)
+            return 1;
+
+        blocks[1] = l.thick_shells;
+        blocks[1].offset += pos;
+        return 2;
+    }
+
+    if (grid != gridShells)
+        return 0;
+
+    // layers of integration points: middle, inner and outer
+    const unsigned int layers = l.shell_layers < 3 ? l.shell_layers : 3;
+    int layer = -1;
+
+    switch (field) {
+    case fieldSigma:           layer = 0; pos = l.shell_sigma; break;
+    case fieldInnerSigma:      layer = 1; pos = l.shell_sigma; break;
+    case fieldOuterSigma:      layer = 2; pos = l.shell_sigma; break;
+    case fieldPlStrain:        layer = 0; pos = l.shell_pl_strain; break;
+    case fieldInnerPlStrain:   layer = 1; pos = l.shell_pl_strain; break;
+    case fieldOuterPlStrain:   layer = 2; pos = l.shell_pl_strain; break;
+    case fieldBendingMoment:   pos = l.shell_bending; break;
+    case fieldShearResultant:  pos = l.shell_shear; break;
+    case fieldNormalResultant: pos = l.shell_normal; break;
+    case fieldThickness:       pos = l.shell_thickness; break;
+    case fieldElemDepValue:    pos = l.shell_elem_dep; break;
+    case fieldInnerStrain:     pos = l.shell_strain; break;
+    case fieldOuterStrain:     pos = l.shell_strain < 0 ? -1 : l.shell_strain + 6; break;
+    case fieldEnergy:          pos = l.shell_energy; break;
+    }
+
+    if (pos < 0 || (layer >= 0 && (unsigned int)layer >= layers))
+        return 0;
+
+    blocks[0] = l.shells;
+    blocks[0].offset += pos + (layer > 0 ? layer * l.shell_layer_stride : 0);
+    return 1;
+}
+
+
+
+// --------------------------------------------------
+// D3PlotFamily
+// --------------------------------------------------
+D3PlotFamily::D3PlotFamily ()
+    : _f (0),
+      _ctl (0),
+      _opts (0),
+      _geo (0)
+{
+}
+
+
+D3PlotFamily::~D3PlotFamily ()
+{
+    close ();
+}
+
+
+// The same sequence lsdt-dump reads family header with, states index
+// is loaded or built but never written.
+bool D3PlotFamily::open (const char* fileName)
+{
+    close ();
+
+    _f = new D3PlotFile (fileName, true);
+    if (!_f->mapped ()) {
+        close ();
+        return false;
+    }
+
+    _ctl = new D3PlotControl (_f);
+
+    // material types are not supported by geometry reader
+    if (_ctl->mattypes () || !_ctl->state_words ()) {
+        close ();
+        return false;
+    }
+
+    if (_ctl->fluid_mats () > 0)
+        _f->skip (_ctl->fluid_mats () * 4);
+
+    _opts = new StateOptions (false, false);
+    _geo = new D3PlotGeometry (_f, _ctl, _opts);
+
+    if (_ctl->narbs () > 0)
+        _f->skip (_ctl->narbs () * 4);
+    if (_ctl->sph_nodes () + _ctl->sph_mats () > 0)
+        _f->skip (sizeof (int) * (_ctl->sph_nodes () + _ctl->sph_mats ()));
+
+    char buf[1024];
+
+    snprintf (buf, sizeof (buf), "%s.idx", fileName);
+    if (!_idx.load (buf, _f, _ctl))
+        _idx.scan (_f, _ctl);
+
+    return true;
+}
+
+
+void D3PlotFamily::close ()
+{
+    delete _geo;
+    delete _opts;
+    delete _ctl;
+    delete _f;
+    _geo = 0;
+    _opts = 0;
+    _ctl = 0;
+    _f = 0;
+    _idx = D3PlotIndex ();
+    _selections.clear ();
+}
+
+
+std::vector<unsigned int> D3PlotFamily::parts (int grid) const
+{
+    std::vector<unsigned int> res;
+
+    if (!_geo || grid < 0 || grid > gridBeams)
+        return res;
+
+    const CellArray& cells = _geo->cells (grid);
+
+    res.assign (cells.partIDs (), cells.partIDs () + cells.size ());
+    std::sort (res.begin (), res.end ());
+    res.erase (std::unique (res.begin (), res.end ()), res.end ());
+    return res;
+}
+
+
+bool D3PlotFamily::select (int grid, int part, bool point, const unsigned int** index, size_t* count)
+{
+    if (!_geo || grid < -1 || grid > gridBeams || (grid < 0 && (!point || part >= 0)))
+        return false;
+
+    *index = 0;
+    if (grid < 0) {
+        *count = _ctl->nodes ();
+        return true;
+    }
+
+    const CellArray& cells = _geo->cells (grid);
+
+    if (!point && part < 0) {
+        *count = cells.size ();
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock (_lock);
+    std::pair<int, int> key (grid, part);
+    bool made = _selections.count (key);
+    selection_t& s = _selections[key];
+    unsigned int i;
+
+    if (!made) {
+        std::vector<unsigned char> used (_ctl->nodes (), 0);
+
+        for (i = 0; i < cells.size (); i++)
+            if (part < 0 || cells.partID (i) == (unsigned int)part) {
+                const unsigned int* nodes = cells.nodes (i);
+
+                if (part >= 0)
+                    s.cells.push_back (i);
+                for (unsigned int j = 0; j < cells.nodesCount (i); j++)
+                    used[nodes[j]] = 1;
+            }
+
+        for (i = 0; i < used.size (); i++)
+            if (used[i])
+                s.nodes.push_back (i);
+    }
+
+    const std::vector<unsigned int>& list = point ? s.nodes : s.cells;
+
+    *index = list.empty () ? 0 : &list[0];
+    *count = list.size ();
+    return true;
+}
+
+
+bool D3PlotFamily::cellsOf (int grid, int part, D3PlotView<unsigned int>& view)
+{
+    const unsigned int* index;
+    size_t count;
+
+    if (!select (grid, part, false, &index, &count))
+        return false;
+
+    // every cell of grid has no list, it is made here
+    if (!index && count) {
+        std::vector<unsigned int> all (count);
+
+        for (size_t i = 0; i < count; i++)
+            all[i] = i;
+        view.adopt (all, 1);
+    }
+    else
+        view.attach (index, count, 1, 1);
+
+    return true;
+}
+
+
+bool D3PlotFamily::nodesOf (int grid, int part, D3PlotView<unsigned int>& view)
+{
+    const unsigned int* index;
+    size_t count;
+
+    if (grid < 0 || !select (grid, part, true, &index, &count))
+        return false;
+
+    view.attach (index, count, 1, 1);
+    return true;
+}
+
+
+bool D3PlotFamily::coords (D3PlotView<float>& view, int grid, int part)
+{
+    const unsigned int* index;
+    size_t count;
+
+    if (!select (grid, part, true, &index, &count))
+        return false;
+
+    view.attach ((const float*)_geo->coords (), count, 3, 3, index);
+    return true;
+}
+
+
+const float* D3PlotFamily::mapWords (unsigned int state, unsigned long long offset, size_t words,
+                                     std::vector<char>& scratch)
+{
+    std::lock_guard<std::mutex> lock (_lock);
+    unsigned long long skip = (1 + offset) * WORD_SIZE;
+
+    if (!_f->seek (_idx.state (state).pos) || _f->skip (skip) < skip)
+        return 0;
+
+    return (const float*)_f->mapBlock (words * WORD_SIZE, scratch);
+}
+
+
+// Single block in the mapping is referred to as is, values of several
+// blocks (or copied ones) are gathered into the view.
+bool D3PlotFamily::rawField (unsigned int state, const state_section_t* blocks, unsigned int count,
+                             unsigned int components, size_t all, const unsigned int* index,
+                             size_t records, D3PlotView<float>& view)
+{
+    std::vector<char> scratch[2];
+    const float* data[2];
+    unsigned long long total = 0;
+    bool mapped = true;
+    unsigned int b;
+
+    for (b = 0; b < count; b++) {
+        data[b] = 0;
+        if (blocks[b].count) {
+            size_t words = (size_t)(blocks[b].count - 1) * blocks[b].stride + components;
+
+            if (!(data[b] = mapWords (state, blocks[b].offset, words, scratch[b])))
+                return false;
+            mapped = mapped && (scratch[b].empty () || data[b] != (const float*)&scratch[b][0]);
+        }
+        total += blocks[b].count;
+    }
+
+    if (count == 1 && mapped && total >= all) {
+        view.attach (data[0], records, components, blocks[0].stride, index);
+        return true;
+    }
+
+    std::vector<float> values ((size_t)records * components, 0.0f);
+
+    for (size_t i = 0; i < records; i++) {
+        unsigned long long r = index ? index[i] : i;
+
+        for (b = 0; b < count && r >= blocks[b].count; b++)
+            r -= blocks[b].count;
+
+        // records past the blocks have no values
+        if (b < count)
+            memcpy (&values[i * components], data[b] + r * blocks[b].stride,
+                    components * sizeof (float));
+    }
+
+    view.adopt (values, components);
+    return true;
+}
+
+
+bool D3PlotFamily::field (unsigned int state, int field, D3PlotView<float>& view, int grid, int part)
+{
+    if (!_geo || state >= _idx.size () || field < 0 || field >= fieldsCount)
+        return false;
+
+    const field_info_t& info = fieldInfo (field);
+    const unsigned int* index;
+    size_t count;
+
+    if (!select (grid, part, info.point, &index, &count))
+        return false;
+
+    // derived values are computed for selected cells only
+    if (info.input >= 0) {
+        D3PlotView<float> input;
+
+        if (!this->field (state, info.input, input, grid, part))
+            return false;
+
+        std::vector<float> tensors (count * 6), values (count * info.components);
+        float* out = values.empty () ? 0 : &values[0];
+
+        input.copyTo (tensors.empty () ? 0 : &tensors[0]);
+        if (count)
+            tensorInvariants (&tensors[0], count,
+                              field == fieldPrincipalStress || field == fieldPrincipalStrain ? out : 0,
+                              field == fieldVonMises ? out : 0,
+                              field == fieldHydroPressure ? out : 0,
+                              field == fieldPrincipalShear ? out : 0,
+                              field == fieldOctahedralShear ? out : 0);
+        view.adopt (values, info.components);
+        return true;
+    }
+
+    // movements since previous state
+    if (field == fieldDeltas) {
+        D3PlotView<float> cur, prev;
+
+        if (!this->field (state, fieldCoords, cur, grid, part) ||
+            !(state ? this->field (state - 1, fieldCoords, prev, grid, part) : coords (prev, grid, part)))
+            return false;
+
+        std::vector<float> values (count * 3);
+
+        for (size_t i = 0; i < count; i++)
+            for (unsigned int c = 0; c < 3; c++)
+                values[i * 3 + c] = cur[i][c] - prev[i][c];
+        view.adopt (values, 3);
+        return true;
+    }
+
+    state_section_t blocks[2];
+    unsigned int n = fieldBlocks (_ctl, field, grid, blocks);
+
+    size_t all = info.point ? _ctl->nodes () : _geo->cells (grid).size ();
+
+    return n && rawField (state, blocks, n, info.components, all, index, count, view);
+}
+
+
+// Deletion data holds a flag per cell of every grid in grids order,
+// the same as the converter takes it (see D3PlotGeometry::setDeletion).
+bool D3PlotFamily::deleted (unsigned int state, D3PlotView<unsigned char>& view, int grid, int part)
+{
+    const unsigned int* index;
+    size_t count;
+
+    if (!_geo || state >= _idx.size () || grid < 0 || !select (grid, part, false, &index, &count))
+        return false;
+
+    std::vector<unsigned char> flags (count, 0);
+    size_t cells = _geo->cells (grid).size ();
+
+    if (_ctl->elems_deletion () == 2 && cells) {
+        unsigned long long offset = _ctl->layout ().deletion.offset;
+        std::vector<char> scratch;
+        std::vector<uint64_t> bits ((cells + 63) / 64);
+
+        for (int i = 0; i < grid; i++)
+            offset += _geo->cells (i).size ();
+
+        const float* data = mapWords (state, offset, cells, scratch);
+
+        if (!data)
+            return false;
+
+        decodeDeletion (data, cells, &bits[0]);
+        for (size_t i = 0; i < count; i++) {
+            size_t cell = index ? index[i] : i;
+
+            flags[i] = (bits[cell >> 6] >> (cell & 63)) & 1;
+        }
+    }
+
+    view.adopt (flags, 1);
+    return true;
+}
+
+
+bool D3PlotFamily::liveCells (unsigned int state, D3PlotView<unsigned int>& view, int grid, int part)
+{
+    D3PlotView<unsigned char> flags;
+
+    if (!deleted (state, flags, grid, part))
+        return false;
+
+    std::vector<unsigned int> live;
+
+    for (size_t i = 0; i < flags.size (); i++)
+        if (!*flags[i])
+            live.push_back (i);
+
+    view.adopt (live, 1);
+    return true;
+}
@@ -0,0 +1,183 @@
+//
+// libdyna2lz: in-process random access to states of d3plot family, no
+// VTK and no intermediate files needed. Family is memory mapped, states
+// are located by the states index (<family>.idx is used if it matches,
+// otherwise states are scanned in memory), and values are served as
+// views straight into the mapping whenever state layout allows it.
+//
+#ifndef __DYNA2LZ_H__
+#define __DYNA2LZ_H__
+
+#include <stddef.h>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "d3plot.h"
+#include "options.h"
+
+
+// Read-only view of count tuples of components values. Tuple i starts
+// stride values after tuple i - 1, or at record index[i] if the view is
+// indexed. Values either refer to memory of the family (valid while it
+// is open) or are held by the view itself.
+template <typename T>
+class D3PlotView
+{
+private:
+    const T* _data;
+    size_t _count;
+    unsigned int _components, _stride;
+    const unsigned int* _index;
+    std::vector<T> _own;
+
+public:
+    D3PlotView ()
+        : _data (0), _count (0), _components (0), _stride (0), _index (0) { };
+
+    // refers to external records, index may be 0
+    void attach (const T* data, size_t count, unsigned int components,
+                 unsigned int stride, const unsigned int* index = 0)
+        {
+            _own.clear ();
+            _data = data;
+            _count = count;
+            _components = components;
+            _stride = stride;
+            _index = index;
+        };
+
+    // takes packed tuples, values is left empty
+    void adopt (std::vector<T>& values, unsigned int components)
+        {
+            _own.swap (values);
+            values.clear ();
+            _data = 0;
+            _count = components ? _own.size () / components : 0;
+            _components = _stride = components;
+            _index = 0;
+        };
+
+    size_t size () const
+        { return _count; };
+    unsigned int components () const
+        { return _components; };
+
+    const T* operator[] (size_t i) const
+        { return (_own.empty () ? _data : &_own[0]) + (size_t)(_index ? _index[i] : i) * _stride; };
+
+    // tuples follow each other without gaps from (*this)[0] on
+    bool packed () const
+        { return !_index && _stride == _components; };
+
+    // copies values into dst as packed tuples
+    void copyTo (T* dst) const
+        {
+            for (size_t i = 0; i < _count; i++, dst += _components)
+                for (unsigned int c = 0; c < _components; c++)
+                    dst[c] = (*this)[i][c];
+        };
+};
+
+
+class D3PlotFamily
+{
+private:
+    D3PlotFile* _f;
+    D3PlotControl* _ctl;
+    StateOptions* _opts;
+    D3PlotGeometry* _geo;  // cells and initial coordinates only
+    D3PlotIndex _idx;
+
+    // cells of part of grid and nodes they use, by (grid, part), made
+    // on first use. Cells of part -1 are not listed, it has all of them.
+    typedef struct {
+        std::vector<unsigned int> cells;
+        std::vector<unsigned int> nodes;
+    } selection_t;
+
+    std::map<std::pair<int, int>, selection_t> _selections;
+
+    // family file position is shared by all callers
+    std::mutex _lock;
+
+protected:
+    // records of selection, index is 0 if it has every record
+    bool select (int grid, int part, bool point, const unsigned int** index, size_t* count);
+
+    // Words of state from offset on (in words after time word). Result
+    // points into the mapping, or into scratch if words straddle two
+    // files of family. 0 if state is truncated.
+    const float* mapWords (unsigned int state, unsigned long long offset, size_t words,
+                           std::vector<char>& scratch);
+
+    // Values of raw field held by blocks of records, all is amount of
+    // records of grid (or nodes), records are selected by index
+    bool rawField (unsigned int state, const state_section_t* blocks, unsigned int count,
+                   unsigned int components, size_t all, const unsigned int* index,
+                   size_t records, D3PlotView<float>& view);
+
+public:
+    D3PlotFamily ();
+    ~D3PlotFamily ();
+
+    // fileName is the first file of family (d3plot)
+    bool open (const char* fileName);
+    void close ();
+
+    bool isOpen () const
+        { return _geo != 0; };
+
+    const D3PlotControl* control () const
+        { return _ctl; };
+
+    unsigned int statesCount () const
+        { return _idx.size (); };
+    float time (unsigned int state) const
+        { return _idx.state (state).time; };
+
+    // index of state with time nearest to given one, -1 if none
+    int findTime (float time) const
+        { return _idx.findTime (time); };
+
+    // cells of grid (grid_kind_t) in file order, global node IDs
+    const CellArray& cells (int grid) const
+        { return _geo->cells (grid); };
+
+    // IDs of parts having cells in grid, ascending
+    std::vector<unsigned int> parts (int grid) const;
+
+    // Cells of part of grid (all of them if part is -1) in file order
+    // and nodes they use as ascending global IDs. Views of cell or
+    // point values of the same grid and part follow these orders.
+    bool cellsOf (int grid, int part, D3PlotView<unsigned int>& view);
+    bool nodesOf (int grid, int part, D3PlotView<unsigned int>& view);
+
+    // Coordinates of nodes before the first state. Grid -1 is every
+    // node of family.
+    bool coords (D3PlotView<float>& view, int grid = -1, int part = -1);
+
+    // Values of raw or derived field (field_id_t, see findField) in
+    // state. Cell fields are of cells of part of grid, point fields of
+    // its nodes, or of every node with grid -1. Delta movements are
+    // taken against the previous state (initial coordinates for the
+    // first one). False if family holds no such values. Safe to be
+    // called from several threads.
+    bool field (unsigned int state, int field, D3PlotView<float>& view,
+                int grid = -1, int part = -1);
+
+    // Deletion flags of cells of part of grid in state, 1 for cells
+    // deleted (eroded) by then, in the order of cellsOf. Views of cell
+    // fields hold deleted cells too, while the converter leaves them out
+    // unless deleted cells are kept. Flags are 0 if family has no
+    // element deletion data.
+    bool deleted (unsigned int state, D3PlotView<unsigned char>& view, int grid, int part = -1);
+
+    // positions (in the order of cellsOf) of cells of part of grid not
+    // deleted in state, the cells converted output of state holds
+    bool liveCells (unsigned int state, D3PlotView<unsigned int>& view, int grid, int part = -1);
+};
+
+
+#endif
@@ -0,0 +1,279 @@
+#include "kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mutex>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// vector kernels are built for x86 regardless of compiler flags and
+// chosen at run time. Every function using intrinsics carries target
+// attribute, clang does not honour GCC target pragmas.
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+
+// --------------------------------------------------
+// Deletion flags
+// --------------------------------------------------
+void decodeDeletion (const float* data, size_t count, uint64_t* bits)
+{
+    size_t words = count / 64, i, j;
+
+    for (i = 0; i < words; i++, data += 64) {
+        uint64_t res = 0;
+
+#ifdef __SSE2__
+        // 4 flags per compare, movemask packs sign bits of results
+        const __m128 half = _mm_set1_ps (0.5f);
+
+        for (j = 0; j < 64; j += 4)
+            res |= (uint64_t)_mm_movemask_ps (_mm_cmplt_ps (_mm_loadu_ps (data + j), half)) << j;
+#else
+        for (j = 0; j < 64; j++)
+            res |= (uint64_t)(data[j] < 0.5f) << j;
+#endif
+        bits[i] = res;
+    }
+
+    // tail
+    if (count % 64) {
+        uint64_t res = 0;
+
+        for (j = 0; j < count % 64; j++)
+            res |= (uint64_t)(data[j] < 0.5f) << j;
+        bits[i] = res;
+    }
+}
+
+
+size_t countBits (const uint64_t* bits, size_t count)
+{
+    size_t res = 0, i;
+
+    for (i = 0; i < count / 64; i++)
+        res += __builtin_popcountll (bits[i]);
+
+    if (count % 64)
+        res += __builtin_popcountll (bits[i] & ((1ULL << (count % 64)) - 1));
+
+    return res;
+}
+
+
+// --------------------------------------------------
+// Tensor invariants
+// --------------------------------------------------
+static int float_compare_rev (const void* a, const void* b)
+{
+    return *(float*)a < *(float*)b ? 1 : -1;
+}
+
+
+void tensorInvariantsScalar (const float* tensors, size_t count, float* principal,
+                             float* vonMises, float* hydro, float* priShear, float* octShear)
+{
+    for (size_t k = 0; k < count; k++, tensors += 6) {
+        const float* sigma = tensors;
+        float a, b, c, d, e, f;
+
+        a = sigma[0] - sigma[1];
+        b = sigma[1] - sigma[2];
+        c = sigma[2] - sigma[0];
+
+        d = sigma[3];
+        e = sigma[4];
+        f = sigma[5];
+
+        if (vonMises)
+            vonMises[k] = sqrt ((a*a + b*b + c*c + 6*(d*d+e*e+f*f)) / 2);
+
+        float alpha = 0.0, koefA = -(sigma[0]+sigma[1]+sigma[2]), koefB, koefC, kP, kQ, fi;
+
+        if (hydro)
+            hydro[k] = koefA / 3.0;
+
+        if (!principal && !priShear && !octShear)
+            continue;
+
+        koefB = sigma[0]*sigma[1] + sigma[1]*sigma[2] + sigma[2]*sigma[0] -
+                sigma[3]*sigma[3] - sigma[4]*sigma[4] - sigma[5]*sigma[5];
+
+        koefC = sigma[0]*sigma[1]*sigma[2] - 2*sigma[3]*sigma[4]*sigma[5] +
+                sigma[0]*sigma[4]*sigma[4] + sigma[1]*sigma[5]*sigma[5] + sigma[2]*sigma[3]*sigma[3];
+
+        kP = -(koefA * koefA / 3.0) + koefB;
+
+        kQ = 2*koefA*koefA*koefA - koefA*koefB/3.0 + koefC;
+        fi = -kQ / 2.0 / sqrt (-kP*kP*kP/27.0);
+
+        if (fabs (fi) >= 1)
+            alpha = 0.0;
+        else
+            alpha = acos (fi) / 3.0;
+
+        float res[3];
+
+        res[0] = 2*sqrt (-kP/3.0) * cos (alpha) - koefA/3.0;
+        res[1] = -2*sqrt (-kP/3.0) * cos (alpha + 1.047197551197) - koefA/3.0;
+        res[2] = -2*sqrt (-kP/3.0) * cos (alpha - 1.047197551197) - koefA/3.0;
+
+        qsort (res, 3, sizeof (float), float_compare_rev);
+
+        if (principal)
+            memcpy (principal + k * 3, res, sizeof (res));
+
+        float data2[3] = {
+            (res[0]-res[1]),
+            (res[1]-res[2]),
+            (res[2]-res[0])
+        };
+
+        if (octShear)
+            octShear[k] = sqrt (data2[0]*data2[0] + data2[1]*data2[1] + data2[2]*data2[2]) / 3;
+
+        if (priShear) {
+            priShear[k * 3]     = data2[0] / 2;
+            priShear[k * 3 + 1] = data2[1] / 2;
+            priShear[k * 3 + 2] = data2[2] / 2;
+        }
+    }
+}
+
+
+#ifdef KERNELS_X86
+
+// AVX2 + FMA, 8 tensors at once
+#define KERNEL_TARGET __attribute__ ((target ("avx2,fma")))
+
+namespace avx2 {
+
+struct traits {
+    typedef __m256 vec;
+    typedef __m256 mask;
+    static const int width = 8;
+
+    static KERNEL_TARGET vec set (float a)                 { return _mm256_set1_ps (a); }
+    static KERNEL_TARGET vec load (const float* p)         { return _mm256_loadu_ps (p); }
+    static KERNEL_TARGET void store (float* p, vec a)      { _mm256_storeu_ps (p, a); }
+    static KERNEL_TARGET vec add (vec a, vec b)            { return _mm256_add_ps (a, b); }
+    static KERNEL_TARGET vec sub (vec a, vec b)            { return _mm256_sub_ps (a, b); }
+    static KERNEL_TARGET vec mul (vec a, vec b)            { return _mm256_mul_ps (a, b); }
+    static KERNEL_TARGET vec div (vec a, vec b)            { return _mm256_div_ps (a, b); }
+    static KERNEL_TARGET vec sqrt (vec a)                  { return _mm256_sqrt_ps (a); }
+    static KERNEL_TARGET vec min (vec a, vec b)            { return _mm256_min_ps (a, b); }
+    static KERNEL_TARGET vec max (vec a, vec b)            { return _mm256_max_ps (a, b); }
+    static KERNEL_TARGET vec abs (vec a)                   { return _mm256_andnot_ps (_mm256_set1_ps (-0.0f), a); }
+    static KERNEL_TARGET mask lt (vec a, vec b)            { return _mm256_cmp_ps (a, b, _CMP_LT_OQ); }
+    static KERNEL_TARGET mask gt (vec a, vec b)            { return _mm256_cmp_ps (a, b, _CMP_GT_OQ); }
+    static KERNEL_TARGET mask ge (vec a, vec b)            { return _mm256_cmp_ps (a, b, _CMP_GE_OQ); }
+    static KERNEL_TARGET vec select (mask m, vec a, vec b) { return _mm256_blendv_ps (b, a, m); }
+};
+
+typedef traits V;
+#include "kernels_simd.h"
+
+}
+
+#undef KERNEL_TARGET
+
+
+// AVX-512, 16 tensors at once
+#define KERNEL_TARGET __attribute__ ((target ("avx512f")))
+// gcc warns on _mm512_undefined_ps inside its own headers
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+namespace avx512 {
+
+struct traits {
+    typedef __m512 vec;
+    typedef __mmask16 mask;
+    static const int width = 16;
+
+    static KERNEL_TARGET vec set (float a)                 { return _mm512_set1_ps (a); }
+    static KERNEL_TARGET vec load (const float* p)         { return _mm512_loadu_ps (p); }
+    static KERNEL_TARGET void store (float* p, vec a)      { _mm512_storeu_ps (p, a); }
+    static KERNEL_TARGET vec add (vec a, vec b)            { return _mm512_add_ps (a, b); }
+    static KERNEL_TARGET vec sub (vec a, vec b)            { return _mm512_sub_ps (a, b); }
+    static KERNEL_TARGET vec mul (vec a, vec b)            { return _mm512_mul_ps (a, b); }
+    static KERNEL_TARGET vec div (vec a, vec b)            { return _mm512_div_ps (a, b); }
+    static KERNEL_TARGET vec sqrt (vec a)                  { return _mm512_sqrt_ps (a); }
+    static KERNEL_TARGET vec min (vec a, vec b)            { return _mm512_min_ps (a, b); }
+    static KERNEL_TARGET vec max (vec a, vec b)            { return _mm512_max_ps (a, b); }
+    static KERNEL_TARGET vec abs (vec a)                   { return _mm512_abs_ps (a); }
+    static KERNEL_TARGET mask lt (vec a, vec b)            { return _mm512_cmp_ps_mask (a, b, _CMP_LT_OQ); }
+    static KERNEL_TARGET mask gt (vec a, vec b)            { return _mm512_cmp_ps_mask (a, b, _CMP_GT_OQ); }
+    static KERNEL_TARGET mask ge (vec a, vec b)            { return _mm512_cmp_ps_mask (a, b, _CMP_GE_OQ); }
+    static KERNEL_TARGET vec select (mask m, vec a, vec b) { return _mm512_mask_blend_ps (m, b, a); }
+};
+
+typedef traits V;
+#include "kernels_simd.h"
+
+}
+
+#pragma GCC diagnostic pop
+#undef KERNEL_TARGET
+
+#endif
+
+
+static invariants_fn invariantsKernel = 0;
+static const char* invariantsName = 0;
+static std::once_flag invariantsOnce;
+
+
+invariants_fn tensorKernel (const char* name)
+{
+    if (!strcmp (name, "scalar"))
+        return tensorInvariantsScalar;
+
+#ifdef KERNELS_X86
+    __builtin_cpu_init ();
+
+    if (!strcmp (name, "avx512") && __builtin_cpu_supports ("avx512f"))
+        return avx512::tensorInvariantsVec;
+
+    if (!strcmp (name, "avx2") && __builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma"))
+        return avx2::tensorInvariantsVec;
+#endif
+
+    return 0;
+}
+
+
+static void selectInvariantsKernel ()
+{
+    // the widest one first
+    static const char* names[] = { "avx512", "avx2", "scalar" };
+
+    for (unsigned int i = 0; !invariantsKernel; i++) {
+        invariantsKernel = tensorKernel (names[i]);
+        invariantsName = names[i];
+    }
+}
+
+
+void tensorInvariants (const float* tensors, size_t count, float* principal,
+                       float* vonMises, float* hydro, float* priShear, float* octShear)
+{
+    // grids and states are converted on several threads
+    std::call_once (invariantsOnce, selectInvariantsKernel);
+
+    invariantsKernel (tensors, count, principal, vonMises, hydro, priShear, octShear);
+}
+
+
+const char* tensorKernelName ()
+{
+    std::call_once (invariantsOnce, selectInvariantsKernel);
+
+    return invariantsName;
+}
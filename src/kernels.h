@@ -0,0 +1,42 @@
+//
+// Data conversion kernels working on whole arrays at once
+//
+#ifndef __KERNELS_H__
+#define __KERNELS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Converts count MDLOPT deletion flags (float 1.0 - alive, 0.0 -
+// deleted) into bitset, bit is set for deleted cell. Bits array must
+// hold (count + 63) / 64 words, unused bits of the last one are zeroed.
+void decodeDeletion(const float *data, size_t count, uint64_t *bits);
+
+// amount of set bits in count first bits of bitset
+size_t countBits(const uint64_t *bits, size_t count);
+
+// Derived values of count symmetric tensors stored as 6 floats (xx, yy,
+// zz, xy, yz, zx): principal values (3 per tensor, descending), von
+// Mises value, hydrostatic pressure, principal shear (3 per tensor) and
+// octahedral shear. Any output may be 0 if not needed. Uses the widest
+// vector unit of the CPU, chosen on first call.
+void tensorInvariants(const float *tensors, size_t count, float *principal,
+                      float *vonMises, float *hydro, float *priShear,
+                      float *octShear);
+
+// the same, one tensor at a time in double precision, for reference
+void tensorInvariantsScalar(const float *tensors, size_t count,
+                            float *principal, float *vonMises, float *hydro,
+                            float *priShear, float *octShear);
+
+// name of instruction set used by tensorInvariants
+const char *tensorKernelName();
+
+typedef void (*invariants_fn)(const float *, size_t, float *, float *, float *,
+                              float *, float *);
+
+// tensorInvariants kernel of given instruction set ("scalar", "avx2",
+// "avx512"), 0 if it is not built in or not supported by the CPU
+invariants_fn tensorKernel(const char *name);
+
+#endif
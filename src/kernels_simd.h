@@ -0,0 +1,167 @@
+//
+// Vector kernels body. This file is included by kernels.cpp several
+// times, once for every instruction set, with V set to traits class
+// of vector type and KERNEL_TARGET to target attribute of the set. It
+// has no include guard on purpose.
+//
+
+// acos (x) with float accuracy, asin series from cephes
+static inline KERNEL_TARGET typename V::vec vacos (typename V::vec x)
+{
+    typedef typename V::vec vec;
+
+    vec ax  = V::abs (x);
+    typename V::mask big = V::gt (ax, V::set (0.5f));
+    vec z   = V::select (big, V::mul (V::set (0.5f), V::sub (V::set (1.0f), ax)), V::mul (x, x));
+    vec s   = V::select (big, V::sqrt (z), ax);
+
+    vec p = V::set (4.2163199048E-2f);
+    p = V::add (V::mul (p, z), V::set (2.4181311049E-2f));
+    p = V::add (V::mul (p, z), V::set (4.5470025998E-2f));
+    p = V::add (V::mul (p, z), V::set (7.4953002686E-2f));
+    p = V::add (V::mul (p, z), V::set (1.6666752422E-1f));
+    p = V::add (V::mul (V::mul (p, z), s), s);          // asin (s)
+
+    typename V::mask neg = V::lt (x, V::set (0.0f));
+
+    // |x| > 0.5: acos (|x|) = 2 asin (sqrt ((1 - |x|) / 2))
+    vec r_big = V::add (p, p);
+    r_big = V::select (neg, V::sub (V::set (3.14159265358979f), r_big), r_big);
+
+    // |x| <= 0.5: acos (x) = pi/2 - asin (x)
+    vec r_small = V::select (neg, V::add (V::set (1.57079632679490f), p),
+                             V::sub (V::set (1.57079632679490f), p));
+
+    return V::select (big, r_big, r_small);
+}
+
+
+// cos and sin of x in [0, pi/3], Taylor series
+static inline KERNEL_TARGET void vsincos (typename V::vec x, typename V::vec& c, typename V::vec& s)
+{
+    typedef typename V::vec vec;
+
+    vec x2 = V::mul (x, x);
+
+    c = V::set (1.0f / 479001600.0f);
+    c = V::add (V::mul (c, x2), V::set (-1.0f / 3628800.0f));
+    c = V::add (V::mul (c, x2), V::set (1.0f / 40320.0f));
+    c = V::add (V::mul (c, x2), V::set (-1.0f / 720.0f));
+    c = V::add (V::mul (c, x2), V::set (1.0f / 24.0f));
+    c = V::add (V::mul (c, x2), V::set (-0.5f));
+    c = V::add (V::mul (c, x2), V::set (1.0f));
+
+    s = V::set (1.0f / 6227020800.0f);
+    s = V::add (V::mul (s, x2), V::set (-1.0f / 39916800.0f));
+    s = V::add (V::mul (s, x2), V::set (1.0f / 362880.0f));
+    s = V::add (V::mul (s, x2), V::set (-1.0f / 5040.0f));
+    s = V::add (V::mul (s, x2), V::set (1.0f / 120.0f));
+    s = V::add (V::mul (s, x2), V::set (-1.0f / 6.0f));
+    s = V::mul (V::add (V::mul (s, x2), V::set (1.0f)), x);
+}
+
+
+// Same math as tensorInvariantsScalar, V::width cells per iteration.
+// Tensors are transposed through small stack blocks, so any count and
+// alignment is handled.
+static KERNEL_TARGET void tensorInvariantsVec (const float* tensors, size_t count, float* principal,
+                                               float* vonMises, float* hydro, float* priShear, float* octShear)
+{
+    typedef typename V::vec vec;
+    const int W = V::width;
+    float in[6][W], out[9][W];
+
+    for (size_t base = 0; base < count; base += W) {
+        int n = count - base < (size_t)W ? count - base : W, i, j;
+
+        for (i = 0; i < W; i++)
+            for (j = 0; j < 6; j++)
+                in[j][i] = i < n ? tensors[(base + i) * 6 + j] : 0.0f;
+
+        vec s0 = V::load (in[0]), s1 = V::load (in[1]), s2 = V::load (in[2]);
+        vec s3 = V::load (in[3]), s4 = V::load (in[4]), s5 = V::load (in[5]);
+
+        // von Mises and hydrostatic pressure
+        vec a = V::sub (s0, s1), b = V::sub (s1, s2), c = V::sub (s2, s0);
+        vec sh = V::add (V::add (V::mul (s3, s3), V::mul (s4, s4)), V::mul (s5, s5));
+        vec vm = V::add (V::add (V::mul (a, a), V::mul (b, b)), V::mul (c, c));
+
+        vm = V::sqrt (V::mul (V::add (vm, V::mul (V::set (6.0f), sh)), V::set (0.5f)));
+
+        vec kA = V::sub (V::set (0.0f), V::add (V::add (s0, s1), s2));
+        vec kB = V::sub (V::add (V::add (V::mul (s0, s1), V::mul (s1, s2)), V::mul (s2, s0)), sh);
+        vec kC = V::mul (V::mul (s0, s1), s2);
+
+        kC = V::sub (kC, V::mul (V::set (2.0f), V::mul (V::mul (s3, s4), s5)));
+        kC = V::add (kC, V::mul (V::mul (s0, s4), s4));
+        kC = V::add (kC, V::mul (V::mul (s1, s5), s5));
+        kC = V::add (kC, V::mul (V::mul (s2, s3), s3));
+
+        vec third = V::set (1.0f / 3.0f);
+        vec kA3 = V::mul (kA, third);
+        vec kP = V::sub (kB, V::mul (kA, kA3));
+        vec kQ = V::add (V::sub (V::mul (V::set (2.0f), V::mul (V::mul (kA, kA), kA)),
+                                 V::mul (kB, kA3)), kC);
+
+        // -kP^3/27 = r^3, r = sqrt (-kP/3)
+        vec r  = V::sqrt (V::mul (V::sub (V::set (0.0f), kP), third));
+        vec fi = V::div (V::mul (kQ, V::set (-0.5f)), V::mul (V::mul (r, r), r));
+        vec alpha = V::select (V::ge (V::abs (fi), V::set (1.0f)), V::set (0.0f),
+                               V::mul (vacos (fi), third));
+
+        // cos (alpha -+ pi/3) = cos (alpha) / 2 +- sin (alpha) * sqrt (3) / 2
+        vec ca, sa;
+
+        vsincos (alpha, ca, sa);
+
+        vec r2 = V::add (r, r);
+        vec half_c = V::mul (ca, V::set (0.5f));
+        vec sq_s   = V::mul (sa, V::set (0.866025403784439f));
+        vec p0 = V::sub (V::mul (r2, ca), kA3);
+        vec p1 = V::sub (V::sub (V::set (0.0f), V::mul (r2, V::sub (half_c, sq_s))), kA3);
+        vec p2 = V::sub (V::sub (V::set (0.0f), V::mul (r2, V::add (half_c, sq_s))), kA3);
+
+        // sorting network, descending order
+        vec hi = V::max (p0, p1), lo = V::min (p0, p1);
+        vec t  = V::min (hi, p2);
+
+        hi = V::max (hi, p2);
+        vec mid = V::max (lo, t);
+        lo = V::min (lo, t);
+
+        // principal shear and octahedral shear
+        vec d0 = V::sub (hi, mid), d1 = V::sub (mid, lo), d2 = V::sub (lo, hi);
+        vec oct = V::mul (V::sqrt (V::add (V::add (V::mul (d0, d0), V::mul (d1, d1)), V::mul (d2, d2))), third);
+
+        V::store (out[0], hi);
+        V::store (out[1], mid);
+        V::store (out[2], lo);
+        V::store (out[3], vm);
+        V::store (out[4], kA3);
+        V::store (out[5], V::mul (d0, V::set (0.5f)));
+        V::store (out[6], V::mul (d1, V::set (0.5f)));
+        V::store (out[7], V::mul (d2, V::set (0.5f)));
+        V::store (out[8], oct);
+
+        for (i = 0; i < n; i++) {
+            size_t k = base + i;
+
+            if (principal) {
+                principal[k * 3]     = out[0][i];
+                principal[k * 3 + 1] = out[1][i];
+                principal[k * 3 + 2] = out[2][i];
+            }
+            if (vonMises)
+                vonMises[k] = out[3][i];
+            if (hydro)
+                hydro[k] = out[4][i];
+            if (priShear) {
+                priShear[k * 3]     = out[5][i];
+                priShear[k * 3 + 1] = out[6][i];
+                priShear[k * 3 + 2] = out[7][i];
+            }
+            if (octShear)
+                octShear[k] = out[8][i];
+        }
+    }
+}
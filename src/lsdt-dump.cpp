@@ -24,31 +24,288 @@
 //
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <getopt.h>
 
 #include "d3plot.h"
 
 
+static void usage ()
+{
+    printf ("Usage: lsdt-dump [options] d3plot basename\n");
+    printf ("Options:\n");
+    printf ("  -m, --mmap       map d3plot family into memory instead of reading it\n");
+    printf ("  -i, --index      use (and create if needed) state index d3plot.idx\n");
+    printf ("  -s, --state N    convert only state N, implies -i\n");
+    printf ("  -t, --time T     convert only state nearest to time T, implies -i\n");
+    printf ("  -c, --cache      use (and create if needed) geometry cache d3plot.geo\n");
+    printf ("  -p, --prefetch N read up to N states ahead in background\n");
+    printf ("      --prefetch-mem MB\n");
+    printf ("                   limit memory used by prefetched states\n");
+    printf ("  -f, --fields LIST\n");
+    printf ("                   write only comma separated list of fields, for example\n");
+    printf ("                   \"Von Mises Stress,Plastic Strain,Velocity\"\n");
+    printf ("      --vtk-writer write files through VTK instead of built-in writer\n");
+    printf ("  -z, --compress CODEC[:LEVEL]\n");
+    printf ("                   compress output data by zlib, lz4 or zstd (zstd with\n");
+    printf ("                   --archive only)\n");
+    printf ("  -j, --threads N  compress by N threads, default is one per CPU\n");
+    printf ("  -w, --workers N  decode N states at once on separate threads\n");
+    printf ("      --writers M  write M states at once on separate threads\n");
+    printf ("      --in-flight K\n");
+    printf ("                   limit states being decoded or written at once, every one\n");
+    printf ("                   takes memory of a geometry copy (default N + M)\n");
+    printf ("      --pvd        write parts into basename/ directory and time series\n");
+    printf ("                   basename.pvd, which is valid after every state. With\n");
+    printf ("                   -s or -t the state is added to existing series\n");
+    printf ("  -k, --pieces K   write every grid as K .vtu pieces and .pvtu index\n");
+    printf ("      --split sfc|part\n");
+    printf ("                   cut pieces along space filling curve (default) or\n");
+    printf ("                   keep parts whole\n");
+    printf ("  -a, --archive    write single basename.d2l container, which keeps topology\n");
+    printf ("                   once per change of deleted elements and only changing\n");
+    printf ("                   arrays for every state\n");
+    printf ("  -q, --quantize FIELD=BOUND[%%]\n");
+    printf ("                   store field as 8 or 16 bit codes with absolute error\n");
+    printf ("                   at most BOUND, or BOUND percent of its range\n");
+    printf ("      --keyframe N with --archive and --compress, store float arrays\n");
+    printf ("                   XORed with previous state, whole every N states\n");
+}
+
+
+static void listFields ()
+{
+    printf ("Available fields:\n");
+    for (int i = 0; i < fieldsCount; i++)
+        printf ("  %s\n", fieldInfo (i).name);
+}
+
+
+// index of container is written at the end, without it readers have
+// to walk all blocks
+static int finishOutput (D3PlotGeometry& geo, const char* outName)
+{
+    if (!geo.closeOutput ()) {
+        printf ("Cannot finish %s.d2l\n", outName);
+        return 1;
+    }
+    return 0;
+}
+
+
 int main (int argc, char** argv)
 {
     PartIDFilter filter;
+    FieldFilter fields;
+    QuantizeFilter quantize;
+    output_mode_t output = outputVTU;
+    bool pvdMode = false;
+    int codec = codecNone, level = 0;
+    unsigned int threads = 0;
+    unsigned int workers = 1, writers = 1, inFlight = 0;
+    unsigned int pieces = 1;
+    unsigned int keyframes = 0;
+    piece_split_t split = splitSpaceCurve;
 
 //     filter.appendValue (6);
 //     filter.appendValue (7);
 //     filter.appendValue (19);
     
-    StateOptions opts (false, false, &filter);
-
     static char fileName[1024];
     float time = 0.0;
     int index = 0;
+    bool useMmap = false;
+    bool useIndex = false;
+    bool useCache = false;
+    int selState = -1;
+    bool selTime = false;
+    float selTimeVal = 0.0;
+    unsigned int prefetchDepth = 0;
+    unsigned long long prefetchMem = 0;
+
+    static struct option long_opts[] = {
+        { "mmap",  no_argument,       0, 'm' },
+        { "index", no_argument,       0, 'i' },
+        { "state", required_argument, 0, 's' },
+        { "time",  required_argument, 0, 't' },
+        { "cache", no_argument,       0, 'c' },
+        { "prefetch", required_argument, 0, 'p' },
+        { "prefetch-mem", required_argument, 0, 'P' },
+        { "fields", required_argument, 0, 'f' },
+        { "vtk-writer", no_argument, 0, 'V' },
+        { "archive", no_argument, 0, 'a' },
+        { "compress", required_argument, 0, 'z' },
+        { "threads", required_argument, 0, 'j' },
+        { "workers", required_argument, 0, 'w' },
+        { "writers", required_argument, 0, 'W' },
+        { "in-flight", required_argument, 0, 'F' },
+        { "pvd", no_argument, 0, 'D' },
+        { "keyframe", required_argument, 0, 'K' },
+        { "quantize", required_argument, 0, 'q' },
+        { "pieces", required_argument, 0, 'k' },
+        { "split", required_argument, 0, 'S' },
+        { 0, 0, 0, 0 }
+    };
+    int c;
+
+    while ((c = getopt_long (argc, argv, "mis:t:cp:f:az:j:w:k:q:", long_opts, 0)) != -1)
+        switch (c) {
+        case 'm':
+            useMmap = true;
+            break;
+        case 'i':
+            useIndex = true;
+            break;
+        case 's':
+            selState = atoi (optarg);
+            useIndex = true;
+            break;
+        case 't':
+            selTimeVal = atof (optarg);
+            selTime = true;
+            useIndex = true;
+            break;
+        case 'c':
+            useCache = true;
+            break;
+        case 'p':
+            prefetchDepth = atoi (optarg);
+            break;
+        case 'P':
+            prefetchMem = atoll (optarg) * 1024 * 1024;
+            break;
+        case 'f':
+            fields.appendList (optarg);
+            break;
+        case 'V':
+            output = outputVTK;
+            break;
+        case 'a':
+            output = outputArchive;
+            break;
+        case 'z': {
+            char* p = strchr (optarg, ':');
 
-    if (argc < 3) {
-        printf ("Usage: lsdt-dump d3plot basename\n");
+            if (p) {
+                *p = 0;
+                level = atoi (p + 1);
+            }
+            codec = findCodec (optarg);
+            if (codec < 0 || !codecAvailable (codec)) {
+                printf ("Unknown or unsupported codec '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'j':
+            threads = atoi (optarg);
+            break;
+        case 'w':
+            workers = atoi (optarg);
+            break;
+        case 'W':
+            writers = atoi (optarg);
+            break;
+        case 'F':
+            inFlight = atoi (optarg);
+            break;
+        case 'D':
+            pvdMode = true;
+            break;
+        case 'K':
+            keyframes = atoi (optarg);
+            break;
+        case 'q':
+            if (!quantize.append (optarg)) {
+                printf ("Bad quantization '%s', FIELD=BOUND or FIELD=BOUND%% expected\n", optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            pieces = atoi (optarg);
+            break;
+        case 'S':
+            if (!strcmp (optarg, "sfc"))
+                split = splitSpaceCurve;
+            else if (!strcmp (optarg, "part"))
+                split = splitPartID;
+            else {
+                printf ("Unknown split '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage ();
+            return 0;
+        }
+
+    if (argc - optind < 2) {
+        usage ();
         return 0;
     }
 
-    D3PlotFile f (argv[1]);
+    for (size_t i = 0; i < fields.names ().size (); i++)
+        if (findField (fields.names ()[i].c_str ()) < 0) {
+            printf ("Unknown field '%s'\n", fields.names ()[i].c_str ());
+            listFields ();
+            return 1;
+        }
+
+    for (size_t i = 0; i < quantize.names ().size (); i++)
+        if (findField (quantize.names ()[i].c_str ()) < 0) {
+            printf ("Unknown field '%s'\n", quantize.names ()[i].c_str ());
+            listFields ();
+            return 1;
+        }
+
+    if (quantize.active () && output == outputVTK) {
+        printf ("--quantize is not supported by --vtk-writer\n");
+        return 1;
+    }
+
+    // VTK writer keeps its own compression, VTK readers do not know zstd
+    if (codec != codecNone && output == outputVTK) {
+        printf ("Compression is not supported by --vtk-writer\n");
+        return 1;
+    }
+    if (output != outputArchive && codec != codecNone && !codecVTKName (codec)) {
+        printf ("%s compression is supported only by --archive\n", codecName (codec));
+        return 1;
+    }
+
+    // pieces and their index are written by built-in writer only
+    if (pieces > 1 && output != outputVTU) {
+        printf ("--pieces is not supported by --vtk-writer and --archive\n");
+        return 1;
+    }
+
+    if (pvdMode && output == outputArchive) {
+        printf ("--pvd is not supported by --archive\n");
+        return 1;
+    }
+
+    // differences are useful only when compressed
+    if (keyframes && (output != outputArchive || codec == codecNone)) {
+        printf ("--keyframe needs --archive and --compress\n");
+        return 1;
+    }
+
+    StateOptions opts (false, pvdMode, &filter, &fields, output);
+
+    opts.setCompression (codec, level);
+    opts.setThreads (threads);
+    opts.setPieces (pieces, split);
+    opts.setKeyframes (keyframes);
+    opts.setQuantize (&quantize);
+
+    const char* inName  = argv[optind];
+    const char* outName = argv[optind + 1];
+
+    D3PlotFile f (inName, useMmap);
+
+    if (useMmap && !f.mapped ())
+        printf ("Warning: cannot map %s, falling back to plain reads\n", inName);
 
     // control information bout all these d3plots
     printf ("Read control information..."); fflush (stdout);
@@ -65,8 +322,11 @@ int main (int argc, char** argv)
     }
 
     printf ("Reading initial geometry... "); fflush (stdout);
-//    f.sayPos ();
-    D3PlotGeometry geo (&f, &ctl, &opts);
+    f.sayPos ();
+    static char cacheName[1024];
+
+    sprintf (cacheName, "%s.geo", inName);
+    D3PlotGeometry geo (&f, &ctl, &opts, useCache ? cacheName : 0);
     printf ("done\n");
     printf ("\n");
     printf ("==================================================\n");
@@ -99,18 +359,95 @@ int main (int argc, char** argv)
     if (ctl.road_movement ())
         printf ("Rigid road... skipped\n");
 
-    printf ("Writing VTK file (%s)... ", argv[2]); fflush (stdout);
-    if (geo.save (argv[2]))
+    printf ("Writing VTK file (%s)... ", outName); fflush (stdout);
+    if (geo.save (outName))
         printf ("done\n");
     else
         printf ("faield\n");
 
+    // states index lets us jump to any state without decoding
+    // the preceding ones
+    D3PlotIndex idx;
+    int last = -1;
+
+    if (useIndex) {
+        sprintf (fileName, "%s.idx", inName);
+
+        if (!idx.load (fileName, &f, &ctl)) {
+            printf ("Scanning states... "); fflush (stdout);
+            f.pushPos ();
+            idx.scan (&f, &ctl);
+            f.popPos ();
+            if (!idx.save (fileName))
+                printf ("(cannot write %s) ", fileName);
+            printf ("done\n");
+        }
+        printf ("States indexed   : %u\n", idx.size ());
+
+        if (selTime)
+            selState = idx.findTime (selTimeVal);
+
+        if (selState >= 0) {
+            index = last = selState;
+            if (selState >= (int)idx.size ()) {
+                printf ("No such state\n");
+                return 1;
+            }
+        }
+    }
+
+    // single state goes into the series of earlier conversions
+    opts.setExtendSeries (selState >= 0);
+
+    // pipeline takes states from prefetcher, every worker holds one
+    bool pipeline = workers > 1 || writers > 1;
+
+    if (pipeline && prefetchDepth < workers)
+        prefetchDepth = workers;
+
+    // background reading of the following states
+    D3PlotPrefetcher* prefetch = 0;
+
+    if (prefetchDepth) {
+        std::vector<byte_range_t> ranges;
+
+        D3PlotState::neededRanges (&ctl, &geo, ranges);
+        prefetch = new D3PlotPrefetcher (&f, &ctl, prefetchDepth, prefetchMem,
+                                         useIndex ? &idx : 0, index, last, &ranges);
+        printf ("Prefetch depth   : %u\n", prefetch->depth ());
+    }
+
     printf ("State data...\n");
 
+    if (pipeline) {
+        if (!inFlight)
+            inFlight = workers + writers;
+
+        D3PlotPipeline conv (&opts, &ctl, &geo, prefetch, outName, workers, writers, inFlight);
+
+        printf ("Workers          : %u decoding, %u writing, %u states in flight\n",
+                workers, writers, inFlight);
+        printf ("States written   : %u\n", conv.run ());
+        delete prefetch;
+        return finishOutput (geo, outName);
+    }
+
     try {
         while (1) {
+            const state_buffer_t* buf = 0;
+
+            if (prefetch) {
+                if (!(buf = prefetch->next ()))
+                    throw 0;
+            }
+            else if (useIndex) {
+                if ((last >= 0 && index > last) || index >= (int)idx.size ())
+                    throw 0;
+                f.seek (idx.state (index).pos);
+            }
+
             geo.resetState ();
-            D3PlotState state (&opts, &ctl, &geo, &f);
+            D3PlotState state (&opts, &ctl, &geo, &f, buf);
 
             printf ("t = %.6f... ", state.time ()); fflush (stdout);
             state.read ();
@@ -118,7 +455,7 @@ int main (int argc, char** argv)
 
             // prepare output file name
             printf ("Writing VTK file (%d)...", index); fflush (stdout);
-            state.save (argv[2], index);
+            state.save (outName, index);
             printf ("done\n");
             index++;
         }
@@ -131,6 +468,8 @@ int main (int argc, char** argv)
         }
     }
 
-    return 0;
+    delete prefetch;
+
+    return finishOutput (geo, outName);
 }
 
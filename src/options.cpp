@@ -1,5 +1,8 @@
 #include "options.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 
 // --------------------------------------------------
 // PartIDFilter
@@ -48,3 +51,78 @@ bool PartIDFilter::check (unsigned int val)
     return _data[val];
 }
 
+
+
+
+// --------------------------------------------------
+// FieldFilter
+// --------------------------------------------------
+FieldFilter::FieldFilter ()
+{
+}
+
+
+FieldFilter::FieldFilter (const char* text)
+{
+    appendList (text);
+}
+
+
+void FieldFilter::appendList (const char* text)
+{
+    std::string name;
+
+    for (const char* p = text; ; p++) {
+        if (*p && *p != ',') {
+            // leading spaces are dropped
+            if (!name.empty () || *p != ' ')
+                name += *p;
+            continue;
+        }
+
+        // and trailing ones too
+        while (!name.empty () && name[name.size () - 1] == ' ')
+            name.erase (name.size () - 1);
+
+        if (!name.empty ())
+            _names.push_back (name);
+        name.clear ();
+
+        if (!*p)
+            break;
+    }
+}
+
+
+
+
+// --------------------------------------------------
+// QuantizeFilter
+// --------------------------------------------------
+QuantizeFilter::QuantizeFilter ()
+{
+}
+
+
+bool QuantizeFilter::append (const char* text)
+{
+    const char* eq = strrchr (text, '=');
+    char* end;
+
+    if (!eq || eq == text)
+        return false;
+
+    double bound = strtod (eq + 1, &end);
+    bool relative = *end == '%';
+
+    if (relative)
+        end++;
+    if (end == eq + 1 || *end || !(bound > 0))
+        return false;
+
+    _names.push_back (std::string (text, eq - text));
+    _bounds.push_back (relative ? bound / 100 : bound);
+    _relative.push_back (relative);
+
+    return true;
+}
@@ -2,6 +2,7 @@
 #define __OPTIONS_H__
 
 #include <set>
+#include <string>
 #include <vector>
 
 
@@ -22,18 +23,103 @@ public:
 };
 
 
+// names of fields user wants in output, empty means all of them
+class FieldFilter
+{
+private:
+    std::vector<std::string> _names;
+
+public:
+    FieldFilter ();
+    FieldFilter (const char* text);
+
+    // appends comma separated list of names
+    void appendList (const char* text);
+
+    bool active () const
+        { return !_names.empty (); };
+
+    const std::vector<std::string>& names () const
+        { return _names; };
+};
+
+
+// error bounds of fields which may be stored lossy, see quantize.h
+class QuantizeFilter
+{
+private:
+    std::vector<std::string> _names;
+    std::vector<double> _bounds;
+    std::vector<bool> _relative;
+
+public:
+    QuantizeFilter ();
+
+    // appends "name=bound" with absolute bound or "name=bound%" with
+    // percents of range of values, false if text is malformed
+    bool append (const char* text);
+
+    bool active () const
+        { return !_names.empty (); };
+
+    const std::vector<std::string>& names () const
+        { return _names; };
+
+    // relative bound is a fraction of range of values
+    double bound (size_t i) const
+        { return _bounds[i]; };
+    bool relative (size_t i) const
+        { return _relative[i]; };
+};
+
+
+// how converted grids are written
+typedef enum {
+    outputVTU,          // .vtu files by built-in writer
+    outputVTK,          // .vtu files through VTK objects
+    outputArchive,      // topology once and per-state arrays in <base>.d2l
+} output_mode_t;
+
+
+/* how cells of partitioned grid are assigned to pieces */
+typedef enum {
+    splitSpaceCurve,    // runs of equal size along Morton curve of cell centers
+    splitPartID,        // whole parts, balanced by amount of cells
+} piece_split_t;
+
+
 class StateOptions
 {
 private:
     bool _keepDeleted;
     bool _pvd_mode;
+    bool _extend_series;
     PartIDFilter* _pid_filter;
-    
+    FieldFilter* _field_filter;
+    output_mode_t _output;
+    int _codec, _level;
+    unsigned int _threads;
+    unsigned int _pieces;
+    piece_split_t _split;
+    unsigned int _keyframes;
+    const QuantizeFilter* _quantize;
+
 public:
-    StateOptions (bool keepDeleted, bool pvd_mode, PartIDFilter* pid_filter = 0)
+    StateOptions (bool keepDeleted, bool pvd_mode, PartIDFilter* pid_filter = 0,
+                  FieldFilter* field_filter = 0, output_mode_t output = outputVTU)
         : _keepDeleted (keepDeleted),
           _pvd_mode (pvd_mode),
-          _pid_filter (pid_filter)
+          _extend_series (false),
+          _pid_filter (pid_filter),
+          _field_filter (field_filter),
+          _output (output),
+          _codec (0),
+          _level (0),
+          _threads (0),
+          _pieces (1),
+          _split (splitSpaceCurve),
+          _keyframes (0),
+          _quantize (0)
         { };
 
     bool keepDeleted () const
@@ -42,8 +128,62 @@ public:
     bool pvdMode () const
         { return _pvd_mode; };
 
+    // pvd mode adds states to the existing time series (conversion of
+    // a range of states) instead of starting a new one
+    void setExtendSeries (bool extend)
+        { _extend_series = extend; };
+
+    bool extendSeries () const
+        { return _extend_series; };
+
+    output_mode_t outputMode () const
+        { return _output; };
+
+    // codec_t of output data and its level, 0 picks codec default
+    void setCompression (int codec, int level)
+        { _codec = codec; _level = level; };
+
+    int codec () const
+        { return _codec; };
+    int level () const
+        { return _level; };
+
+    // worker threads of output, 0 means one per hardware thread
+    void setThreads (unsigned int threads)
+        { _threads = threads; };
+
+    unsigned int threads () const
+        { return _threads; };
+
+    // grids are written as .pvtu of pieces .vtu files if more than one
+    void setPieces (unsigned int pieces, piece_split_t split)
+        { _pieces = pieces ? pieces : 1; _split = split; };
+
+    unsigned int pieces () const
+        { return _pieces; };
+    piece_split_t pieceSplit () const
+        { return _split; };
+
+    // archive stores states as difference to the previous one, whole
+    // every interval states, 0 stores every state whole
+    void setKeyframes (unsigned int interval)
+        { _keyframes = interval; };
+
+    unsigned int keyframes () const
+        { return _keyframes; };
+
+    // fields stored as codes with bounded error, 0 keeps them exact
+    void setQuantize (const QuantizeFilter* quantize)
+        { _quantize = quantize; };
+
+    const QuantizeFilter* quantizeFilter () const
+        { return _quantize; };
+
     bool partIDCheck (unsigned int partID)
         { return _pid_filter ? _pid_filter->check (partID) : true; };
+
+    const FieldFilter* fieldFilter () const
+        { return _field_filter; };
 };
 
 
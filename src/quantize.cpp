@@ -0,0 +1,69 @@
+#include "quantize.h"
+
+#include <float.h>
+#include <math.h>
+
+
+template <typename T>
+static bool encode (const float* values, size_t count, double bound, const quantization_t& q, T* dst)
+{
+    for (size_t i = 0; i < count; i++) {
+        double code = q.scale ? floor ((values[i] - q.offset) / q.scale + 0.5) : 0;
+        uint32_t max = (uint32_t)(T)~0u;
+
+        dst[i] = code < 0 ? 0 : code > max ? max : (T)code;
+
+        // decoded value is rounded to float, which must not spoil bound
+        if (fabs ((double)dequantize (q, dst[i]) - values[i]) > bound)
+            return false;
+    }
+
+    return true;
+}
+
+
+bool quantizeValues (const float* values, size_t count, double bound, bool relative,
+                     quantization_t& q, void* dst)
+{
+    double lo = 0, hi = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (!isfinite (values[i]))
+            return false;
+        if (!i || values[i] < lo)
+            lo = values[i];
+        if (!i || values[i] > hi)
+            hi = values[i];
+    }
+
+    if (relative)
+        bound *= hi - lo;
+
+    // codes are centers of steps of twice the bound, less the rounding of
+    // decoded values to float
+    double slack = fmax (fabs (lo), fabs (hi)) * FLT_EPSILON;
+    double steps = bound > slack ? ceil ((hi - lo) / (2 * (bound - slack))) : hi > lo ? HUGE_VAL : 0;
+
+    q.offset = lo;
+    q.bits = steps < 256 ? 8 : 16;
+    if (steps >= 65536)
+        return false;
+    q.scale = steps ? (hi - lo) / steps : 0;
+
+    return q.bits == 8 ? encode (values, count, bound, q, (uint8_t*)dst) :
+                         encode (values, count, bound, q, (uint16_t*)dst);
+}
+
+
+void dequantizeValues (const quantization_t& q, const void* codes, size_t count, float* dst)
+{
+    size_t i;
+
+    if (q.bits == 8)
+        for (i = 0; i < count; i++)
+            dst[i] = dequantize (q, ((const uint8_t*)codes)[i]);
+    else
+        for (i = 0; i < count; i++)
+            dst[i] = dequantize (q, ((const uint16_t*)codes)[i]);
+}
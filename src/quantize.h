@@ -0,0 +1,34 @@
+//
+// Error bounded quantization of float arrays. Values are stored as 8 or
+// 16 bit codes, value is offset + code * scale, which differs from the
+// original one by at most the bound given on quantization.
+//
+#ifndef __QUANTIZE_H__
+#define __QUANTIZE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+typedef struct {
+    unsigned int bits;      // of code, 8 or 16
+    double scale, offset;
+} quantization_t;
+
+
+// Finds codes of count values with error at most bound, relative bound
+// is a fraction of range of the values. Codes are written to dst (bytes
+// or 16 bit words, count * q.bits / 8 bytes). False if some value is not
+// finite or bound cannot be met by 16 bits, dst is undefined then.
+bool quantizeValues (const float* values, size_t count, double bound, bool relative,
+                     quantization_t& q, void* dst);
+
+static inline float dequantize (const quantization_t& q, uint32_t code)
+{
+    return (float)(q.offset + code * q.scale);
+}
+
+void dequantizeValues (const quantization_t& q, const void* codes, size_t count, float* dst);
+
+
+#endif
@@ -0,0 +1,112 @@
+#include "threadpool.h"
+
+#include <algorithm>
+
+
+// --------------------------------------------------
+// ThreadPool
+// --------------------------------------------------
+ThreadPool::ThreadPool (unsigned int threads)
+    : _stop (false)
+{
+    if (!threads)
+        threads = std::thread::hardware_concurrency ();
+    if (!threads)
+        threads = 1;
+
+    for (unsigned int i = 0; i < threads; i++)
+        _threads.push_back (std::thread (&ThreadPool::work, this));
+}
+
+
+ThreadPool::~ThreadPool ()
+{
+    {
+        std::unique_lock<std::mutex> lock (_lock);
+        _stop = true;
+    }
+    _cond.notify_all ();
+
+    for (size_t i = 0; i < _threads.size (); i++)
+        _threads[i].join ();
+}
+
+
+bool ThreadPool::take (batch_t* b, size_t* index)
+{
+    if (b->next >= b->count)
+        return false;
+
+    *index = b->next++;
+
+    // all tasks are handed out, nobody has to look at batch anymore
+    if (b->next == b->count)
+        _batches.erase (std::find (_batches.begin (), _batches.end (), b));
+
+    return true;
+}
+
+
+void ThreadPool::work ()
+{
+    std::unique_lock<std::mutex> lock (_lock);
+
+    while (1) {
+        while (!_stop && _batches.empty ())
+            _cond.wait (lock);
+        if (_stop)
+            return;
+
+        batch_t* b = _batches.front ();
+        size_t i;
+
+        take (b, &i);
+
+        lock.unlock ();
+        (*b->task) (i);
+        lock.lock ();
+
+        if (++b->done == b->count)
+            _cond.notify_all ();
+    }
+}
+
+
+void ThreadPool::run (size_t count, const std::function<void (size_t)>& task)
+{
+    if (!count)
+        return;
+
+    batch_t b = { &task, count, 0, 0 };
+    std::unique_lock<std::mutex> lock (_lock);
+
+    _batches.push_back (&b);
+    _cond.notify_all ();
+
+    size_t i;
+
+    while (take (&b, &i)) {
+        lock.unlock ();
+        task (i);
+        lock.lock ();
+        b.done++;
+    }
+
+    while (b.done < b.count)
+        _cond.wait (lock);
+}
+
+
+void runConcurrently (unsigned int count, const std::function<void (unsigned int)>& task)
+{
+    std::vector<std::thread> threads;
+
+    for (unsigned int i = 1; i < count; i++)
+        threads.push_back (std::thread (task, i));
+
+    if (count)
+        task (0);
+
+    for (unsigned int i = 0; i < threads.size (); i++)
+        threads[i].join ();
+}
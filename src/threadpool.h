@@ -0,0 +1,61 @@
+//
+// Fixed set of worker threads running indexed tasks. Several threads
+// may submit work at once, every caller also runs tasks of its own
+// batch, so a pool of N threads is busy with N+1 tasks at most.
+//
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+class ThreadPool
+{
+private:
+    typedef struct {
+        const std::function<void (size_t)>* task;
+        size_t count;
+        size_t next;        // first task not taken yet
+        size_t done;
+    } batch_t;
+
+    std::vector<std::thread> _threads;
+    std::deque<batch_t*> _batches;
+    bool _stop;
+
+    std::mutex _lock;
+    std::condition_variable _cond;
+
+protected:
+    void work ();
+
+    // takes next task of batch, lock must be held
+    bool take (batch_t* b, size_t* index);
+
+public:
+    // threads = 0 means one per hardware thread
+    ThreadPool (unsigned int threads = 0);
+    ~ThreadPool ();
+
+    unsigned int size () const
+        { return _threads.size (); };
+
+    // runs task (0), ..., task (count - 1) and returns when all of
+    // them are finished
+    void run (size_t count, const std::function<void (size_t)>& task);
+};
+
+
+// Runs task (0), ..., task (count - 1) at once, the first one on the
+// calling thread. Used for grids, which are few and independent.
+void runConcurrently (unsigned int count, const std::function<void (unsigned int)>& task);
+
+
+#endif
@@ -0,0 +1,517 @@
+#include "vtuwriter.h"
+#include "threadpool.h"
+
+#include <stdint.h>
+#include <string.h>
+
+
+// --------------------------------------------------
+// VTUWriter
+// --------------------------------------------------
+static const char* type_names[] = { "UInt8", "Int32", "UInt32", "Float32" };
+
+// arrays are gathered through buffer of this size
+#define CHUNK_SIZE (256*1024)
+
+// uncompressed size of compressed blocks
+#define BLOCK_SIZE (256*1024)
+
+
+VTUWriter::VTUWriter ()
+    : _points (0),
+      _cells (0),
+      _hasCells (false),
+      _codec (codecNone),
+      _level (0),
+      _pool (0)
+{
+}
+
+
+size_t VTUWriter::typeSize (value_type_t type)
+{
+    return type == typeUInt8 ? 1 : 4;
+}
+
+
+unsigned long long VTUWriter::arrayBytes (const array_t& a)
+{
+    return (unsigned long long)a.tuples * a.components * typeSize (a.type);
+}
+
+
+VTUWriter::array_t VTUWriter::makeArray (const char* name, value_type_t type, unsigned int components,
+                                         size_t tuples, const void* data, const unsigned int* index)
+{
+    array_t res;
+
+    res.name = name;
+    res.type = type;
+    res.components = components;
+    res.tuples = tuples;
+    res.data = (const char*)data;
+    res.index = index;
+    res.offset = 0;
+    res.quant.bits = 0;
+    res.quant.scale = res.quant.offset = 0;
+
+    return res;
+}
+
+
+void VTUWriter::setPoints (const float* coords, size_t count, const unsigned int* index)
+{
+    _points = count;
+    _coords = makeArray ("Points", typeFloat32, 3, count, coords, index);
+}
+
+
+void VTUWriter::setCells (size_t count, const unsigned int* conn, const unsigned int* offsets,
+                          const unsigned char* types)
+{
+    // connectivity IDs are below 2^31, so they are written as Int32
+    // which every VTK reader takes
+    _cells = count;
+    _conn = makeArray ("connectivity", typeInt32, 1, count ? offsets[count - 1] : 0, conn, 0);
+    _offsets = makeArray ("offsets", typeInt32, 1, count, offsets, 0);
+    _types = makeArray ("types", typeUInt8, 1, count, types, 0);
+    _hasCells = true;
+}
+
+
+void VTUWriter::addPointArray (const char* name, value_type_t type, unsigned int components,
+                               const void* data, const unsigned int* index)
+{
+    _pointData.push_back (makeArray (name, type, components, _points, data, index));
+}
+
+
+void VTUWriter::addCellArray (const char* name, value_type_t type, unsigned int components,
+                              const void* data, const unsigned int* index)
+{
+    _cellData.push_back (makeArray (name, type, components, _cells, data, index));
+}
+
+
+bool VTUWriter::quantizeArray (const char* name, double bound, bool relative)
+{
+    array_t* a = 0;
+    size_t i;
+
+    for (i = 0; i < _pointData.size (); i++)
+        if (_pointData[i].name == name)
+            a = &_pointData[i];
+    for (i = 0; i < _cellData.size (); i++)
+        if (_cellData[i].name == name)
+            a = &_cellData[i];
+
+    if (!a || a->type != typeFloat32 || a->quant.bits)
+        return false;
+
+    size_t count = a->tuples * a->components;
+    std::vector<float> values (count);
+    std::vector<uint16_t> codes (count);
+    quantization_t q;
+
+    if (count)
+        gather (*a, 0, count * sizeof (float), (char*)&values[0]);
+
+    if (!quantizeValues (count ? &values[0] : 0, count, bound, relative, q, count ? &codes[0] : 0))
+        return false;
+
+    size_t bytes = count * q.bits / 8;
+    char* data = allocate<char> (bytes);
+
+    if (bytes)
+        memcpy (data, &codes[0], bytes);
+    a->data = data;
+    a->index = 0;
+    a->quant = q;
+
+    return true;
+}
+
+
+void* VTUWriter::allocate (size_t bytes)
+{
+    _buffers.push_back (std::vector<char> (bytes ? bytes : 1));
+    return &_buffers.back ()[0];
+}
+
+
+void VTUWriter::writeHeader (FILE* f, const array_t& a)
+{
+    fprintf (f, "        <DataArray type=\"%s\" Name=\"%s\"", type_names[a.type], a.name.c_str ());
+    if (a.components > 1)
+        fprintf (f, " NumberOfComponents=\"%u\"", a.components);
+    fprintf (f, " format=\"appended\" offset=\"%llu\"/>\n", a.offset);
+}
+
+
+void VTUWriter::writePHeader (FILE* f, const array_t& a)
+{
+    fprintf (f, "      <PDataArray type=\"%s\" Name=\"%s\"", type_names[a.type], a.name.c_str ());
+    if (a.components > 1)
+        fprintf (f, " NumberOfComponents=\"%u\"", a.components);
+    fprintf (f, "/>\n");
+}
+
+
+bool VTUWriter::writeData (FILE* f, const array_t& a, bool wide)
+{
+    unsigned long long bytes = arrayBytes (a);
+
+    // block size header
+    if (wide) {
+        uint64_t size = bytes;
+
+        if (fwrite (&size, sizeof (size), 1, f) != 1)
+            return false;
+    }
+    else {
+        uint32_t size = bytes;
+
+        if (fwrite (&size, sizeof (size), 1, f) != 1)
+            return false;
+    }
+
+    return writeValues (f, a);
+}
+
+
+bool VTUWriter::writeValues (FILE* f, const array_t& a)
+{
+    unsigned long long bytes = arrayBytes (a);
+
+    if (!bytes)
+        return true;
+
+    if (!a.index && !a.quant.bits)
+        return fwrite (a.data, 1, bytes, f) == bytes;
+
+    // quantized values are expanded by chunks
+    if (a.quant.bits) {
+        std::vector<char> chunk (CHUNK_SIZE);
+
+        for (unsigned long long from = 0; from < bytes; from += CHUNK_SIZE) {
+            size_t n = bytes - from < CHUNK_SIZE ? bytes - from : CHUNK_SIZE;
+
+            gather (a, from, n, &chunk[0]);
+            if (fwrite (&chunk[0], 1, n, f) != n)
+                return false;
+        }
+
+        return true;
+    }
+
+    // picked tuples are collected into chunks
+    size_t tupleSize = a.components * typeSize (a.type);
+    size_t perChunk = CHUNK_SIZE / tupleSize + 1;
+    std::vector<char> chunk (perChunk * tupleSize);
+
+    for (size_t i = 0; i < a.tuples; i += perChunk) {
+        size_t n = a.tuples - i < perChunk ? a.tuples - i : perChunk;
+        char* dst = &chunk[0];
+
+        for (size_t j = 0; j < n; j++, dst += tupleSize)
+            memcpy (dst, a.data + (size_t)a.index[i + j] * tupleSize, tupleSize);
+
+        if (fwrite (&chunk[0], tupleSize, n, f) != n)
+            return false;
+    }
+
+    return true;
+}
+
+
+void VTUWriter::gather (const array_t& a, unsigned long long from, size_t size, char* dst)
+{
+    // codes are always in tuples order, range may cut a value
+    if (a.quant.bits) {
+        if (!size)
+            return;
+
+        size_t first = from / sizeof (float);
+        size_t count = (from + size + sizeof (float) - 1) / sizeof (float) - first;
+        std::vector<float> values (count);
+
+        dequantizeValues (a.quant, a.data + first * a.quant.bits / 8, count, &values[0]);
+        memcpy (dst, (const char*)&values[0] + from % sizeof (float), size);
+        return;
+    }
+
+    if (!a.index) {
+        memcpy (dst, a.data + from, size);
+        return;
+    }
+
+    // range may start and end in the middle of tuple
+    size_t tupleSize = a.components * typeSize (a.type);
+    size_t tuple = from / tupleSize;
+    size_t skip = from % tupleSize;
+
+    while (size) {
+        size_t n = tupleSize - skip < size ? tupleSize - skip : size;
+
+        memcpy (dst, a.data + (size_t)a.index[tuple] * tupleSize + skip, n);
+        dst += n;
+        size -= n;
+        tuple++;
+        skip = 0;
+    }
+}
+
+
+bool VTUWriter::packArrays (const std::vector<const array_t*>& arrays, int codec, int level,
+                            ThreadPool* pool, std::vector<packed_t>& packed,
+                            const std::vector<unsigned int>* shuffle)
+{
+    // (array, block) pairs of all arrays form one batch of tasks
+    std::vector<std::pair<size_t, size_t> > tasks;
+    size_t i;
+
+    packed.clear ();
+    packed.resize (arrays.size ());
+
+    for (i = 0; i < arrays.size (); i++) {
+        unsigned long long bytes = arrayBytes (*arrays[i]);
+        size_t blocks = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        packed_t& p = packed[i];
+
+        p.header.resize (3 + blocks);
+        p.header[0] = blocks;
+        p.header[1] = BLOCK_SIZE;
+        p.header[2] = bytes % BLOCK_SIZE;
+        p.blocks.resize (blocks);
+
+        for (size_t j = 0; j < blocks; j++)
+            tasks.push_back (std::make_pair (i, j));
+    }
+
+    std::function<void (size_t)> pack = [&] (size_t t) {
+        const array_t& a = *arrays[tasks[t].first];
+        packed_t& p = packed[tasks[t].first];
+        size_t block = tasks[t].second;
+        unsigned long long from = (unsigned long long)block * BLOCK_SIZE;
+        size_t size = arrayBytes (a) - from < BLOCK_SIZE ? arrayBytes (a) - from : BLOCK_SIZE;
+        unsigned int width = shuffle ? (*shuffle)[tasks[t].first] : 0;
+        std::vector<char> raw, planes;
+        const char* src;
+
+        if (a.index || a.quant.bits) {
+            raw.resize (size);
+            gather (a, from, size, &raw[0]);
+            src = &raw[0];
+        }
+        else
+            src = a.data + from;
+
+        if (width) {
+            planes.resize (size);
+            shuffleBytes (src, size, width, &planes[0]);
+            src = &planes[0];
+        }
+
+        std::vector<char>& dst = p.blocks[block];
+
+        dst.resize (compressBound (codec, size));
+        dst.resize (compressBlock (codec, level, src, size, &dst[0], dst.size ()));
+        p.header[3 + block] = dst.size ();
+    };
+
+    if (pool)
+        pool->run (tasks.size (), pack);
+    else
+        for (i = 0; i < tasks.size (); i++)
+            pack (i);
+
+    // codecs never produce empty block from data
+    for (i = 0; i < tasks.size (); i++)
+        if (packed[tasks[i].first].blocks[tasks[i].second].empty ())
+            return false;
+    return true;
+}
+
+
+unsigned long long VTUWriter::packedBytes (const packed_t& p, bool wide)
+{
+    unsigned long long res = p.header.size () * (wide ? 8 : 4);
+
+    for (size_t i = 0; i < p.blocks.size (); i++)
+        res += p.blocks[i].size ();
+    return res;
+}
+
+
+bool VTUWriter::writePacked (FILE* f, const packed_t& p, bool wide)
+{
+    size_t i;
+
+    if (wide) {
+        std::vector<uint64_t> header (p.header.begin (), p.header.end ());
+
+        if (fwrite (&header[0], sizeof (uint64_t), header.size (), f) != header.size ())
+            return false;
+    }
+    else {
+        std::vector<uint32_t> header (p.header.begin (), p.header.end ());
+
+        if (fwrite (&header[0], sizeof (uint32_t), header.size (), f) != header.size ())
+            return false;
+    }
+
+    for (i = 0; i < p.blocks.size (); i++)
+        if (!p.blocks[i].empty () && fwrite (&p.blocks[i][0], 1, p.blocks[i].size (), f) != p.blocks[i].size ())
+            return false;
+
+    return true;
+}
+
+
+void VTUWriter::setCompression (int codec, int level, ThreadPool* pool)
+{
+    _codec = codec;
+    _level = level;
+    _pool = pool;
+}
+
+
+bool VTUWriter::write (const char* fileName)
+{
+    // all arrays in the order they are stored in appended data
+    std::vector<array_t*> arrays;
+    size_t i;
+
+    for (i = 0; i < _pointData.size (); i++)
+        arrays.push_back (&_pointData[i]);
+    for (i = 0; i < _cellData.size (); i++)
+        arrays.push_back (&_cellData[i]);
+    arrays.push_back (&_coords);
+    if (_hasCells) {
+        arrays.push_back (&_conn);
+        arrays.push_back (&_offsets);
+        arrays.push_back (&_types);
+    }
+
+    // compressed arrays are kept in memory until written, their
+    // offsets are known only after compression
+    std::vector<packed_t> packed;
+
+    if (_codec != codecNone &&
+        !packArrays (std::vector<const array_t*> (arrays.begin (), arrays.end ()),
+                     _codec, _level, _pool, packed))
+        return false;
+
+    // 32 bit block headers, unless some array does not fit them,
+    // compressed blocks always do
+    bool wide = false;
+
+    for (i = 0; packed.empty () && i < arrays.size (); i++)
+        wide = wide || arrayBytes (*arrays[i]) > 0xFFFFFFFFull;
+
+    unsigned long long offset = 0;
+
+    for (i = 0; i < arrays.size (); i++) {
+        arrays[i]->offset = offset;
+        if (packed.empty ())
+            offset += (wide ? 8 : 4) + arrayBytes (*arrays[i]);
+        else
+            offset += packedBytes (packed[i], wide);
+    }
+
+    FILE* f = fopen (fileName, "wb");
+
+    if (!f)
+        return false;
+
+    setvbuf (f, 0, _IOFBF, 1024*1024);
+
+    const uint16_t one = 1;
+    const char* order = *(const char*)&one ? "LittleEndian" : "BigEndian";
+
+    fprintf (f, "<?xml version=\"1.0\"?>\n");
+    if (wide)
+        fprintf (f, "<VTKFile type=\"UnstructuredGrid\" version=\"1.0\" byte_order=\"%s\" header_type=\"UInt64\"", order);
+    else
+        fprintf (f, "<VTKFile type=\"UnstructuredGrid\" version=\"0.1\" byte_order=\"%s\"", order);
+    if (!packed.empty ())
+        fprintf (f, " compressor=\"%s\"", codecVTKName (_codec));
+    fprintf (f, ">\n");
+    fprintf (f, "  <UnstructuredGrid>\n");
+    fprintf (f, "    <Piece NumberOfPoints=\"%zu\" NumberOfCells=\"%zu\">\n", _points, _cells);
+
+    fprintf (f, "      <PointData>\n");
+    for (i = 0; i < _pointData.size (); i++)
+        writeHeader (f, _pointData[i]);
+    fprintf (f, "      </PointData>\n");
+
+    fprintf (f, "      <CellData>\n");
+    for (i = 0; i < _cellData.size (); i++)
+        writeHeader (f, _cellData[i]);
+    fprintf (f, "      </CellData>\n");
+
+    fprintf (f, "      <Points>\n");
+    writeHeader (f, _coords);
+    fprintf (f, "      </Points>\n");
+
+    fprintf (f, "      <Cells>\n");
+    if (_hasCells) {
+        writeHeader (f, _conn);
+        writeHeader (f, _offsets);
+        writeHeader (f, _types);
+    }
+    fprintf (f, "      </Cells>\n");
+
+    fprintf (f, "    </Piece>\n");
+    fprintf (f, "  </UnstructuredGrid>\n");
+    fprintf (f, "  <AppendedData encoding=\"raw\">\n   _");
+
+    bool ok = true;
+
+    for (i = 0; ok && i < arrays.size (); i++)
+        ok = packed.empty () ? writeData (f, *arrays[i], wide) : writePacked (f, packed[i], wide);
+
+    fprintf (f, "\n  </AppendedData>\n");
+    fprintf (f, "</VTKFile>\n");
+
+    return (fclose (f) == 0) && ok;
+}
+
+
+bool VTUWriter::writePVTU (const char* fileName, const std::vector<std::string>& sources) const
+{
+    FILE* f = fopen (fileName, "w");
+
+    if (!f)
+        return false;
+
+    const uint16_t one = 1;
+    const char* order = *(const char*)&one ? "LittleEndian" : "BigEndian";
+    size_t i;
+
+    fprintf (f, "<?xml version=\"1.0\"?>\n");
+    fprintf (f, "<VTKFile type=\"PUnstructuredGrid\" version=\"0.1\" byte_order=\"%s\">\n", order);
+    fprintf (f, "  <PUnstructuredGrid GhostLevel=\"0\">\n");
+
+    fprintf (f, "    <PPointData>\n");
+    for (i = 0; i < _pointData.size (); i++)
+        writePHeader (f, _pointData[i]);
+    fprintf (f, "    </PPointData>\n");
+
+    fprintf (f, "    <PCellData>\n");
+    for (i = 0; i < _cellData.size (); i++)
+        writePHeader (f, _cellData[i]);
+    fprintf (f, "    </PCellData>\n");
+
+    fprintf (f, "    <PPoints>\n");
+    writePHeader (f, _coords);
+    fprintf (f, "    </PPoints>\n");
+
+    for (i = 0; i < sources.size (); i++)
+        fprintf (f, "    <Piece Source=\"%s\"/>\n", sources[i].c_str ());
+
+    fprintf (f, "  </PUnstructuredGrid>\n");
+    fprintf (f, "</VTKFile>\n");
+
+    return fclose (f) == 0;
+}
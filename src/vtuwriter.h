@@ -0,0 +1,153 @@
+//
+// Streaming writer of VTK XML unstructured grid files (.vtu) with raw
+// appended data. Arrays are not copied into any intermediate object,
+// they are gathered from caller buffers while the file is written.
+//
+#ifndef __VTUWRITER_H__
+#define __VTUWRITER_H__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "compress.h"
+#include "quantize.h"
+
+class ThreadPool;
+
+
+class VTUWriter
+{
+public:
+    typedef enum {
+        typeUInt8,
+        typeInt32,
+        typeUInt32,
+        typeFloat32,
+    } value_type_t;
+
+    typedef struct {
+        std::string name;
+        value_type_t type;
+        unsigned int components;
+        size_t tuples;
+        const char* data;           // tuples, or records picked by index
+        const unsigned int* index;  // tuple i is data[index[i]], may be 0
+        unsigned long long offset;  // in appended data
+        quantization_t quant;       // bits are 0 unless data holds codes of floats
+    } array_t;
+
+    // Compressed array in VTK layout: header holds number of blocks,
+    // uncompressed block size, size of partial last block (0 if it is
+    // full) and compressed size of every block.
+    typedef struct {
+        std::vector<unsigned long long> header;
+        std::vector<std::vector<char> > blocks;
+    } packed_t;
+
+private:
+    size_t _points, _cells;
+    std::vector<array_t> _pointData, _cellData;
+    array_t _coords, _conn, _offsets, _types;
+    bool _hasCells;
+
+    int _codec, _level;
+    ThreadPool* _pool;
+
+    // arrays computed by caller, live as long as the writer
+    std::deque<std::vector<char> > _buffers;
+
+    array_t makeArray (const char* name, value_type_t type, unsigned int components,
+                       size_t tuples, const void* data, const unsigned int* index);
+    void writeHeader (FILE* f, const array_t& a);
+    static void writePHeader (FILE* f, const array_t& a);
+    bool writeData (FILE* f, const array_t& a, bool wide);
+
+public:
+    VTUWriter ();
+
+    static size_t typeSize (value_type_t type);
+    static unsigned long long arrayBytes (const array_t& a);
+
+    // writes values of array (without any header), gathering picked
+    // tuples if array has index
+    static bool writeValues (FILE* f, const array_t& a);
+
+    // copies size bytes of array values starting at byte from, codes of
+    // quantized array are expanded
+    static void gather (const array_t& a, unsigned long long from, size_t size, char* dst);
+
+    // Compresses arrays by blocks, which are spread over pool threads
+    // if pool is given. Block header values are 64 bit, writePacked
+    // narrows them if wide is false. False if some block failed. With
+    // shuffle, bytes of every block of array i are split into planes of
+    // (*shuffle)[i] wide values first (see shuffleBytes), 0 keeps them.
+    static bool packArrays (const std::vector<const array_t*>& arrays, int codec, int level,
+                            ThreadPool* pool, std::vector<packed_t>& packed,
+                            const std::vector<unsigned int>* shuffle = 0);
+    static unsigned long long packedBytes (const packed_t& p, bool wide);
+    static bool writePacked (FILE* f, const packed_t& p, bool wide);
+
+    // Point coordinates, 3 floats per point. With index point i is
+    // coords[index[i]], so grid points could be picked from the global
+    // nodes array without a copy.
+    void setPoints (const float* coords, size_t count, const unsigned int* index = 0);
+
+    // connectivity of count cells in local point IDs, offsets are the
+    // end positions of cells in connectivity, types are VTK cell types
+    void setCells (size_t count, const unsigned int* conn, const unsigned int* offsets,
+                   const unsigned char* types);
+
+    // arrays with tuple per point or per cell, setPoints and setCells
+    // must be called first
+    void addPointArray (const char* name, value_type_t type, unsigned int components,
+                        const void* data, const unsigned int* index = 0);
+    void addCellArray (const char* name, value_type_t type, unsigned int components,
+                       const void* data, const unsigned int* index = 0);
+
+    // Replaces values of point or cell array by codes with error at
+    // most bound (see quantizeValues), they are expanded back when file
+    // is written. False if array is kept as it was.
+    bool quantizeArray (const char* name, double bound, bool relative);
+
+    // storage for arrays computed while building the grid, freed
+    // together with the writer
+    void* allocate (size_t bytes);
+
+    template <typename T>
+    T* allocate (size_t count)
+        { return (T*)allocate (count * sizeof (T)); };
+
+    // appended data is compressed by codec (one VTK readers support),
+    // blocks are compressed in parallel on pool
+    void setCompression (int codec, int level = 0, ThreadPool* pool = 0);
+
+    bool write (const char* fileName);
+
+    // Writes .pvtu index of pieces written by writers with the same
+    // arrays as this one, sources are relative to the index file
+    bool writePVTU (const char* fileName, const std::vector<std::string>& sources) const;
+
+    size_t pointsCount () const
+        { return _points; };
+    size_t cellsCount () const
+        { return _cells; };
+
+    const array_t& points () const
+        { return _coords; };
+    const array_t& connectivity () const
+        { return _conn; };
+    const array_t& offsets () const
+        { return _offsets; };
+    const array_t& types () const
+        { return _types; };
+    const std::vector<array_t>& pointData () const
+        { return _pointData; };
+    const std::vector<array_t>& cellData () const
+        { return _cellData; };
+};
+
+
+#endif
@@ -0,0 +1,265 @@
+//
+// Round trip of states container: several states of two grids are
+// written by ArchiveWriter with the temporal filter on and every array
+// is read back bit-exactly by ArchiveReader, with and without the
+// index. States cover keyframe intervals, a field missing in one state
+// and a change of topology.
+//
+#include "archive.h"
+#include "archive_reader.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vector>
+
+#define STATES    10
+#define KEYFRAMES 4
+
+// state the topology of grid 0 changes in, and state grid 1 has no
+// "Strain" field in
+#define NEW_TOPOLOGY 6
+#define NO_STRAIN    5
+
+
+// one grid of one state, arrays stay alive until the state is read back
+typedef struct {
+    int state;
+    unsigned int grid;
+    uint64_t topologyKey;
+    size_t points, cells;
+    std::vector<float> coords, stress, strain, velocity;
+    std::vector<unsigned int> conn, offsets, partIDs;
+    std::vector<unsigned char> types;
+} grid_state_t;
+
+
+static void makeGrid (grid_state_t& g, int state, unsigned int grid)
+{
+    // grid 0 loses every other cell at NEW_TOPOLOGY (elements deleted)
+    bool eroded = grid == 0 && state >= NEW_TOPOLOGY;
+    size_t i;
+
+    g.state = state;
+    g.grid = grid;
+    g.topologyKey = eroded ? 2 : 1;
+    g.points = grid ? 3000 : 4000;
+    g.cells = g.points / 4 / (eroded ? 2 : 1);
+
+    // slowly moving points and fields, so XOR with previous state pays
+    g.coords.resize (g.points * 3);
+    g.velocity.resize (g.points * 3);
+    for (i = 0; i < g.coords.size (); i++) {
+        g.coords[i] = i * 0.01f + state * 1e-4f * sinf (i);
+        g.velocity[i] = cosf (i * 0.1f) * (1.0f + state * 1e-3f);
+    }
+
+    g.stress.resize (g.cells * 6);
+    g.strain.resize (grid && state == NO_STRAIN ? 0 : g.cells);
+    for (i = 0; i < g.stress.size (); i++)
+        g.stress[i] = 100.0f * sinf (i * 0.05f) + state;
+    for (i = 0; i < g.strain.size (); i++)
+        g.strain[i] = 1e-3f * i + state * 1e-5f;
+
+    g.conn.resize (g.cells * 4);
+    g.offsets.resize (g.cells);
+    g.partIDs.resize (g.cells);
+    g.types.resize (g.cells, 9);
+    for (i = 0; i < g.cells; i++) {
+        size_t cell = eroded ? i * 2 : i;
+
+        for (unsigned int j = 0; j < 4; j++)
+            g.conn[i * 4 + j] = cell * 4 + j;
+        g.offsets[i] = (i + 1) * 4;
+        g.partIDs[i] = 1 + cell % 3;
+    }
+}
+
+
+static void fillWriter (const grid_state_t& g, VTUWriter& vtu)
+{
+    vtu.setPoints (&g.coords[0], g.points);
+    vtu.setCells (g.cells, &g.conn[0], &g.offsets[0], &g.types[0]);
+    vtu.addCellArray ("PartID", VTUWriter::typeUInt32, 1, &g.partIDs[0]);
+    vtu.addCellArray ("Stress", VTUWriter::typeFloat32, 6, &g.stress[0]);
+    if (!g.strain.empty ())
+        vtu.addCellArray ("Strain", VTUWriter::typeFloat32, 1, &g.strain[0]);
+    vtu.addPointArray ("Velocity", VTUWriter::typeFloat32, 3, &g.velocity[0]);
+}
+
+
+// state starting a chain of XORed arrays of grid
+static bool keyframe (int state, unsigned int grid)
+{
+    int first = grid == 0 && state >= NEW_TOPOLOGY ? NEW_TOPOLOGY : 0;
+
+    return (state - first) % KEYFRAMES == 0;
+}
+
+
+// Array of reader must hold exactly size bytes of data, a range of
+// tuples in the middle is read on its own as well
+static size_t check (const ArchiveReader& r, const grid_state_t& g, const char* name,
+                     const void* data, size_t size)
+{
+    const archive_entry_t* e = r.find (g.state, g.grid, name);
+
+    if (!data) {
+        if (!e)
+            return 0;
+        printf ("  state %d grid %u: %s should not exist\n", g.state, g.grid, name);
+        return 1;
+    }
+
+    std::vector<char> buf (size + 1);
+
+    if (!e || ArchiveReader::rawBytes (*e) != size || !r.read (e, &buf[0]) ||
+        memcmp (&buf[0], data, size)) {
+        printf ("  state %d grid %u: %s differs\n", g.state, g.grid, name);
+        return 1;
+    }
+
+    size_t tuple = size / e->array.tuples;
+    uint64_t first = e->array.tuples / 3, count = e->array.tuples / 3;
+
+    memset (&buf[0], 0, buf.size ());
+    if (!r.read (e, &buf[0], first, count) ||
+        memcmp (&buf[0], (const char*)data + first * tuple, count * tuple)) {
+        printf ("  state %d grid %u: tuples %llu-%llu of %s differ\n", g.state, g.grid,
+                (unsigned long long)first, (unsigned long long)(first + count), name);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static size_t checkAll (const ArchiveReader& r, const std::vector<grid_state_t>& grids)
+{
+    size_t bad = 0;
+
+    if (r.statesCount () != STATES) {
+        printf ("  %zu states, expected %d\n", r.statesCount (), STATES);
+        bad++;
+    }
+
+    for (size_t i = 0; i < grids.size (); i++) {
+        const grid_state_t& g = grids[i];
+
+        bad += check (r, g, "Points", &g.coords[0], g.coords.size () * sizeof (float));
+        bad += check (r, g, "connectivity", &g.conn[0], g.conn.size () * sizeof (unsigned int));
+        bad += check (r, g, "offsets", &g.offsets[0], g.offsets.size () * sizeof (unsigned int));
+        bad += check (r, g, "types", &g.types[0], g.types.size ());
+        bad += check (r, g, "PartID", &g.partIDs[0], g.partIDs.size () * sizeof (unsigned int));
+        bad += check (r, g, "Stress", &g.stress[0], g.stress.size () * sizeof (float));
+        bad += check (r, g, "Strain", g.strain.empty () ? 0 : &g.strain[0],
+                      g.strain.size () * sizeof (float));
+        bad += check (r, g, "Velocity", &g.velocity[0], g.velocity.size () * sizeof (float));
+    }
+
+    return bad;
+}
+
+
+static size_t roundTrip (int codec)
+{
+    const char* fileName = "archive_test.d2l";
+    std::vector<grid_state_t> grids;
+    ArchiveWriter w;
+    size_t bad = 0;
+
+    printf ("%s:\n", codecName (codec));
+
+    if (!w.open (fileName)) {
+        printf ("  cannot create %s\n", fileName);
+        return 1;
+    }
+    w.setCompression (codec, 0);
+    w.setKeyframes (KEYFRAMES);
+
+    for (int s = 0; s < STATES; s++)
+        for (unsigned int grid = 0; grid < 2; grid++) {
+            grids.push_back (grid_state_t ());
+            grid_state_t& g = grids.back ();
+            VTUWriter vtu;
+
+            makeGrid (g, s, grid);
+            fillWriter (g, vtu);
+            if (!w.writeGrid (grid, g.topologyKey, s, s * 0.1f, vtu)) {
+                printf ("  cannot write state %d\n", s);
+                return 1;
+            }
+        }
+
+    if (!w.close ()) {
+        printf ("  cannot finish %s\n", fileName);
+        return 1;
+    }
+
+    ArchiveReader r;
+
+    if (!r.open (fileName)) {
+        printf ("  cannot open %s\n", fileName);
+        unlink (fileName);
+        return 1;
+    }
+
+    // the chain must actually be used, with references to the state
+    // before and restarted at keyframes
+    size_t xored = 0, revisions = 0;
+
+    for (size_t i = 0; i < r.entries ().size (); i++) {
+        const archive_entry_t& e = r.entries ()[i];
+
+        if (e.array.filter == filterXorPrevious) {
+            xored++;
+            if (e.array.reference != e.state - 1 || keyframe (e.state, e.grid)) {
+                printf ("  state %d: %s refers to state %d\n", e.state, e.array.name, e.array.reference);
+                bad++;
+            }
+        }
+        if (e.kind == blockTopology)
+            revisions++;
+    }
+
+    printf ("  %zu arrays XORed, %zu topology arrays\n", xored, revisions);
+    if (!xored || revisions != 3 * 4) {
+        printf ("  temporal filter or topology revisions not exercised\n");
+        bad++;
+    }
+
+    bad += checkAll (r, grids);
+    r.close ();
+
+    // without footer (writer killed) blocks are found by walking them
+    struct stat st;
+
+    if (stat (fileName, &st) || truncate (fileName, st.st_size - sizeof (archive_footer_t)) ||
+        !r.open (fileName)) {
+        printf ("  cannot open %s without index\n", fileName);
+        unlink (fileName);
+        return bad + 1;
+    }
+
+    bad += checkAll (r, grids);
+    r.close ();
+
+    unlink (fileName);
+    return bad;
+}
+
+
+int main ()
+{
+    size_t bad = 0;
+
+    for (int codec = codecZLib; codec < codecsCount; codec++)
+        if (codecAvailable (codec))
+            bad += roundTrip (codec);
+
+    printf (bad ? "FAILED\n" : "passed\n");
+    return bad ? 1 : 0;
+}
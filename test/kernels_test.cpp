@@ -0,0 +1,154 @@
+//
+// Accuracy test of vector tensorInvariants kernels against the scalar
+// double precision code. Every kernel supported by the CPU is run on
+// random and degenerate tensors.
+//
+#include "kernels.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+// Errors are relative to the largest component of the tensor. Principal
+// values (and shears built of them) are ill conditioned near repeated
+// roots, the rest is a couple of float roundings.
+#define TOL_PRINCIPAL 1e-4
+#define TOL_PLAIN     1e-5
+
+// outputs of one kernel run
+typedef struct {
+    std::vector<float> principal, vonMises, hydro, priShear, octShear;
+} invariants_t;
+
+
+static void run (invariants_fn fn, const std::vector<float>& tensors, invariants_t& res)
+{
+    size_t count = tensors.size () / 6;
+
+    res.principal.assign (count * 3, 0.0f);
+    res.vonMises.assign (count, 0.0f);
+    res.hydro.assign (count, 0.0f);
+    res.priShear.assign (count * 3, 0.0f);
+    res.octShear.assign (count, 0.0f);
+
+    fn (&tensors[0], count, &res.principal[0], &res.vonMises[0], &res.hydro[0],
+        &res.priShear[0], &res.octShear[0]);
+}
+
+
+// Number of values of output differing from reference by more than
+// tol * scale of their tensor, NaN must match NaN
+static size_t compare (const char* kernel, const char* output, const std::vector<float>& val,
+                       const std::vector<float>& ref, unsigned int components,
+                       const std::vector<double>& scale, double tol)
+{
+    size_t bad = 0;
+    double worst = 0;
+
+    for (size_t i = 0; i < ref.size (); i++) {
+        double s = scale[i / components];
+
+        if (isnan (ref[i]) || isnan (val[i])) {
+            if (isnan (ref[i]) != isnan (val[i]) && !bad++)
+                printf ("  %s %s[%zu]: %g, expected %g\n", kernel, output, i, val[i], ref[i]);
+            continue;
+        }
+
+        double err = fabs ((double)val[i] - ref[i]) / (s > 0 ? s : 1);
+
+        if (err > worst)
+            worst = err;
+        if (err > tol && !bad++)
+            printf ("  %s %s[%zu]: %g, expected %g\n", kernel, output, i, val[i], ref[i]);
+    }
+
+    printf ("  %-7s %-10s max error %.2e%s\n", kernel, output, worst, bad ? " FAILED" : "");
+    return bad;
+}
+
+
+static float randomValue (double magnitude)
+{
+    return (2.0 * rand () / RAND_MAX - 1.0) * magnitude;
+}
+
+
+static void append (std::vector<float>& tensors, float xx, float yy, float zz,
+                    float xy, float yz, float zx)
+{
+    float t[6] = { xx, yy, zz, xy, yz, zx };
+
+    tensors.insert (tensors.end (), t, t + 6);
+}
+
+
+int main ()
+{
+    std::vector<float> tensors;
+    unsigned int i;
+
+    srand (1);
+
+    // random tensors spanning 7 magnitudes
+    for (i = 0; i < 100000; i++) {
+        double m = pow (10.0, rand () % 7 - 3);
+
+        append (tensors, randomValue (m), randomValue (m), randomValue (m),
+                randomValue (m), randomValue (m), randomValue (m));
+    }
+
+    // degenerate ones: zeros, three and two equal eigenvalues, NaN
+    append (tensors, 0, 0, 0, 0, 0, 0);
+    append (tensors, 5, 5, 5, 0, 0, 0);
+    append (tensors, -2e3f, -2e3f, -2e3f, 0, 0, 0);
+    append (tensors, 1, 1, 3, 0, 0, 0);
+    append (tensors, 7, -1, -1, 0, 0, 0);
+    append (tensors, 1, 1, 1, 1, 0, 0);
+    append (tensors, 0, 0, 0, 1, 1, 1);
+    append (tensors, 1e-30f, 0, 0, 0, 0, 0);
+    append (tensors, NAN, 0, 0, 0, 0, 0);
+    append (tensors, 1, 2, 3, NAN, 0, 0);
+    append (tensors, NAN, NAN, NAN, NAN, NAN, NAN);
+
+    // odd count exercises tails of vector loops
+    append (tensors, 3, 1, 2, 0.5f, 0.25f, 0.125f);
+
+    size_t count = tensors.size () / 6;
+    std::vector<double> scale (count);
+
+    for (i = 0; i < count; i++)
+        for (unsigned int j = 0; j < 6; j++)
+            if (fabs (tensors[i * 6 + j]) > scale[i])
+                scale[i] = fabs (tensors[i * 6 + j]);
+
+    invariants_t ref;
+
+    run (tensorKernel ("scalar"), tensors, ref);
+
+    static const char* kernels[] = { "scalar", "avx2", "avx512" };
+    size_t bad = 0;
+
+    printf ("%zu tensors, tensorInvariants uses %s\n", count, tensorKernelName ());
+
+    for (i = 0; i < sizeof (kernels) / sizeof (kernels[0]); i++) {
+        invariants_fn fn = tensorKernel (kernels[i]);
+        invariants_t res;
+
+        if (!fn) {
+            printf ("  %-7s not supported, skipped\n", kernels[i]);
+            continue;
+        }
+
+        run (fn, tensors, res);
+
+        bad += compare (kernels[i], "principal", res.principal, ref.principal, 3, scale, TOL_PRINCIPAL);
+        bad += compare (kernels[i], "vonMises", res.vonMises, ref.vonMises, 1, scale, TOL_PLAIN);
+        bad += compare (kernels[i], "hydro", res.hydro, ref.hydro, 1, scale, TOL_PLAIN);
+        bad += compare (kernels[i], "priShear", res.priShear, ref.priShear, 3, scale, TOL_PRINCIPAL);
+        bad += compare (kernels[i], "octShear", res.octShear, ref.octShear, 1, scale, TOL_PRINCIPAL);
+    }
+
+    return bad ? 1 : 0;
+}
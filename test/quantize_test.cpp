@@ -0,0 +1,240 @@
+//
+// Error bound of quantized fields. Random and degenerate arrays are
+// quantized by QuantizeFilter bounds, absolute and % of range, written
+// to states container and expanded back by ArchiveReader. Every value
+// must be within the bound, arrays which cannot be quantized (not finite
+// values, bound out of reach of 16 bits) must come back bit-exactly.
+//
+#include "archive.h"
+#include "archive_reader.h"
+#include "options.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#define COUNT 10007
+
+// array, quantization of it by QuantizeFilter text and bits of codes
+// expected, 0 if array must be kept as it is
+typedef struct {
+    const char* array;
+    const char* bound;
+    unsigned int bits;
+} case_t;
+
+static const case_t cases[] = {
+    { "random",     "10",      8 },
+    { "random",     "0.1",     16 },
+    { "random",     "0.5%",    8 },
+    { "random",     "0.005%",  16 },
+    { "random",     "1e-4",    0 },     // 10^7 steps
+    { "magnitudes", "10",      8 },
+    { "magnitudes", "0.05%",   16 },
+    { "offset",     "0.5",     8 },     // bound near float rounding of values
+    { "offset",     "0.125",   16 },
+    { "offset",     "0.01",    0 },
+    { "offset",     "1%",      0 },
+    { "constant",   "0.1",     8 },
+    { "constant",   "1%",      8 },
+    { "zeros",      "1%",      8 },
+    { "single",     "1e-3",    8 },
+    { "extremes",   "1%",      8 },
+    { "extremes",   "1e30",    0 },
+    { "nan",        "10",      0 },
+    { "inf",        "10",      0 },
+    { "-inf",       "1%",      0 },
+};
+
+#define CASES (sizeof (cases) / sizeof (cases[0]))
+
+
+static float randomValue (double magnitude)
+{
+    return (2.0 * rand () / RAND_MAX - 1.0) * magnitude;
+}
+
+
+static void makeArray (const char* name, std::vector<float>& values)
+{
+    size_t i;
+
+    values.resize (strcmp (name, "single") ? COUNT : 1);
+
+    for (i = 0; i < values.size (); i++)
+        if (!strcmp (name, "magnitudes"))
+            values[i] = randomValue (pow (10.0, rand () % 7 - 3));
+        else if (!strcmp (name, "offset"))
+            values[i] = 1e6f + (i % 1000) * 0.01f;
+        else if (!strcmp (name, "constant"))
+            values[i] = 3.5f;
+        else if (!strcmp (name, "zeros"))
+            values[i] = 0.0f;
+        else if (!strcmp (name, "single"))
+            values[i] = 42.0f;
+        else if (!strcmp (name, "extremes"))
+            values[i] = i % 3 == 0 ? FLT_MAX : i % 3 == 1 ? -FLT_MAX : randomValue (1e38);
+        else
+            values[i] = randomValue (1000);
+
+    // one bad value somewhere in the middle
+    if (!strcmp (name, "nan"))
+        values[COUNT / 2] = NAN;
+    else if (!strcmp (name, "inf"))
+        values[COUNT / 2] = INFINITY;
+    else if (!strcmp (name, "-inf"))
+        values[COUNT / 2] = -INFINITY;
+}
+
+
+// absolute bound of case, relative ones are fractions of range
+static double absoluteBound (const QuantizeFilter& filter, const std::vector<float>& values)
+{
+    double lo = values[0], hi = values[0];
+
+    if (!filter.relative (0))
+        return filter.bound (0);
+
+    for (size_t i = 1; i < values.size (); i++) {
+        lo = fmin (lo, values[i]);
+        hi = fmax (hi, values[i]);
+    }
+
+    return filter.bound (0) * (hi - lo);
+}
+
+
+// Values read back whole and from the middle must be within bound of
+// the written ones, or the same bits for arrays kept as they were
+static size_t check (const ArchiveReader& r, int state, const case_t& c,
+                     const std::vector<float>& values, double bound)
+{
+    const archive_entry_t* e = r.find (state, 0, "F");
+    std::vector<float> read (values.size ()), part (values.size ());
+    uint64_t first = values.size () / 3, count = values.size () - first;
+
+    if (!e || e->array.tuples != values.size () || !r.read (e, &read[0]) ||
+        !r.read (e, &part[0], first, count)) {
+        printf ("  %s=%s: cannot read\n", c.array, c.bound);
+        return 1;
+    }
+
+    if (e->array.quantized != c.bits) {
+        printf ("  %s=%s: %u bit codes, expected %u\n", c.array, c.bound, e->array.quantized, c.bits);
+        return 1;
+    }
+
+    if (memcmp (&part[0], &read[first], count * sizeof (float))) {
+        printf ("  %s=%s: values from %llu differ\n", c.array, c.bound, (unsigned long long)first);
+        return 1;
+    }
+
+    if (!c.bits) {
+        if (memcmp (&read[0], &values[0], values.size () * sizeof (float))) {
+            printf ("  %s=%s: kept values differ\n", c.array, c.bound);
+            return 1;
+        }
+        printf ("  %-10s %-7s kept\n", c.array, c.bound);
+        return 0;
+    }
+
+    size_t bad = 0;
+    double worst = 0;
+
+    for (size_t i = 0; i < values.size (); i++) {
+        double err = fabs ((double)read[i] - values[i]);
+
+        if (!(err <= worst))
+            worst = err;
+        if (!(err <= bound) && !bad++)
+            printf ("  %s=%s [%zu]: %.9g, expected %.9g\n", c.array, c.bound, i, read[i], values[i]);
+    }
+
+    printf ("  %-10s %-7s %2u bits, max error %.3g of %.3g%s\n", c.array, c.bound, c.bits,
+            worst, bound, bad ? " FAILED" : "");
+    return bad;
+}
+
+
+int main ()
+{
+    const char* fileName = "quantize_test.d2l";
+    std::vector<std::vector<float> > values (CASES);
+    std::vector<double> bounds (CASES);
+    ArchiveWriter w;
+    size_t bad = 0;
+    int s;
+
+    srand (1);
+
+    if (!w.open (fileName)) {
+        printf ("cannot create %s\n", fileName);
+        return 1;
+    }
+    w.setCompression (codecZLib, 0);
+
+    // state per case, cells are vertices with a value each
+    for (s = 0; s < (int)CASES; s++) {
+        const case_t& c = cases[s];
+        std::string text = std::string ("F=") + c.bound;
+        QuantizeFilter filter;
+
+        makeArray (c.array, values[s]);
+
+        size_t cells = values[s].size ();
+        std::vector<float> coords (cells * 3, 0.0f);
+        std::vector<unsigned int> conn (cells), offsets (cells);
+        std::vector<unsigned char> types (cells, 1);
+        VTUWriter vtu;
+
+        for (size_t i = 0; i < cells; i++) {
+            conn[i] = i;
+            offsets[i] = i + 1;
+        }
+
+        if (!filter.append (text.c_str ())) {
+            printf ("  bad bound %s\n", text.c_str ());
+            bad++;
+            continue;
+        }
+        bounds[s] = absoluteBound (filter, values[s]);
+
+        vtu.setPoints (&coords[0], cells);
+        vtu.setCells (cells, &conn[0], &offsets[0], &types[0]);
+        vtu.addCellArray ("F", VTUWriter::typeFloat32, 1, &values[s][0]);
+
+        if (vtu.quantizeArray ("F", filter.bound (0), filter.relative (0)) != (c.bits != 0)) {
+            printf ("  %s=%s: %s\n", c.array, c.bound, c.bits ? "not quantized" : "quantized");
+            bad++;
+        }
+
+        if (!w.writeGrid (0, cells, s, s, vtu)) {
+            printf ("cannot write state %d\n", s);
+            unlink (fileName);
+            return 1;
+        }
+    }
+
+    ArchiveReader r;
+
+    if (!w.close () || !r.open (fileName)) {
+        printf ("cannot read %s back\n", fileName);
+        unlink (fileName);
+        return 1;
+    }
+
+    for (s = 0; s < (int)CASES; s++)
+        bad += check (r, s, cases[s], values[s], bounds[s]);
+
+    r.close ();
+    unlink (fileName);
+
+    printf (bad ? "FAILED\n" : "passed\n");
+    return bad ? 1 : 0;
+}